@@ -77,8 +77,7 @@ static void (*rx_handler)();
 void cdc_req_handler(req_t *req)
 {
     U8 i;
-    usb_pcb_t *pcb = usb_pcb_get();
-    
+
     switch (req->req)
     {
     case GET_LINE_CODING:
@@ -96,29 +95,10 @@ void cdc_req_handler(req_t *req)
     case SET_LINE_CODING:
         if (req->type & (HOST_TO_DEVICE | TYPE_CLASS | RECIPIENT_INTF))
         {
-            SI32_USB_A_clear_out_packet_ready_ep0( SI32_USB_0 );
-
-            while(pcb->fifo[EP_CTRL].len < req->len)
-            {
-                //ep_read(EP_CTRL);
-                i = pcb->fifo[EP_CTRL].len;
-            }
-
-
-            // clear the setup flag if needed
-            pcb->flags &= ~(1<<SETUP_DATA_AVAIL);
-
-            // send out a zero-length packet to ack to the host that we received
-            // the new line coding
-            ep_send_zlp(EP_CTRL);
-
-            // set the new line code. the first 8 bytes in the fifo are just
-            // for the setup packet so we want to write the next 7 bytes for the
-            // line code.
-            for (i=0; i<LINE_CODE_SZ; i++)
-            {
-                line_code[i] = usb_buf_read(EP_CTRL);
-            }
+            // have the control layer collect the new line coding straight into
+            // the line code array. it will send the zero-length status packet
+            // to ack the host once all the bytes have arrived.
+            ctrl_recv_data(line_code, (req->len < LINE_CODE_SZ) ? req->len : LINE_CODE_SZ, NULL);
         }
         break;
 
@@ -144,7 +124,10 @@ void cdc_req_handler(req_t *req)
 /**************************************************************************/
 void cdc_rx_handler()
 {
-    if (rx_handler)
+    usb_pcb_t *pcb = usb_pcb_get();
+
+    // on a composite device the rx data could be for another class
+    if (rx_handler && pcb->fifo[CDC_EP_OUT].len)
     {
         rx_handler();
     }
@@ -152,17 +135,16 @@ void cdc_rx_handler()
 
 /**************************************************************************/
 /*!
-    Initialize the endpoints according to the CDC class driver. The class
-    driver specifies a BULK IN, BULK OUT, and INTERRUPT IN endpoint. We will
-    usually set this after the host issues the set_configuration request.
+    Class init callback. The CDC class uses a BULK IN, BULK OUT, and INTERRUPT
+    IN endpoint. These are listed in the endpoint table in desc.c and get
+    configured by the usb core when the host issues the set_configuration
+    request, just before this is called.
 */
 /**************************************************************************/
 void cdc_ep_init()
 {
-    // setup the endpoints
-    ep_config(EP_1, XFER_BULK, DIR_IN, MAX_PACKET_SZ);
-    ep_config(EP_2, XFER_INTP, DIR_IN, MAX_PACKET_SZ);
-    ep_config(EP_3, XFER_BULK, DIR_OUT, MAX_PACKET_SZ);
+    // the endpoints are configured by the usb core from the endpoint table
+    // in desc.c. nothing class specific to do here.
 }
 
 /**************************************************************************/
@@ -209,6 +191,21 @@ int cdc_demo_putchar(char c, FILE *unused)
     return 0;
 }
 
+#if defined( USE_COMPOSITE )
+// class driver entry for a composite device. the CDC owns its two interfaces
+// and all three of its endpoints.
+static const usb_class_drvr_t cdc_drvr =
+{
+    CDC_INTF,
+    CDC_NUM_INTFS,
+    (1<<CDC_EP_IN) | (1<<CDC_EP_OUT) | (1<<CDC_EP_INTP),
+    cdc_ep_init,
+    cdc_req_handler,
+    cdc_rx_handler,
+    NULL
+};
+#endif
+
 /**************************************************************************/
 /*!
     Initialize the CDC class driver. We basically register our init, request handler,
@@ -221,6 +218,10 @@ void cdc_init()
     // for printf to work.
     //stdout = &file_str;
 
+#if defined( USE_COMPOSITE )
+    usb_reg_class(&cdc_drvr);
+#else
     usb_reg_class_drvr(cdc_ep_init, cdc_req_handler, cdc_rx_handler);
+#endif
 }
 
@@ -38,7 +38,11 @@
 #ifndef CDC_H
 #define CDC_H
 
+#include "desc.h"
+
+#ifndef NUM_EPS
 #define NUM_EPS             4
+#endif
 #define LINE_CODE_SZ        7
 
 // cdc definitions
@@ -61,14 +65,62 @@
 #define PARITY_MARK         3
 #define PARITY_SPACE        4
 
+// first of the two interfaces (comm and data) used by the CDC. a composite
+// device can move it by defining it in usb_composite.h.
+#ifndef CDC_INTF
+#define CDC_INTF            0
+#endif
+#define CDC_NUM_INTFS       2
+
 // ep definitions
 #define CDC_EP_IN           1
 #define CDC_EP_OUT          3
 #define CDC_EP_INTP         2
 
+// functional descriptors
+#define CS_INTERFACE        0x24
+#define CDC_HDR_FUNC        0x00
+#define CDC_CALL_MGMT_FUNC  0x01
+#define CDC_ACM_FUNC        0x02
+#define CDC_UNION_FUNC      0x06
+
 // misc
 #define LINE_CODE_LEN       7
 
+typedef struct DESC_PACKED
+{
+    U8  bFunctionLength;
+    U8  bDescriptorType;
+    U8  bDescriptorSubtype;
+    U16 bcdCDC;
+} cdc_hdr_func_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bFunctionLength;
+    U8  bDescriptorType;
+    U8  bDescriptorSubtype;
+    U8  bmCapabilities;
+    U8  bDataInterface;
+} cdc_call_mgmt_func_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bFunctionLength;
+    U8  bDescriptorType;
+    U8  bDescriptorSubtype;
+    U8  bmCapabilities;
+} cdc_acm_func_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bFunctionLength;
+    U8  bDescriptorType;
+    U8  bDescriptorSubtype;
+    U8  bMasterInterface;
+    U8  bSlaveInterface0;
+} cdc_union_func_desc_t;
+
 void cdc_init();
 void cdc_req_handler();
 void cdc_rx_handler();
@@ -39,174 +39,138 @@
 #include "hw.h"
 //#include <avr/pgmspace.h>
 
-U8 dev_desc[] PROGMEM =
+// interface numbers. the interface count in the cfg descriptor comes from here.
+enum
 {
-        0x12,       // bLength
-        DEV_DESCR,  // bDescriptorType
-        0x10,
-        0x01,       // bcdUSB: 0110 (1.1)
-        0x02,       // bDeviceClass: CDC
-        0x00,       // bDeviceSubClass: Get from cfg descr
-        0x00,       // bDeviceProtocol: Get from cfg descr
-        MAX_BUF_SZ, // bMaxPacketSize: MAX_BUF_SZ
-        0xC4,
-        0x10,       // idVendor: Silicon Laboratories Vendor ID (VID): 0x10C4
-        0x19,
-        0x88,       // idProduct: CDC PID: 0x8819
-        0x00,
-        0x01,       // bcdDevice: 0100 (v1.00)
-        1,          // Index of string descriptor describing manufacturer
-        2,          // Index of string descriptor describing product
-        3,          // Index of string descriptor describing the device's serial number
-        0x01        // bNumConfigurations
+    CDC_INTF_COMM = CDC_INTF,
+    CDC_INTF_DATA,
+    CDC_NUM_INTF
 };
 
+// endpoint definitions: ep num, direction, transfer type, max packet size. these
+// are used for both the endpoint descriptors and the endpoint table.
+#define CDC_EP_INTP_DESC    CDC_EP_INTP, DIR_IN,  XFER_INTP, PKTSZ_8
+#define CDC_EP_OUT_DESC     CDC_EP_OUT,  DIR_OUT, XFER_BULK, MAX_PACKET_SZ
+#define CDC_EP_IN_DESC      CDC_EP_IN,   DIR_IN,  XFER_BULK, MAX_PACKET_SZ
+
+// layout of the complete configuration descriptor. wTotalLength is the size of this.
+typedef struct DESC_PACKED
+{
+    usb_cfg_desc_t              cfg;
+    usb_intf_desc_t             comm_intf;
+    cdc_hdr_func_desc_t         hdr;
+    cdc_call_mgmt_func_desc_t   call_mgmt;
+    cdc_acm_func_desc_t         acm;
+    cdc_union_func_desc_t       union_func;
+    usb_ep_desc_t               comm_eps[1];
+    usb_intf_desc_t             data_intf;
+    usb_ep_desc_t               data_eps[2];
+} cdc_cfg_desc_t;
+
+const usb_dev_desc_t dev_desc PROGMEM = DESC_DEV(
+    0x0110,     // bcdUSB: 0110 (1.1)
+    0x02,       // bDeviceClass: CDC
+    0x00,       // bDeviceSubClass: Get from cfg descr
+    0x00,       // bDeviceProtocol: Get from cfg descr
+    0x10C4,     // idVendor: Silicon Laboratories Vendor ID (VID): 0x10C4
+    0x8819,     // idProduct: CDC PID: 0x8819
+    0x0100,     // bcdDevice: 0100 (v1.00)
+    1           // bNumConfigurations
+);
+
 // cfg descriptor
-U8 cfg_desc[] PROGMEM =
+const cdc_cfg_desc_t cfg_desc PROGMEM =
 {
-    // cfg descr
-    0x09,           // bLength: cfg desc len
-    CFG_DESCR,      // bDescriptorType: Configuration
-    0x43,           // wTotalLength: 0x43 (67 bytes = total size of cfg + sub descriptors)
-    0x00,
-    0x02,           // bNumInterfaces: 2 interface
-    0x01,           // bConfigurationValue: Configuration value
-    0x00,           // iConfiguration: Index of string descriptor describing the configuration
-    0xA0,           // bmAttributes: bus powered
-    0xFA,           // MaxPower 500 mA
-
-    // intf descr
-    0x09,           // bLength: Interface Descriptor size
-    INTF_DESCR,     // bDescriptorType: Interface
-    0x00,           // bInterfaceNumber: Number of Interface
-    0x00,           // bAlternateSetting: Alternate setting
-    0x01,           // bNumEndpoints: One endpoints used
-    0x02,           // bInterfaceClass: Communication Interface Class
-    0x02,           // bInterfaceSubClass: Abstract Control Model
-    0x01,           // bInterfaceProtocol: Common AT commands
-    0x00,           // iInterface:
+    .cfg = DESC_CFG(cdc_cfg_desc_t,
+        CDC_NUM_INTF,   // bNumInterfaces
+        0x01,           // bConfigurationValue: Configuration value
+        0xA0,           // bmAttributes: bus powered
+        0xFA            // MaxPower 500 mA
+    ),
+
+    .comm_intf = DESC_INTF(
+        CDC_INTF_COMM,  // bInterfaceNumber
+        0x00,           // bAlternateSetting: Alternate setting
+        DESC_COUNT(cdc_cfg_desc_t, comm_eps),
+        0x02,           // bInterfaceClass: Communication Interface Class
+        0x02,           // bInterfaceSubClass: Abstract Control Model
+        0x01,           // bInterfaceProtocol: Common AT commands
+        0x00            // iInterface
+    ),
 
     // hdr functional descr
-    0x05,           // bLength: Endpoint Descriptor size
-    0x24,           // bDescriptorType: CS_INTERFACE
-    0x00,           // bDescriptorSubtype: Header Func Desc
-    0x10,           // bcdCDC: spec release number 0110 (1.1)
-    0x01,
+    .hdr = { sizeof(cdc_hdr_func_desc_t), CS_INTERFACE, CDC_HDR_FUNC,
+        0x0110          // bcdCDC: spec release number 0110 (1.1)
+    },
 
     // call mgmt functional descriptors
-    0x05,           // bFunctionLength
-    0x24,           // bDescriptorType: CS_INTERFACE
-    0x01,           // bDescriptorSubtype: Call Management Func Desc
-    0x00,           // bmCapabilities: D0+D1
-    0x01,           // bDataInterface: 1
+    .call_mgmt = { sizeof(cdc_call_mgmt_func_desc_t), CS_INTERFACE, CDC_CALL_MGMT_FUNC,
+        0x00,           // bmCapabilities: D0+D1
+        CDC_INTF_DATA   // bDataInterface
+    },
 
     // acm functional descr
-    0x04,           // bFunctionLength
-    0x24,           // bDescriptorType: CS_INTERFACE
-    0x02,           // bDescriptorSubtype: Abstract Control Management desc
-    0x02,           // bmCapabilities
+    .acm = { sizeof(cdc_acm_func_desc_t), CS_INTERFACE, CDC_ACM_FUNC,
+        0x02            // bmCapabilities
+    },
 
     // union functional descr
-    0x05,           // bFunctionLength
-    0x24,           // bDescriptorType: CS_INTERFACE
-    0x06,           // bDescriptorSubtype: Union func desc
-    0x00,           // bMasterInterface: Communication class interface
-    0x01,           // bSlaveInterface0: Data Class Interface
-
-    // ep 2 descr
-    0x07,           // bLength: Endpoint Descriptor size
-    EP_DESCR,       // bDescriptorType: Endpoint
-    0x82,           // bEndpointAddress: (IN2)
-    0x03,           // bmAttributes: Interrupt
-    0x08,           // wMaxPacketSize:
-    0x00,
-    0xff,           // bInterval: 255 msec
-                    // not really using this endpoint for anything so just set
-                    // it to a fucking long interval
+    .union_func = { sizeof(cdc_union_func_desc_t), CS_INTERFACE, CDC_UNION_FUNC,
+        CDC_INTF_COMM,  // bMasterInterface: Communication class interface
+        CDC_INTF_DATA   // bSlaveInterface0: Data Class Interface
+    },
 
-    // data class intf descr
-    0x09,           // bLength: Interface Descriptor size
-    INTF_DESCR,     // bDescriptorType: interface descriptor
-    0x01,           // bInterfaceNumber: Number of Interface
-    0x00,           // bAlternateSetting: Alternate setting
-    0x02,           // bNumEndpoints: Two endpoints used
-    0x0A,           // bInterfaceClass: CDC
-    0x00,           // bInterfaceSubClass:
-    0x00,           // bInterfaceProtocol:
-    0x00,           // iInterface:
-
-    // ep 3 descr
-    0x07,           // bLength: Endpoint Descriptor size
-    EP_DESCR,       // bDescriptorType: Endpoint
-    0x03,           // bEndpointAddress: (OUT3)
-    0x02,           // bmAttributes: Bulk
-    MAX_BUF_SZ,     // wMaxPacketSize: MAX_BUF_SZ
-    0x00,
-    0x00,           // bInterval: ignore for Bulk transfer
-
-    // ep 1 descr
-    0x07,           // bLength: Endpoint Descriptor size
-    EP_DESCR,       // bDescriptorType: Endpoint
-    0x81,           // bEndpointAddress: (IN1)
-    0x02,           // bmAttributes: Bulk
-    MAX_BUF_SZ,     // wMaxPacketSize: MAX_BUF_SZ
-    0x00,
-    0x00            // bInterval: ignore for Bulk transfer
-};
+    // not really using the interrupt endpoint for anything so just set
+    // it to a fucking long interval (255 msec)
+    .comm_eps = {
+        DESC_EP(CDC_EP_INTP_DESC, 0xFF)
+    },
 
-U8 dev_qualifier_desc[] PROGMEM =
-{
-    0x0A,           // bLength
-    0x06,           // bDescriptorType: Device Qualifier
-    0x00,
-    0x02,           // bcdUSB Spec Version: 0200 (2.0)
-    0x02,           // bDeviceClass: CDC
-    0x00,           // bDeviceSubClass: Get from cfg descr
-    0x00,           // bDeviceProtocol: Get from cfg descr
-    MAX_BUF_SZ,     // bMaxPacketSize: MAX_BUF_SZ
-    0x01,           // bNumConfigurations: 1
-    0x00            // bReserved: Don't touch this or the device explodes
-};
+    // data class intf descr
+    .data_intf = DESC_INTF(
+        CDC_INTF_DATA,  // bInterfaceNumber
+        0x00,           // bAlternateSetting: Alternate setting
+        DESC_COUNT(cdc_cfg_desc_t, data_eps),
+        0x0A,           // bInterfaceClass: CDC
+        0x00,           // bInterfaceSubClass
+        0x00,           // bInterfaceProtocol
+        0x00            // iInterface
+    ),
 
-U8 lang_str_desc[] PROGMEM =
-{
-    0x4,        // bLength
-    STR_DESCR,  // bDescriptorType: String
-                // Language: English
-    0x09, 0x04
+    // bInterval is ignored for bulk transfers
+    .data_eps = {
+        DESC_EP(CDC_EP_OUT_DESC, 0x00),
+        DESC_EP(CDC_EP_IN_DESC, 0x00)
+    }
 };
 
-U8 vendor_str_desc[] PROGMEM =
+// endpoint table. the usb core configures these when the host sets the configuration.
+const usb_ep_cfg_t ep_tbl[] PROGMEM =
 {
-    0x26,       // bLength
-    STR_DESCR,  // bDescriptorType: String
-                // Manufacturer: "http://www.gsat.us"
-    'h',0, 't',0, 't',0, 'p',0, ':',0, '/',0, '/',0, 'w',0,
-    'w',0, 'w',0, '.',0, 'g',0, 's',0, 'a',0, 't',0, '.',0,
-    'u',0, 's',0
+    DESC_EP_CFG(CDC_EP_IN_DESC),
+    DESC_EP_CFG(CDC_EP_INTP_DESC),
+    DESC_EP_CFG(CDC_EP_OUT_DESC)
 };
 
+const usb_dev_qual_desc_t dev_qualifier_desc PROGMEM = DESC_DEV_QUAL(
+    0x0200,     // bcdUSB Spec Version: 0200 (2.0)
+    0x02,       // bDeviceClass: CDC
+    0x00,       // bDeviceSubClass: Get from cfg descr
+    0x00,       // bDeviceProtocol: Get from cfg descr
+    1           // bNumConfigurations
+);
 
+DESC_STR(lang_str_desc, "\u0409");     // Language: English (US)
+DESC_STR(vendor_str_desc, "http://www.gsat.us");
+DESC_STR(prod_str_desc, "GSatMicro Communications Port");
+DESC_STR(serial_str_desc, "Beta 0.50");
 
-U8 prod_str_desc[] PROGMEM =
-{
-    0x3C,      // bLength:
-    STR_DESCR, // bDescriptorType: String
-               // Product name: "GSatMicro Communications Port"
-
-    'G',0, 'S',0, 'a',0, 't',0, 'M',0, 'i',0, 'c',0, 'r',0,
-    'o',0, ' ',0, 'C',0, 'o',0, 'm',0, 'm',0, 'u',0, 'n',0,
-    'i',0, 'c',0, 'a',0, 't',0, 'i',0, 'o',0, 'n',0, 's',0,
-    ' ',0, 'P',0, 'o',0, 'r',0, 't',0
-};
-
-U8 serial_str_desc[] PROGMEM =
+static const U8 * const str_desc[] =
 {
-    0x14,       // bLength: 0x14 (20 bytes = sizeof str fields + string)
-    STR_DESCR,  // bDescriptorType: String
-                // Serial: Beta 0.50
-    'B',0, 'e',0, 't',0, 'a',0, ' ',0, '0',0, '.',0, '5',0,
-    '0',0,
+    (const U8 *)&lang_str_desc,
+    (const U8 *)&vendor_str_desc,
+    (const U8 *)&prod_str_desc,
+    (const U8 *)&serial_str_desc
 };
 
 /**************************************************************************/
@@ -216,18 +180,17 @@ U8 serial_str_desc[] PROGMEM =
 /**************************************************************************/
 U8 *desc_dev_get()
 {
-    return dev_desc;
+    return (U8 *)&dev_desc;
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the device descriptor. The length is stored in the
-    first byte of the device descriptor.
+    Return the length of the device descriptor.
 */
 /**************************************************************************/
 U8 desc_dev_get_len()
 {
-    return hw_flash_get_byte(dev_desc);
+    return sizeof(dev_desc);
 }
 
 /**************************************************************************/
@@ -237,19 +200,37 @@ U8 desc_dev_get_len()
 /**************************************************************************/
 U8 *desc_cfg_get()
 {
-    return cfg_desc;
+    return (U8 *)&cfg_desc;
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the configuration descriptor. The length of the complete
-    configuration descriptor is stored in the third byte of the config
-    descriptor.
+    Return the length of the complete configuration descriptor.
 */
 /**************************************************************************/
-U8 desc_cfg_get_len()
+U16 desc_cfg_get_len()
 {
-    return hw_flash_get_byte(cfg_desc + 2);
+    return sizeof(cfg_desc);
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the endpoint table for the configuration.
+*/
+/**************************************************************************/
+const usb_ep_cfg_t *desc_ep_tbl_get()
+{
+    return ep_tbl;
+}
+
+/**************************************************************************/
+/*!
+    Return the number of entries in the endpoint table.
+*/
+/**************************************************************************/
+U8 desc_ep_tbl_get_len()
+{
+    return sizeof(ep_tbl) / sizeof(ep_tbl[0]);
 }
 
 /**************************************************************************/
@@ -259,18 +240,58 @@ U8 desc_cfg_get_len()
 /**************************************************************************/
 U8 *desc_dev_qual_get()
 {
-    return dev_qualifier_desc;
+    return (U8 *)&dev_qualifier_desc;
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the device qualifier. The length is stored in the
-    first byte of the qualifier.
+    Return the length of the device qualifier.
 */
 /**************************************************************************/
 U8 desc_dev_qual_get_len()
 {
-    return hw_flash_get_byte(dev_qualifier_desc);
+    return sizeof(dev_qualifier_desc);
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the BOS descriptor. The CDC device reports USB 1.1
+    so it doesn't have one. Windows uses its inbox usbser driver for it.
+*/
+/**************************************************************************/
+U8 *desc_bos_get()
+{
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the BOS descriptor.
+*/
+/**************************************************************************/
+U16 desc_bos_get_len()
+{
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the MS OS 2.0 descriptor set.
+*/
+/**************************************************************************/
+U8 *desc_msos20_get()
+{
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the MS OS 2.0 descriptor set.
+*/
+/**************************************************************************/
+U16 desc_msos20_get_len()
+{
+    return 0;
 }
 
 /**************************************************************************/
@@ -280,39 +301,22 @@ U8 desc_dev_qual_get_len()
 /**************************************************************************/
 U8 *desc_str_get(U8 index)
 {
-    switch (index)
+    if (index >= (sizeof(str_desc) / sizeof(str_desc[0])))
     {
-    case LANG_DESC_IDX:
-        return (U8 *)lang_str_desc;
-    case MANUF_DESC_IDX:
-        return (U8 *)vendor_str_desc;
-    case PROD_DESC_IDX:
-        return (U8 *)prod_str_desc;
-    case SERIAL_DESC_IDX:
-        return (U8 *)serial_str_desc;
-    default:
         return NULL;
     }
+    return (U8 *)str_desc[index];
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the specified string descriptor.
+    Return the length of the specified string descriptor. The length is
+    the bLength field which gets filled in by the compiler.
 */
 /**************************************************************************/
 U8 desc_str_get_len(U8 index)
 {
-    switch (index)
-    {
-    case LANG_DESC_IDX:
-        return hw_flash_get_byte(lang_str_desc);
-    case MANUF_DESC_IDX:
-        return hw_flash_get_byte(vendor_str_desc);
-    case PROD_DESC_IDX:
-        return hw_flash_get_byte(prod_str_desc);
-    case SERIAL_DESC_IDX:
-        return hw_flash_get_byte(serial_str_desc);
-    default:
-        return 0;
-    }
+    U8 *desc = desc_str_get(index);
+
+    return (desc) ? hw_flash_get_byte(desc) : 0;
 }
@@ -37,129 +37,170 @@
 /*******************************************************************/
 #include "freakusb.h"
 #include "hw.h"
+#include "sim3u1xx.h"
 
-#define wTransferSize 64
+// interface numbers. the interface count in the cfg descriptor comes from here.
+enum
+{
+    DFU_INTF,
+    DFU_NUM_INTF
+};
 
-U8 dev_desc[] PROGMEM =
+// layout of the complete configuration descriptor. wTotalLength is the size of this.
+typedef struct DESC_PACKED
 {
-    0x12,       // bLength
-    DEV_DESCR,  // bDescriptorType
-    0x10,
-    0x01,       // bcdUSB: 0110 (1.1)
+    usb_cfg_desc_t      cfg;
+    usb_intf_desc_t     intf;
+#if defined( DFU_DFUSE )
+    usb_intf_desc_t     intf_dfuse;
+#endif
+    dfu_func_desc_t     dfu_func;
+} dfu_cfg_desc_t;
+
+// a host only asks for the BOS descriptor from a 2.01 or later device
+#if defined( USB_MSOS20 )
+#define DFU_BCD_USB     0x0201
+#else
+#define DFU_BCD_USB     0x0110
+#endif
+
+const usb_dev_desc_t dev_desc PROGMEM = DESC_DEV(
+    DFU_BCD_USB,    // bcdUSB: 0201 (2.01) with the BOS descriptor, 0110 (1.1) without
     0x00,       // bDeviceClass: Get from cfg descr
     0x00,       // bDeviceSubClass: Get from cfg descr
     0x00,       // bDeviceProtocol: Get from cfg descr
-    MAX_BUF_SZ, // bMaxPacketSize: MAX_BUF_SZ
-    0xC4,
-    0x10,       // idVendor: Silicon Laboratories Vendor ID (VID): 0x10C4
-    0x18,
-    0x88,       // idProduct: DFU PID: 0x8818
-    0x00,
-    0x01,       // bcdDevice: 0100 (v1.00)
-    0x01,          // Index of string descriptor describing manufacturer
-    0x02,          // Index of string descriptor describing product
-    0x03,          // Index of string descriptor describing the device's serial number
-    0x01        // bNumConfigurations
-};
+    0x10C4,     // idVendor: Silicon Laboratories Vendor ID (VID): 0x10C4
+    0x8818,     // idProduct: DFU PID: 0x8818
+    0x0100,     // bcdDevice: 0100 (v1.00)
+    1           // bNumConfigurations
+);
 
 // cfg descriptor (updated for DFU)
-U8 cfg_desc[27] PROGMEM =
+const dfu_cfg_desc_t cfg_desc PROGMEM =
 {
-    // cfg descr
-    0x09,           // bLength: cfg desc len
-    CFG_DESCR,      // bDescriptorType: Configuration
-    0x1B,           // wTotalLength: 0x24 (36 bytes = total size of cfg)
-    0x00,
-    0x01,           // bNumInterfaces: 1 interface
-    0x01,           // bConfigurationValue: Configuration value
-    0x00,           // iConfiguration: Index of string descriptor describing the configuration
-    0x80,           // bmAttributes: ??
-    0x32,           // MaxPower 100 mA
+    .cfg = DESC_CFG(dfu_cfg_desc_t,
+        DFU_NUM_INTF,   // bNumInterfaces
+        0x01,           // bConfigurationValue: Configuration value
+        0x80,           // bmAttributes: bus powered
+        0x32            // MaxPower 100 mA
+    ),
 
     // intf descr alternate 0
-    0x09,           // bLength: Interface Descriptor size
-    INTF_DESCR,     // bDescriptorType: Interface
-    0x00,           // bInterfaceNumber: Number of Interface
-    0x00,           // bAlternateSetting: Alternate setting
-    0x00,           // bNumEndpoints: zero endpoints
-    0xFE,           // bInterfaceClass: Device Firmware Upgrade
-    0x01,           // bInterfaceSubClass: ???
-    0x02,           // bInterfaceProtocol:  switched to 0x02 while in dfu_mode
-    0x04,           // iInterface:
-
-    0x09,           // blength = 7 Bytes
-    0x21,           // DFU Functional Descriptor
-    0x01,           // bmAttribute, can only download for now 
-    0xFF,           // DetachTimeOut= 255 ms
-    0xFF,
-    (wTransferSize & 0x00FF),
-    (wTransferSize & 0xFF00) >> 8,  // TransferSize = 1024 Byte
-    0x01,                           // bcdDFUVersion
-    0x00
+    .intf = DESC_INTF(
+        DFU_INTF,       // bInterfaceNumber
+        0x00,           // bAlternateSetting: Alternate setting
+        0x00,           // bNumEndpoints: zero endpoints
+        0xFE,           // bInterfaceClass: Device Firmware Upgrade
+        0x01,           // bInterfaceSubClass: ???
+        0x02,           // bInterfaceProtocol:  switched to 0x02 while in dfu_mode
+        0x04            // iInterface
+    ),
+
+#if defined( DFU_DFUSE )
+    // intf descr alternate 1. DfuSe, the memory layout is in its string.
+    .intf_dfuse = DESC_INTF(
+        DFU_INTF,       // bInterfaceNumber
+        DFU_ALT_DFUSE,  // bAlternateSetting: Alternate setting
+        0x00,           // bNumEndpoints: zero endpoints
+        0xFE,           // bInterfaceClass: Device Firmware Upgrade
+        0x01,           // bInterfaceSubClass: ???
+        0x02,           // bInterfaceProtocol:  switched to 0x02 while in dfu_mode
+        0x05            // iInterface
+    ),
+#endif
+
+    .dfu_func = {
+        sizeof(dfu_func_desc_t),
+        DFU_FUNC_DESCR,
+        0x01,           // bmAttribute, can only download for now
+        0xFFFF,         // DetachTimeOut= 65535 ms
+        DFU_XFER_SIZE,  // TransferSize
+        0x0001          // bcdDFUVersion
+    }
 };
 
-U8 dfu_functional_desc[] PROGMEM =
+#if defined( USB_MSOS20 )
+// BOS descriptor with the MS OS 2.0 platform capability
+typedef struct DESC_PACKED
 {
-    0x09,           // bLength
-    0x21,           // bDescriptorType: DFU Functional Descriptor
-    0x01,
-    0xFF,           // DetachTimeOut: 255 ms
-    0xFF,           // DetachTimeOut: 255 ms
-    (wTransferSize & 0x00FF),
-    (wTransferSize & 0xFF00) >> 8, /* TransferSize = 1024 Byte*/
-    0x01,                          /* bcdDFUVersion*/
-    0x00
-};
+    usb_bos_desc_t              bos;
+    usb_msos20_platform_desc_t  msos20;
+} dfu_bos_desc_t;
 
-U8 lang_str_desc[] PROGMEM =
+// MS OS 2.0 descriptor set. binds WinUSB to the device and gives it an
+// interface GUID so host tools can find it without an INF file.
+typedef struct DESC_PACKED
 {
-    0x4,        // bLength
-    STR_DESCR,  // bDescriptorType: String
-                // Language: English
-    0x09, 0x04
-};
+    usb_msos20_set_hdr_t        hdr;
+    usb_msos20_compat_id_t      compat_id;
+    usb_msos20_guid_prop_t      guid;
+} dfu_msos20_desc_t;
 
-U8 vendor_str_desc[] PROGMEM =
+const dfu_msos20_desc_t msos20_desc PROGMEM =
 {
-    0x26,       // bLength
-    STR_DESCR,  // bDescriptorType: String
-                // Manufacturer: "http://www.gsat.us"
-    'h',0, 't',0, 't',0, 'p',0, ':',0, '/',0, '/',0, 'w',0,
-    'w',0, 'w',0, '.',0, 'g',0, 's',0, 'a',0, 't',0, '.',0,
-    'u',0, 's',0
+    .hdr        = DESC_MSOS20_SET_HDR(dfu_msos20_desc_t),
+    .compat_id  = DESC_MSOS20_WINUSB,
+    .guid       = DESC_MSOS20_GUID("{C79EF45E-F0D0-44E7-8E0D-A6CB75E68E1E}")
 };
 
-U8 prod_str_desc[] PROGMEM =
+const dfu_bos_desc_t bos_desc PROGMEM =
 {
-    0x34,      // bLength: 0x3E (62 bytes = sizeof str fields + string)
-    STR_DESCR, // bDescriptorType: String
-               // Product name: "GSatMicro Firmware Upload"
-
-    'G',0, 'S',0, 'a',0, 't',0, 'M',0, 'i',0, 'c',0, 'r',0,
-    'o',0, ' ',0, 'F',0, 'i',0, 'r',0, 'm',0, 'w',0, 'a',0,
-    'r',0, 'e',0, ' ',0, 'U',0, 'p',0, 'l',0, 'o',0, 'a',0,
-    'd',0,
+    .bos        = DESC_BOS(dfu_bos_desc_t, 1),
+    .msos20     = DESC_MSOS20_PLATFORM(sizeof(dfu_msos20_desc_t))
 };
+#endif
+
+DESC_STR(lang_str_desc, "\u0409");     // Language: English (US)
+DESC_STR(vendor_str_desc, "http://www.gsat.us");
+DESC_STR(prod_str_desc, "GSatMicro Firmware Upload");
+
+DESC_STR(image_str_desc, "Application Image");
 
-extern U8 serial_str_desc[] PROGMEM;
-
-// U8 serial_str_desc[] PROGMEM =
-// {
-//     0x1C,       // bLength: 0x14 (20 bytes = sizeof str fields + string)
-//     STR_DESCR,  // bDescriptorType: String
-//                 // Serial: Beta 0.50
-// #if defined( PCB_V7 )
-//     'V',0,'0',0,'7',0,'-',0,
-// #elif defined( PCB_V8 )
-//     'V',0,'0',0,'8',0,'-',0,
-// #elif defined( PCB_V10 )
-//     'V',0,'1',0,'0',0,'-',0,
-// #else
-//     #error "No PCB Revision Selected"
-// #endif
-//     'B',0, 'e',0, 't',0, 'a',0, ' ',0, '0',0, '.',0, '5',0,
-//     '0',0,
-// };
+#if defined( DFU_DFUSE )
+// DfuSe memory layout: the application area, the config pages and the page
+// with the lock word. the bootloader isn't in it since it can't be read
+// back. 1K pages, 'a' is read only and 'g' is read, erase and write. only
+// the config pages and, with A/B slots, the slots can be written. of the
+// slots, dfu_dfuse_range_ok() only lets the one that isn't running be
+// written. the boot control page and whatever is left over behind it are
+// read only. has to match FLASH_TARGET, HW_SLOT_SIZE and HW_CONFIG_PAGES.
+#if defined( HW_AB_SLOTS )
+#if ( SI32_MCU_FLASH_SIZE == 0x0003FFFC )
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/240*001Kg,1*001Ka,2*001Kg,1*001Ka");
+#elif ( SI32_MCU_FLASH_SIZE == 0x00020000 )
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/112*001Kg,2*001Ka,2*001Kg");
+#elif ( SI32_MCU_FLASH_SIZE == 0x00010000 )
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/48*001Kg,2*001Ka,2*001Kg");
+#else
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/16*001Kg,2*001Ka,2*001Kg");
+#endif
+#else
+#if ( SI32_MCU_FLASH_SIZE == 0x0003FFFC )
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/241*001Ka,2*001Kg,1*001Ka");
+#elif ( SI32_MCU_FLASH_SIZE == 0x00020000 )
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/114*001Ka,2*001Kg");
+#elif ( SI32_MCU_FLASH_SIZE == 0x00010000 )
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/50*001Ka,2*001Kg");
+#else
+DESC_STR(dfuse_str_desc, "@Internal Flash /0x00003000/18*001Ka,2*001Kg");
+#endif
+#endif
+#endif
+
+// generated by version.pl
+extern const U8 serial_str_desc[] PROGMEM;
+
+static const U8 * const str_desc[] =
+{
+    (const U8 *)&lang_str_desc,
+    (const U8 *)&vendor_str_desc,
+    (const U8 *)&prod_str_desc,
+    serial_str_desc,
+    (const U8 *)&image_str_desc,
+#if defined( DFU_DFUSE )
+    (const U8 *)&dfuse_str_desc
+#endif
+};
 
 /**************************************************************************/
 /*!
@@ -168,18 +209,17 @@ extern U8 serial_str_desc[] PROGMEM;
 /**************************************************************************/
 U8 *desc_dev_get()
 {
-    return dev_desc;
+    return (U8 *)&dev_desc;
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the device descriptor. The length is stored in the
-    first byte of the device descriptor.
+    Return the length of the device descriptor.
 */
 /**************************************************************************/
 U8 desc_dev_get_len()
 {
-    return hw_flash_get_byte(dev_desc);
+    return sizeof(dev_desc);
 }
 
 /**************************************************************************/
@@ -189,40 +229,59 @@ U8 desc_dev_get_len()
 /**************************************************************************/
 U8 *desc_cfg_get()
 {
-    return cfg_desc;
+    return (U8 *)&cfg_desc;
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the configuration descriptor. The length of the complete
-    configuration descriptor is stored in the third byte of the config
-    descriptor.
+    Return the length of the complete configuration descriptor.
 */
 /**************************************************************************/
-U8 desc_cfg_get_len()
+U16 desc_cfg_get_len()
 {
-    return hw_flash_get_byte(cfg_desc + 2);
+    return sizeof(cfg_desc);
 }
 
 /**************************************************************************/
 /*!
-    Return a pointer to the device qualifier.
+    Return a pointer to the endpoint table for the configuration. DFU only
+    uses the control endpoint so there's nothing in it.
+*/
+/**************************************************************************/
+const usb_ep_cfg_t *desc_ep_tbl_get()
+{
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Return the number of entries in the endpoint table.
+*/
+/**************************************************************************/
+U8 desc_ep_tbl_get_len()
+{
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the DFU functional descriptor. This is the copy
+    that's embedded in the configuration descriptor.
 */
 /**************************************************************************/
 U8 *desc_dfu_func_get()
 {
-    return dfu_functional_desc;
+    return (U8 *)&cfg_desc.dfu_func;
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the device qualifier. The length is stored in the
-    first byte of the qualifier.
+    Return the length of the DFU functional descriptor.
 */
 /**************************************************************************/
 U8 desc_dfu_func_get_len()
 {
-    return hw_flash_get_byte(dfu_functional_desc);
+    return sizeof(cfg_desc.dfu_func);
 }
 
 /**************************************************************************/
@@ -237,8 +296,7 @@ U8 *desc_dev_qual_get()
 
 /**************************************************************************/
 /*!
-    Return the length of the device qualifier. The length is stored in the
-    first byte of the qualifier.
+    Return the length of the device qualifier.
 */
 /**************************************************************************/
 U8 desc_dev_qual_get_len()
@@ -246,6 +304,48 @@ U8 desc_dev_qual_get_len()
     return 0;
 }
 
+#if defined( USB_MSOS20 )
+/**************************************************************************/
+/*!
+    Return a pointer to the BOS descriptor.
+*/
+/**************************************************************************/
+U8 *desc_bos_get()
+{
+    return (U8 *)&bos_desc;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the BOS descriptor including the capabilities.
+*/
+/**************************************************************************/
+U16 desc_bos_get_len()
+{
+    return sizeof(bos_desc);
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the MS OS 2.0 descriptor set.
+*/
+/**************************************************************************/
+U8 *desc_msos20_get()
+{
+    return (U8 *)&msos20_desc;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the MS OS 2.0 descriptor set.
+*/
+/**************************************************************************/
+U16 desc_msos20_get_len()
+{
+    return sizeof(msos20_desc);
+}
+#endif
+
 /**************************************************************************/
 /*!
     Return a pointer to the specified string descriptor.
@@ -253,39 +353,22 @@ U8 desc_dev_qual_get_len()
 /**************************************************************************/
 U8 *desc_str_get(U8 index)
 {
-    switch (index)
+    if (index >= (sizeof(str_desc) / sizeof(str_desc[0])))
     {
-    case LANG_DESC_IDX:
-        return (U8 *)lang_str_desc;
-    case MANUF_DESC_IDX:
-        return (U8 *)vendor_str_desc;
-    case PROD_DESC_IDX:
-        return (U8 *)prod_str_desc;
-    case SERIAL_DESC_IDX:
-        return (U8 *)serial_str_desc;
-    default:
         return NULL;
     }
+    return (U8 *)str_desc[index];
 }
 
 /**************************************************************************/
 /*!
-    Return the length of the specified string descriptor.
+    Return the length of the specified string descriptor. The length is
+    the bLength field which gets filled in by the compiler.
 */
 /**************************************************************************/
 U8 desc_str_get_len(U8 index)
 {
-    switch (index)
-    {
-    case LANG_DESC_IDX:
-        return hw_flash_get_byte(lang_str_desc);
-    case MANUF_DESC_IDX:
-        return hw_flash_get_byte(vendor_str_desc);
-    case PROD_DESC_IDX:
-        return hw_flash_get_byte(prod_str_desc);
-    case SERIAL_DESC_IDX:
-        return hw_flash_get_byte(serial_str_desc);
-    default:
-        return 0;
-    }
+    U8 *desc = desc_str_get(index);
+
+    return (desc) ? hw_flash_get_byte(desc) : 0;
 }
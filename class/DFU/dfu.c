@@ -67,10 +67,18 @@
 /*******************************************************************/
 #include "freakusb.h"
 #include "dfu.h"
+#include "dfu_lz.h"
+#include "dfu_delta.h"
+#include "dfu_journal.h"
 #include "sim3u1xx.h"
 #include "sim3u1xx_Types.h"
 
-volatile U16 dfu_reset_counter = 10;         // 10 warnings are allowed
+static U32 dfu_wait_ms = DFU_WAIT_MS;           // how long a host gets to start talking DFU
+static U32 wait_start = 0;                      // hw_ms_get() when the wait started
+static U32 sof_ms = 0;                          // hw_ms_get() when the frame number last moved
+static U32 last_frame = 0;
+static U32 blink_ms = 0;                        // hw_ms_get() of the last countdown blink
+static U8 host_seen = 0;
 
 DFUStatus dfu_status;
 
@@ -78,13 +86,1138 @@ DFUStatus dfu_status;
 // and will handle any incoming data.
 static void (*rx_handler)();
 
-uint32_t flash_buffer[BLOCK_SIZE_U32];
-uint32_t* flash_buffer_ptr = flash_buffer;
+// page buffers. while one page is being written from the main loop, a chunk
+// at a time, the next block can be received from the host into the other
+// one. the page erase still holds everything up while it runs.
+uint32_t flash_buffer[DFU_NUM_BUFS][BLOCK_SIZE_U32];
+uint32_t* flash_buffer_ptr = flash_buffer[0];
 uint32_t flash_target = FLASH_TARGET;
 
-volatile U8 need_to_write = 0;
+static U8 image_slot = 0;                       // slot images are downloaded into
+static U32 image_base = FLASH_TARGET;           // where that slot starts
+
+static U8 fill_buf = 0;                         // buffer being filled by DNLOAD
+static U8 prog_buf = 0;                         // oldest full buffer, programmed next
+static volatile U8 prog_queue = 0;              // number of full buffers waiting to be programmed
+static U32 prog_len[DFU_NUM_BUFS];              // words to program from each full buffer
+static U32 prog_addr[DFU_NUM_BUFS];             // where each full buffer goes in flash
+static U32 page_ms = DFU_PAGE_PROG_MS;          // how long the last page took to program
+static U8 prog_busy = 0;                        // the page at prog_buf is erased and being written
+static U32 prog_word = 0;                       // words of that page written so far
+static U32 prog_start = 0;                      // hw_ms_get() when that page was started
+
 volatile U8 dfu_communication_started = 0;
 
+// the image CRC is computed as the blocks come in. the last few words might be
+// the trailer so they're held back until more data shows up behind them.
+static U32 crc_lag[HW_IMAGE_TRAILER_U32];
+static U8 crc_lag_idx = 0;
+static U8 crc_lag_cnt = 0;
+static U32 crc_len = 0;                         // bytes fed into the CRC so far
+
+#if defined( DFU_PACKED_IMAGES )
+// compressed and delta images. the host's blocks are received into pack_in
+// and unpacked into the page buffers from the main loop.
+static U8 pack_in[DFU_XFER_SIZE];
+static const U8 *pack_in_ptr = pack_in;
+static volatile U32 pack_in_len = 0;              // compressed bytes still to be unpacked
+static U32 pack_page_len = 0;                     // unpacked bytes in the page being filled
+static U8 pack_mode = DFU_PACK_NONE;              // how the image being downloaded is packed
+#endif
+#if defined( DFU_IMAGE_HEADER )
+static U8 dnload_first = 0;                     // the next block is the first of the image
+#endif
+static U16 dnload_block = 0;                    // wBlockNum expected for the next block
+static U32 dnload_start = 0;                    // hw_ms_get() when the download started
+
+#if defined( DFU_AES_KEY )
+// encrypted images are decrypted a page at a time by dfu_poll()
+static const U32 aes_key[4] PROGMEM = { DFU_AES_KEY };
+static const U8 aes_mac_label[DFU_AES_MAC_SZ] PROGMEM = DFU_AES_MAC_LABEL;
+static U8 aes_ctr[DFU_AES_CTR_SZ];              // counter block for the next page
+static U32 aes_mac[DFU_AES_MAC_SZ / 4];         // CMAC the image has to match, from its header
+static U32 aes_vector;                          // the image's reset vector, held back until the CMAC is checked
+static U32 aes_us = 0;                          // time it took to decrypt the last page
+static U8 dnload_aes = 0;                       // the image being downloaded is encrypted
+#else
+#define dnload_aes 0                            // images are never encrypted
+#endif
+
+static U32 upload_addr = FLASH_TARGET;          // next address to send to the host on DFU_UPLOAD
+static U32 upload_end = FLASH_TARGET;           // end of the application image being uploaded
+
+// erases run a page per dfu_poll(): DfuSe erase commands and the rest of the
+// slot after a download
+static volatile U32 erase_addr = FLASH_TARGET;  // next page of the erase that's in progress
+static volatile U32 erase_end = FLASH_TARGET;   // end of the erase that's in progress
+
+#if defined( DFU_DFUSE )
+// DfuSe alternate setting. the host moves the address pointer around and
+// erases the pages it's going to write, a whole range with one command.
+static U8 dfuse_mode = 0;                       // the DfuSe alternate setting is selected
+static U32 dfuse_addr = FLASH_TARGET;           // address pointer set by the host
+static U8 dfuse_cmd[DFUSE_CMD_MAX_SZ];          // the last command block
+static volatile U8 dfuse_cmd_busy = 0;          // a command came in and the host hasn't seen dnBUSY yet
+
+// commands reported for DfuSe's get command
+static const U8 dfuse_cmd_list[] PROGMEM =
+{
+    DFUSE_CMD_GET,
+    DFUSE_CMD_SET_ADDR,
+    DFUSE_CMD_ERASE,
+    DFUSE_CMD_READ_UNPROTECT
+};
+#else
+#define dfuse_mode 0                            // there's only the image alternate setting
+#endif
+
+/**************************************************************************/
+/*!
+    Start computing the CRC of a new image.
+*/
+/**************************************************************************/
+static void dfu_crc_start( void )
+{
+    crc_lag_idx = 0;
+    crc_lag_cnt = 0;
+    crc_len = 0;
+    hw_crc_start();
+}
+
+/**************************************************************************/
+/*!
+    Add the words of a block that just arrived to the image CRC. Each word
+    only goes into the CRC once it's known not to be part of the trailer.
+*/
+/**************************************************************************/
+static void dfu_crc_add( uint32_t *data, U32 count )
+{
+    for( ; count != 0; count-- )
+    {
+        if( crc_lag_cnt == HW_IMAGE_TRAILER_U32 )
+        {
+            hw_crc_add( &crc_lag[crc_lag_idx], 1 );
+            crc_len += 4;
+        }
+        else
+        {
+            crc_lag_cnt++;
+        }
+        crc_lag[crc_lag_idx] = *data++;
+        crc_lag_idx = ( crc_lag_idx + 1 ) % HW_IMAGE_TRAILER_U32;
+    }
+}
+
+/**************************************************************************/
+/*!
+    Check the CRC of the whole image against the trailer at the end of it.
+    The words still held back are the trailer, oldest first.
+*/
+/**************************************************************************/
+static U8 dfu_crc_ok( void )
+{
+    hw_image_trailer_t trailer;
+    U32 *word = ( U32* )&trailer;
+    U8 i;
+
+    if( crc_lag_cnt != HW_IMAGE_TRAILER_U32 )
+        return 0;
+
+    for( i = 0; i < HW_IMAGE_TRAILER_U32; i++ )
+    {
+        word[i] = crc_lag[( crc_lag_idx + i ) % HW_IMAGE_TRAILER_U32];
+    }
+
+    return ( trailer.magic == HW_IMAGE_CRC_MAGIC ) &&
+           ( trailer.len == crc_len ) &&
+           ( trailer.crc == hw_crc_result() );
+}
+
+/**************************************************************************/
+/*!
+    Hand the buffer that's being filled over to the main loop for programming
+    and start filling the other one.
+*/
+/**************************************************************************/
+static void dfu_queue_page( void )
+{
+    prog_len[fill_buf] = flash_buffer_ptr - flash_buffer[fill_buf];
+    prog_addr[fill_buf] = flash_target;
+
+    // an encrypted page is only decrypted by dfu_poll(). the image gets
+    // its CRC checked in flash during the manifest instead.
+    if( !dfuse_mode && !dnload_aes )
+    {
+        dfu_crc_add( flash_buffer[fill_buf], prog_len[fill_buf] );
+    }
+    prog_queue++;
+    flash_target += BLOCK_SIZE_U8;
+
+    fill_buf = ( fill_buf + 1 ) % DFU_NUM_BUFS;
+    flash_buffer_ptr = flash_buffer[fill_buf];
+}
+
+/**************************************************************************/
+/*!
+    Put the state machine into dfuERROR with status for the host to read
+    back with DFU_GETSTATUS.
+*/
+/**************************************************************************/
+static void dfu_error( U8 status )
+{
+    dfu_status.bState  = dfuERROR;
+    dfu_status.bStatus = status;
+    hw_state_indicator( HW_STATE_ERROR );
+}
+
+/**************************************************************************/
+/*!
+    Leave the outcome of the download in the boot mailbox for the image to
+    pick up after it's started.
+*/
+/**************************************************************************/
+static void dfu_mbox_update( U8 update_status )
+{
+    hw_mbox_t *mbox = hw_mbox_get();
+
+    if( update_status == HW_MBOX_UPDATE_STARTED )
+        dnload_start = hw_ms_get();
+
+    mbox->update_status = update_status;
+    mbox->update_error = dfu_status.bStatus;
+    mbox->update_slot = image_slot;
+    mbox->update_time_ms = hw_ms_since( dnload_start );
+    hw_mbox_commit();
+}
+
+/**************************************************************************/
+/*!
+    Drop any pages that haven't been programmed yet and start over at the
+    beginning of the first buffer.
+*/
+/**************************************************************************/
+static void dfu_reset_pages( void )
+{
+    fill_buf = 0;
+    prog_buf = 0;
+    prog_queue = 0;
+    prog_busy = 0;
+    flash_buffer_ptr = flash_buffer[0];
+
+#if defined( DFU_PACKED_IMAGES )
+    pack_in_len = 0;
+    pack_page_len = 0;
+#endif
+#if defined( DFU_AES_KEY )
+    dnload_aes = 0;
+#endif
+
+    // never anything but an address that's allowed to be erased
+    erase_addr = FLASH_TARGET;
+    erase_end = FLASH_TARGET;
+}
+
+/**************************************************************************/
+/*!
+    Fill in the poll timeout of the status. It's a 24 bit value in ms.
+*/
+/**************************************************************************/
+static void dfu_set_poll_timeout( U32 ms )
+{
+    dfu_status.bwPollTimeout0 = ms & 0xFF;
+    dfu_status.bwPollTimeout1 = ( ms >> 8 ) & 0xFF;
+    dfu_status.bwPollTimeout2 = ( ms >> 16 ) & 0xFF;
+}
+
+/**************************************************************************/
+/*!
+    Return how long the rest of the erase that's in progress will take.
+*/
+/**************************************************************************/
+static U32 dfu_erase_ms( void )
+{
+    if( erase_addr < erase_end )
+        return ( ( erase_end - erase_addr + FLASH_PAGE_SIZE_U8 - 1 ) / FLASH_PAGE_SIZE_U8 ) * page_ms;
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Called by the control layer once all the data for a DFU_DNLOAD block has
+    been received into the page buffer. Advance the buffer pointer and queue
+    the page for programming once it's full.
+*/
+/**************************************************************************/
+static void dfu_dnload_complete(req_t *req)
+{
+    U8 *tail = ( U8* )flash_buffer_ptr + req->len;
+#if defined( DFU_PACKED_IMAGES ) && !defined( DFU_AES_KEY )
+    U32 hdr = 4;
+#endif
+
+#if defined( DFU_IMAGE_HEADER )
+    // the first block says whether the image is encrypted or packed. if it's
+    // packed, move what follows the header over to the packed input.
+    if( dnload_first )
+    {
+        dnload_first = 0;
+#if defined( DFU_AES_KEY )
+        // with a key, nothing but an encrypted image goes in
+        if( ( req->len < 4 + DFU_AES_CTR_SZ + DFU_AES_MAC_SZ ) || ( flash_buffer_ptr[0] != DFU_AES_MAGIC ) )
+        {
+            dfu_error( errTARGET );
+            return;
+        }
+
+        // the header block doesn't go into flash. the next one starts
+        // the first page.
+        memcpy( aes_ctr, flash_buffer_ptr + 1, DFU_AES_CTR_SZ );
+        memcpy( aes_mac, ( U8* )flash_buffer_ptr + 4 + DFU_AES_CTR_SZ, DFU_AES_MAC_SZ );
+        hw_aes_start( aes_key );
+        dnload_aes = 1;
+        return;
+#else
+#if defined( DFU_LZ )
+        if( ( req->len >= 4 ) && ( flash_buffer_ptr[0] == DFU_LZ_MAGIC ) )
+        {
+            pack_mode = DFU_PACK_LZ;
+            dfu_lz_init();
+        }
+#endif
+#if defined( DFU_DELTA )
+        if( ( req->len >= DFU_DELTA_HDR_SZ ) && ( flash_buffer_ptr[0] == DFU_DELTA_MAGIC ) )
+        {
+            // a patch against anything but the image it was made from, or
+            // one that was cut off halfway and left the image broken, would
+            // only build garbage
+            if( 0 != dfu_delta_init( HW_SLOT_BASE( hw_slot_active_get() ), flash_buffer_ptr[1] ) )
+            {
+                dfu_error( errTARGET );
+                return;
+            }
+            pack_mode = DFU_PACK_DELTA;
+            hdr = DFU_DELTA_HDR_SZ;
+        }
+#endif
+
+        // without a key the header can only be for a packed image
+        if( pack_mode != DFU_PACK_NONE )
+        {
+            memcpy( pack_in, ( U8* )flash_buffer_ptr + hdr, req->len - hdr );
+            pack_in_ptr = pack_in;
+            pack_in_len = req->len - hdr;
+            return;
+        }
+#endif
+    }
+#endif
+
+#if defined( DFU_PACKED_IMAGES )
+    if( pack_mode != DFU_PACK_NONE )
+    {
+        pack_in_ptr = pack_in;
+        pack_in_len = req->len;
+        return;
+    }
+#endif
+
+    // the last block of an image doesn't have to be a multiple of 4 bytes.
+    // pad the partial word with erased flash so it gets written out too.
+    while( ( ( U32 )tail & 3 ) != 0 )
+    {
+        *tail++ = 0xFF;
+    }
+    flash_buffer_ptr = ( uint32_t* )tail;
+
+    if( flash_buffer_ptr == flash_buffer[fill_buf] + BLOCK_SIZE_U32 )
+    {
+        dfu_queue_page();
+    }
+}
+
+#if defined( DFU_PACKED_IMAGES )
+/**************************************************************************/
+/*!
+    Unpack the data in *in with the decoder for the image being downloaded.
+*/
+/**************************************************************************/
+static U32 dfu_pack_decode( const U8 **in, U32 *in_len, U8 *out, U32 out_len )
+{
+#if defined( DFU_LZ )
+    if( pack_mode == DFU_PACK_LZ )
+        return dfu_lz_decode( in, in_len, out, out_len );
+#endif
+#if defined( DFU_DELTA )
+    if( pack_mode == DFU_PACK_DELTA )
+        return dfu_delta_decode( in, in_len, out, out_len );
+#endif
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the decoder still has output to give without more input.
+*/
+/**************************************************************************/
+static U8 dfu_pack_pending( void )
+{
+#if defined( DFU_LZ )
+    if( pack_mode == DFU_PACK_LZ )
+        return dfu_lz_pending();
+#endif
+#if defined( DFU_DELTA )
+    if( pack_mode == DFU_PACK_DELTA )
+        return dfu_delta_pending();
+#endif
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the decoder stopped cleanly at the end of an op.
+*/
+/**************************************************************************/
+static U8 dfu_pack_done( void )
+{
+#if defined( DFU_LZ )
+    if( pack_mode == DFU_PACK_LZ )
+        return dfu_lz_done();
+#endif
+#if defined( DFU_DELTA )
+    if( pack_mode == DFU_PACK_DELTA )
+        return dfu_delta_done();
+#endif
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the decoder found bad data.
+*/
+/**************************************************************************/
+static U8 dfu_pack_error( void )
+{
+#if defined( DFU_LZ )
+    if( pack_mode == DFU_PACK_LZ )
+        return dfu_lz_error();
+#endif
+#if defined( DFU_DELTA )
+    if( pack_mode == DFU_PACK_DELTA )
+        return dfu_delta_error();
+#endif
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Finish the last page of a compressed or delta image by padding it out to a whole
+    word. Returns 0 if the compressed data ended in the middle of a token.
+*/
+/**************************************************************************/
+static U8 dfu_pack_flush( void )
+{
+    U8 *tail = ( U8* )flash_buffer[fill_buf] + pack_page_len;
+
+    if( !dfu_pack_done() )
+        return 0;
+
+    while( ( pack_page_len & 3 ) != 0 )
+    {
+        *tail++ = 0xFF;
+        pack_page_len++;
+    }
+    flash_buffer_ptr = flash_buffer[fill_buf] + pack_page_len / 4;
+    pack_page_len = 0;
+    return 1;
+}
+#endif
+
+/**************************************************************************/
+/*!
+    Check if there's packed data that still has to be unpacked into the
+    page buffers.
+*/
+/**************************************************************************/
+static U8 dfu_pack_busy( void )
+{
+#if defined( DFU_PACKED_IMAGES )
+    return ( pack_in_len != 0 ) || dfu_pack_pending();
+#else
+    return 0;
+#endif
+}
+
+/**************************************************************************/
+/*!
+    Check if the flash page at address already matches the page that would be
+    programmed: the first count words are the same as data and the rest of the
+    page is erased.
+*/
+/**************************************************************************/
+static U8 dfu_page_unchanged( U32 address, uint32_t *data, U32 count )
+{
+    U32 *word = ( U32* )address;
+    U32 i;
+
+    // word by word, which also keeps memcmp() out of the bootloader
+    for( i = 0; i < count; i++ )
+    {
+        if( word[i] != data[i] )
+            return 0;
+    }
+
+    return hw_flash_is_blank( address + count * 4, FLASH_PAGE_SIZE_U32 - count );
+}
+
+/**************************************************************************/
+/*!
+    Decide if it's time to give up on the host and start the image. With no
+    bus reset soon after the pull-up goes on, there's no host at all and the
+    image is started right away. With a host, it gets until dfu_wait_ms runs
+    out to start talking DFU, unless it stops sending SOFs before then.
+*/
+/**************************************************************************/
+static void dfu_wait_poll( void )
+{
+    U32 frame = hw_usb_frame_get();
+
+    if( dfu_communication_started || dfu_is_boot_pending() || ( dfu_wait_ms == DFU_WAIT_FOREVER ) )
+        return;
+
+    if( !host_seen )
+    {
+        if( hw_usb_reset_seen() )
+        {
+            host_seen = 1;
+            sof_ms = hw_ms_get();
+            last_frame = frame;
+        }
+        else if( hw_ms_since( wait_start ) >= DFU_HOST_DETECT_MS )
+        {
+            dfu_pend_boot_image();
+        }
+        return;
+    }
+
+    if( frame != last_frame )
+    {
+        last_frame = frame;
+        sof_ms = hw_ms_get();
+    }
+
+    if( ( ( hw_ms_since( sof_ms ) >= DFU_HOST_LOST_MS ) &&
+          ( hw_usb_reset_ms_since() >= DFU_HOST_RESET_MS ) ) ||
+        ( hw_ms_since( wait_start ) >= dfu_wait_ms ) )
+    {
+        dfu_pend_boot_image();
+    }
+    else if( hw_ms_since( blink_ms ) >= 1000 )
+    {
+        blink_ms += 1000;
+        hw_state_indicator( HW_STATE_COUNTDOWN );
+    }
+}
+
+/**************************************************************************/
+/*!
+    Program the oldest queued page. This needs to be called from the main
+    loop. The time it takes is measured and used for the poll timeout that's
+    reported to the host while both buffers are full. It also feeds the
+    watchdog and keeps track of how long to wait for the host.
+*/
+/**************************************************************************/
+void dfu_poll( void )
+{
+    U32 len, addr, chunk;
+
+    hw_watchdog_feed();
+    dfu_wait_poll();
+
+    // a DfuSe erase or the end of the slot after a download goes one page at
+    // a time so USB keeps getting serviced in between. the host was told how
+    // long the whole range takes. a page that's partly written goes in first.
+    if( ( erase_addr < erase_end ) && !prog_busy )
+    {
+        if( !hw_flash_is_blank( erase_addr, FLASH_PAGE_SIZE_U32 ) &&
+            ( 0 != hw_flash_erase( erase_addr, 1 ) ) )
+        {
+            erase_end = erase_addr;
+            dfu_error( errERASE );
+            return;
+        }
+        erase_addr += FLASH_PAGE_SIZE_U8;
+        return;
+    }
+
+#if defined( DFU_PACKED_IMAGES )
+
+    // unpack compressed data into the page buffers while there's room for it
+    while( dfu_pack_busy() && ( prog_queue < DFU_NUM_BUFS ) )
+    {
+        len = pack_in_len;
+        pack_page_len += dfu_pack_decode( &pack_in_ptr, &len, ( U8* )flash_buffer[fill_buf] + pack_page_len,
+                                          BLOCK_SIZE_U8 - pack_page_len );
+        pack_in_len = len;
+
+        if( dfu_pack_error() )
+        {
+            pack_in_len = 0;
+            dfu_error( errFILE );
+            break;
+        }
+
+        if( pack_page_len == BLOCK_SIZE_U8 )
+        {
+            flash_buffer_ptr = flash_buffer[fill_buf] + BLOCK_SIZE_U32;
+            pack_page_len = 0;
+            dfu_queue_page();
+        }
+    }
+#endif
+
+    if( prog_queue == 0 )
+        return;
+
+    addr = prog_addr[prog_buf];
+    len = prog_len[prog_buf];
+
+    if( !prog_busy )
+    {
+        // first step of a page: the checks and the erase. the writing is
+        // left for the next calls.
+        prog_busy = 1;
+        prog_word = 0;
+        prog_start = hw_ms_get();
+
+#if defined( DFU_AES_KEY )
+        // the decryption is timed along with the erase and the write, so
+        // page_ms and the poll timeouts the host gets cover it too. its own
+        // time goes to DFU_GET_TIMING.
+        if( dnload_aes )
+        {
+            aes_us = hw_us_get();
+            hw_aes_ctr( flash_buffer[prog_buf], len, aes_ctr );
+            aes_us = hw_us_get() - aes_us;
+
+            // without its reset vector the image fails its CRC and can't be
+            // booted, even if the power goes before the CMAC is checked
+            if( addr == image_base )
+            {
+                aes_vector = flash_buffer[prog_buf][1];
+                flash_buffer[prog_buf][1] = 0xFFFFFFFF;
+            }
+        }
+#endif
+
+        // an image has to fit in its slot. DfuSe writes were checked with
+        // dfu_dfuse_range_ok() when they came in.
+        if( !dfuse_mode && ( addr + len * 4 > image_base + HW_SLOT_SIZE ) )
+        {
+            dfu_error( errADDRESS );
+        }
+        else if( dfuse_mode )
+        {
+            // the host erases before writing with DfuSe so it isn't done here.
+            // a block doesn't have to start on a page either.
+            if( memcmp( ( void* )addr, flash_buffer[prog_buf], len * 4 ) == 0 )
+            {
+                prog_word = len;
+            }
+            else if( !hw_flash_is_blank( addr, len ) )
+            {
+                dfu_error( errCHECK_ERASED );
+            }
+        }
+        // leave the page alone if it already holds what we'd write. if it's blank,
+        // there's no need to erase it first.
+        else if( dfu_page_unchanged( addr, flash_buffer[prog_buf], len ) )
+        {
+            prog_word = len;
+        }
+        else if( !hw_flash_is_blank( addr, FLASH_PAGE_SIZE_U32 ) &&
+                 ( 0 != hw_flash_erase( addr, 1 ) ) )
+        {
+            dfu_error( errERASE );
+        }
+        else
+        {
+            return;
+        }
+    }
+    else
+    {
+        // program the page DFU_PROG_CHUNK_U32 words per call. the main loop
+        // gets to run usb_poll() in between, which takes in the data stage
+        // of the next block while this one is going in.
+        chunk = len - prog_word;
+        if( chunk > DFU_PROG_CHUNK_U32 )
+            chunk = DFU_PROG_CHUNK_U32;
+
+        if( 0 != hw_flash_write( addr + prog_word * 4, ( U32* )&flash_buffer[prog_buf][prog_word], chunk, 1 ) )
+        {
+            dfu_error( errVERIFY );
+        }
+        else
+        {
+            prog_word += chunk;
+            if( prog_word < len )
+                return;
+
+            // round up so the host never polls too early. skipped pages don't
+            // count since they say nothing about how long programming takes.
+            page_ms = hw_ms_since( prog_start ) + 1;
+        }
+    }
+
+#if defined( DFU_RESUME )
+    // a plain raw image can be resumed from the page after the last one
+    // that's in. an encrypted one would need its counter back.
+#if defined( DFU_PACKED_IMAGES )
+    if( !dfuse_mode && !dnload_aes && ( pack_mode == DFU_PACK_NONE ) && ( dfu_status.bState != dfuERROR ) )
+#else
+    if( !dfuse_mode && !dnload_aes && ( dfu_status.bState != dfuERROR ) )
+#endif
+    {
+        dfu_journal_commit( addr );
+    }
+#endif
+
+    prog_busy = 0;
+    prog_buf = ( prog_buf + 1 ) % DFU_NUM_BUFS;
+    prog_queue--;
+}
+
+#if defined( DFU_RESUME )
+/**************************************************************************/
+/*!
+    Return the block an interrupted download can be resumed from, going by
+    the journal. Blocks are one page (DFU_XFER_SIZE) each. Zero means there's
+    nothing to resume and the download has to start over.
+*/
+/**************************************************************************/
+static U16 dfu_resume_block_get( void )
+{
+#if defined( DFU_AES_KEY )
+    // a resumed download would skip the AES header and go in unencrypted
+    return 0;
+#else
+    dfu_journal_rec_t *last = dfu_journal_last();
+
+    if( ( last == NULL ) || ( last->done != 0 ) ||
+        ( last->addr < image_base ) || ( last->addr >= image_base + HW_SLOT_SIZE ) )
+        return 0;
+
+    return ( last->addr - image_base ) / BLOCK_SIZE_U8 + 1;
+#endif
+}
+
+/**************************************************************************/
+/*!
+    Pick up an interrupted raw download at block. Everything before it is
+    already in flash so the image CRC is brought up to date from there.
+*/
+/**************************************************************************/
+static void dfu_resume( U16 block )
+{
+    dfu_reset_pages();
+    flash_target = image_base + ( U32 )block * BLOCK_SIZE_U8;
+
+    dfu_crc_start();
+    dfu_crc_add( ( uint32_t* )image_base, ( U32 )block * BLOCK_SIZE_U32 );
+
+#if defined( DFU_PACKED_IMAGES )
+    pack_mode = DFU_PACK_NONE;
+#endif
+#if defined( DFU_IMAGE_HEADER )
+    dnload_first = 0;
+#endif
+    dnload_block = block;
+}
+#endif // DFU_RESUME
+
+/**************************************************************************/
+/*!
+    Return 1 if the image that was just downloaded was linked for the slot it
+    went into. Its reset vector has to point into the slot.
+*/
+/**************************************************************************/
+static U8 dfu_image_linked_ok( void )
+{
+    U32 entry = *( U32* )( image_base + 4 );
+
+    return ( entry >= image_base ) && ( entry < image_base + HW_SLOT_SIZE );
+}
+
+#if defined( DFU_AES_KEY )
+/**************************************************************************/
+/*!
+    Return 1 if the CMAC of the decrypted image in flash matches the one in
+    its header, so the image was made by someone who has the key. It's
+    checked in flash rather than page by page so it covers exactly what
+    will be booted. The first block still lacks the reset vector, that one
+    comes from aes_vector.
+*/
+/**************************************************************************/
+static U8 dfu_image_mac_ok( void )
+{
+    U32 key[4];
+    U32 mac[4];
+    U32 len = hw_image_end_get( image_base ) - image_base;
+
+    if( len <= sizeof( mac ) )
+        return 0;
+
+    memcpy( key, aes_mac_label, sizeof( key ) );
+    hw_aes_start( aes_key );
+    hw_aes_block( key );
+    hw_aes_start( key );
+
+    memcpy( mac, ( U32* )image_base, sizeof( mac ) );
+    mac[1] = aes_vector;
+    hw_aes_block( mac );
+    hw_aes_cmac( ( U32* )image_base + 4, ( len - sizeof( mac ) ) / 4, mac );
+    return ( 0 == memcmp( mac, aes_mac, sizeof( mac ) ) );
+}
+#endif
+
+/**************************************************************************/
+/*!
+    Handle the vendor requests on the DFU interface.
+*/
+/**************************************************************************/
+static void dfu_vendor_req( req_t *req )
+{
+#if defined( DFU_RESUME )
+    U16 block;
+#endif
+#if defined( HW_AB_SLOTS ) || defined( DFU_AES_KEY )
+    U8 i;
+#endif
+
+    switch( req->req )
+    {
+#if defined( DFU_RESUME )
+    case DFU_GET_RESUME:
+        if( req->type & DEVICE_TO_HOST )
+        {
+            block = dfu_resume_block_get();
+            usb_buf_write( EP_CTRL, block & 0xFF );
+            usb_buf_write( EP_CTRL, block >> 8 );
+            usb_buf_write( EP_CTRL, DFU_XFER_SIZE & 0xFF );
+            usb_buf_write( EP_CTRL, DFU_XFER_SIZE >> 8 );
+            ep_write( EP_CTRL );
+            return;
+        }
+        break;
+#endif
+
+#if defined( HW_AB_SLOTS )
+    case DFU_GET_SLOT:
+        if( req->type & DEVICE_TO_HOST )
+        {
+            usb_buf_write( EP_CTRL, image_slot );
+            usb_buf_write( EP_CTRL, HW_SLOTS );
+            for( i = 0; i < 32; i += 8 )
+            {
+                usb_buf_write( EP_CTRL, ( image_base >> i ) & 0xFF );
+            }
+            ep_write( EP_CTRL );
+            return;
+        }
+        break;
+#endif
+
+#if defined( DFU_AES_KEY )
+    case DFU_GET_TIMING:
+        if( req->type & DEVICE_TO_HOST )
+        {
+            for( i = 0; i < 32; i += 8 )
+            {
+                usb_buf_write( EP_CTRL, ( page_ms >> i ) & 0xFF );
+            }
+            for( i = 0; i < 32; i += 8 )
+            {
+                usb_buf_write( EP_CTRL, ( aes_us >> i ) & 0xFF );
+            }
+            ep_write( EP_CTRL );
+            return;
+        }
+        break;
+#endif
+    }
+    ep_set_stall( EP_CTRL );
+}
+
+#if defined( DFU_DFUSE )
+/**************************************************************************/
+/*!
+    Get a little endian 32 bit value out of a command block.
+*/
+/**************************************************************************/
+static U32 dfu_get_u32( const U8 *p )
+{
+    return ( U32 )p[0] | ( ( U32 )p[1] << 8 ) | ( ( U32 )p[2] << 16 ) | ( ( U32 )p[3] << 24 );
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if DfuSe may erase and write [addr, end). That's the config
+    pages and, with A/B slots, the slot that isn't running. The bootloader,
+    the journal page, the boot control page and the running
+    image are off limits.
+*/
+/**************************************************************************/
+static U8 dfu_dfuse_range_ok( U32 addr, U32 end )
+{
+    // with an AES key, images only go in encrypted through alternate setting 0
+#if defined( HW_AB_SLOTS ) && !defined( DFU_AES_KEY )
+    U32 slot = HW_SLOT_BASE( hw_slot_update_get() );
+
+    if( ( addr >= slot ) && ( end <= slot + HW_SLOT_SIZE ) && ( end > addr ) )
+        return 1;
+#endif
+    return ( addr >= HW_CONFIG_START ) && ( end <= HW_CONFIG_END ) && ( end > addr );
+}
+
+/**************************************************************************/
+/*!
+    Called by the control layer once a DfuSe command block is in. Setting the
+    address pointer is done right away. An erase is only checked and set up
+    here, the pages get erased from dfu_poll().
+*/
+/**************************************************************************/
+static void dfu_dfuse_cmd_complete( req_t *req )
+{
+    U32 addr = 0, end = 0;
+    U8 status = OK;
+
+    if( req->len >= 5 )
+    {
+        addr = dfu_get_u32( &dfuse_cmd[1] );
+    }
+
+    switch( dfuse_cmd[0] )
+    {
+    case DFUSE_CMD_SET_ADDR:
+        if( ( req->len != 5 ) || ( addr >= SI32_MCU_FLASH_SIZE ) )
+        {
+            status = errADDRESS;
+            break;
+        }
+        dfuse_addr = addr;
+        break;
+
+    case DFUSE_CMD_ERASE:
+        // the command byte alone is a mass erase of the slot that isn't
+        // running. without A/B slots that's nothing, the image only goes in
+        // through alternate setting 0. an end address after the page address
+        // erases the whole range in one go, which DfuSe itself doesn't have.
+        if( req->len == 1 )
+        {
+            addr = HW_SLOT_BASE( hw_slot_update_get() );
+            end = ( HW_SLOTS > 1 ) ? addr + HW_SLOT_SIZE : addr;
+        }
+        else if( req->len == 5 )
+        {
+            addr &= ~( FLASH_PAGE_SIZE_U8 - 1 );
+            end = addr + FLASH_PAGE_SIZE_U8;
+        }
+        else if( req->len == 9 )
+        {
+            addr &= ~( FLASH_PAGE_SIZE_U8 - 1 );
+            end = dfu_get_u32( &dfuse_cmd[5] );
+        }
+        else
+        {
+            status = errSTALLEDPKT;
+            break;
+        }
+
+        if( !dfu_dfuse_range_ok( addr, end ) )
+        {
+            status = errADDRESS;
+            break;
+        }
+
+#if defined( DFU_RESUME )
+        // whatever was left of an interrupted download is gone now
+        if( addr < HW_CONFIG_START )
+        {
+            dfu_journal_clear();
+        }
+#endif
+        erase_addr = addr;
+        erase_end = end;
+        break;
+
+    case DFUSE_CMD_READ_UNPROTECT:
+        // the lock word lives in the last page, which is off limits. taking
+        // the lock off is left to the debugger.
+        status = errTARGET;
+        break;
+
+    default:
+        status = errSTALLEDPKT;
+        break;
+    }
+
+    if( status != OK )
+    {
+        dfu_error( status );
+        return;
+    }
+    dfuse_cmd_busy = 1;
+}
+
+/**************************************************************************/
+/*!
+    Called by the control layer once a DfuSe data block is in. Every block is
+    queued on its own since it goes wherever the address pointer says.
+*/
+/**************************************************************************/
+static void dfu_dfuse_dnload_complete( req_t *req )
+{
+    U8 *tail = ( U8* )flash_buffer_ptr + req->len;
+
+    while( ( ( U32 )tail & 3 ) != 0 )
+    {
+        *tail++ = 0xFF;
+    }
+    flash_buffer_ptr = ( uint32_t* )tail;
+    dfu_queue_page();
+}
+
+/**************************************************************************/
+/*!
+    DFU_DNLOAD on the DfuSe alternate setting. Block 0 is a command. Blocks
+    from 2 on are data that goes at the address pointer plus (block - 2)
+    transfers. A zero length block leaves DFU and boots the image.
+*/
+/**************************************************************************/
+static void dfu_dfuse_dnload( req_t *req )
+{
+    U32 addr;
+
+    if( ( dfu_status.bState != dfuIDLE ) && ( dfu_status.bState != dfuDNLOAD_IDLE ) )
+    {
+        dfu_error( errSTALLEDPKT );
+        ep_set_stall(EP_CTRL);
+        return;
+    }
+
+    if( req->len == 0 )
+    {
+        dfu_status.bState = dfuMANIFEST_SYNC;
+        ep_send_zlp(EP_CTRL);
+        return;
+    }
+
+    if( dfu_status.bState == dfuIDLE )
+    {
+        hw_state_indicator( HW_STATE_TRANSFER );
+        dfu_reset_pages();
+        dfu_mbox_update( HW_MBOX_UPDATE_STARTED );
+    }
+
+    if( ( req->val == 0 ) && ( req->len <= sizeof( dfuse_cmd ) ) )
+    {
+        dfu_status.bState = dfuDNLOAD_SYNC;
+        ctrl_recv_data( dfuse_cmd, req->len, dfu_dfuse_cmd_complete );
+        return;
+    }
+
+    addr = dfuse_addr + ( U32 )( req->val - 2 ) * DFU_XFER_SIZE;
+    if( ( req->val < 2 ) || ( prog_queue >= DFU_NUM_BUFS ) || ( req->len > BLOCK_SIZE_U8 ) )
+    {
+        dfu_error( errSTALLEDPKT );
+        ep_set_stall(EP_CTRL);
+        return;
+    }
+
+    if( ( addr & 3 ) || !dfu_dfuse_range_ok( addr, addr + req->len ) )
+    {
+        dfu_error( errADDRESS );
+        ep_set_stall(EP_CTRL);
+        return;
+    }
+
+    flash_target = addr;
+    dfu_status.bState = dfuDNLOAD_SYNC;
+    ctrl_recv_data( ( U8* )flash_buffer_ptr, req->len, dfu_dfuse_dnload_complete );
+}
+
+/**************************************************************************/
+/*!
+    DFU_UPLOAD on the DfuSe alternate setting. Block 0 is the list of
+    commands. Blocks from 2 on are read from the address pointer plus
+    (block - 2) transfers, anywhere above the bootloader. The bootloader
+    holds the AES key so it can't be read back. With a key, only the config
+    pages can be, the images went in encrypted and stay private.
+*/
+/**************************************************************************/
+static void dfu_dfuse_upload( req_t *req )
+{
+    U32 addr, len = 0;
+
+    if( ( dfu_status.bState != dfuIDLE ) && ( dfu_status.bState != dfuUPLOAD_IDLE ) )
+    {
+        dfu_error( errSTALLEDPKT );
+        ep_set_stall(EP_CTRL);
+        return;
+    }
+
+    usb_buf_clear_fifo(EP_CTRL);
+
+    if( req->val == 0 )
+    {
+        len = ( req->len < sizeof( dfuse_cmd_list ) ) ? req->len : sizeof( dfuse_cmd_list );
+        ctrl_send_data( ( U8* )dfuse_cmd_list, len, req->len, true );
+        return;
+    }
+
+    addr = dfuse_addr + ( U32 )( req->val - 2 ) * DFU_XFER_SIZE;
+#if defined( DFU_AES_KEY )
+    if( ( req->val >= 2 ) && ( addr >= HW_CONFIG_START ) && ( addr < HW_CONFIG_END ) )
+    {
+        len = HW_CONFIG_END - addr;
+    }
+#else
+    if( ( req->val >= 2 ) && ( addr >= FLASH_TARGET ) && ( addr < SI32_MCU_FLASH_SIZE ) )
+    {
+        len = SI32_MCU_FLASH_SIZE - addr;
+    }
+#endif
+
+    // a short block ends the upload
+    if( len >= req->len )
+    {
+        len = req->len;
+        dfu_status.bState = dfuUPLOAD_IDLE;
+    }
+    else
+    {
+        dfu_status.bState = dfuIDLE;
+    }
+    ctrl_send_data( ( U8* )addr, len, req->len, true );
+}
+
+/**************************************************************************/
+/*!
+    Select the alternate setting of the DFU interface. Only allowed while
+    nothing is going on.
+*/
+/**************************************************************************/
+static bool dfu_set_intf( U8 intf, U8 alt )
+{
+    if( ( alt > DFU_ALT_DFUSE ) ||
+        ( ( dfu_status.bState != dfuIDLE ) && ( dfu_status.bState != dfuERROR ) ) )
+        return false;
+
+    dfuse_mode = ( alt == DFU_ALT_DFUSE );
+    return true;
+}
+#endif
+
 /**************************************************************************/
 /*!
     This is the class specific request handler for the USB Comm-unications Device
@@ -105,7 +1238,13 @@ volatile U8 dfu_communication_started = 0;
 void dfu_req_handler(req_t *req)
 {
     U8 i;
-    usb_pcb_t *pcb = usb_pcb_get();
+    U32 erase_ms;
+
+    if( ( req->type & TYPE_MASK ) == TYPE_VENDOR )
+    {
+        dfu_vendor_req( req );
+        return;
+    }
 
     switch (req->req)
     {
@@ -127,23 +1266,58 @@ void dfu_req_handler(req_t *req)
             // wvalue is wBlockNum
             // wlength is Length
             // data is firmware
+#if defined( DFU_DFUSE )
+            if( dfuse_mode )
+            {
+                dfu_dfuse_dnload( req );
+                return;
+            }
+#endif
+
             if( dfu_status.bState == dfuIDLE )
             {
-                if( req->len > 0 )
+                if( ( req->len > 0 ) && ( req->val == 0 ) )
+                {
+                    hw_state_indicator( HW_STATE_TRANSFER );
+                    dfu_reset_pages();
+#if defined( DFU_RESUME )
+                    dfu_journal_clear();
+#endif
+                    flash_target = image_base;
+                    dfu_crc_start();
+#if defined( DFU_PACKED_IMAGES )
+                    pack_mode = DFU_PACK_NONE;
+#endif
+#if defined( DFU_IMAGE_HEADER )
+                    dnload_first = 1;
+#endif
+                    dnload_block = 0;
+                    dfu_mbox_update( HW_MBOX_UPDATE_STARTED );
+                    dfu_status.bState = dfuDNLOAD_SYNC;
+                }
+#if defined( DFU_RESUME )
+                else if( ( req->len > 0 ) && ( req->val == dfu_resume_block_get() ) )
                 {
+                    // the host is picking up where an interrupted download left off
                     hw_state_indicator( HW_STATE_TRANSFER );
+                    dfu_resume( req->val );
+                    dfu_mbox_update( HW_MBOX_UPDATE_STARTED );
                     dfu_status.bState = dfuDNLOAD_SYNC;
                 }
+#endif
+                else if( req->len > 0 )
+                {
+                    dfu_error( errADDRESS );
+                    ep_set_stall(EP_CTRL);
+                    return;
+                }
                 else
                 {
-                    dfu_status.bState  = dfuERROR;
-                    dfu_status.bStatus = errNOTDONE;
-                    hw_state_indicator( HW_STATE_ERROR );
+                    dfu_error( errNOTDONE );
                     ep_send_zlp(EP_CTRL);
                     return;
                 }
             }
-        	i = req->val;
             if( dfu_status.bState == dfuDNLOAD_IDLE )
             {
                 if( req->len > 0 )
@@ -152,53 +1326,79 @@ void dfu_req_handler(req_t *req)
                 }
                 else
                 {
-                    if( flash_buffer_ptr > flash_buffer )
+#if defined( DFU_PACKED_IMAGES )
+                    U8 complete = ( pack_mode == DFU_PACK_NONE ) || dfu_pack_flush();
+#else
+                    U8 complete = 1;
+#endif
+
+                    // queue whatever is left of the last page
+                    if( flash_buffer_ptr > flash_buffer[fill_buf] )
+                    {
+                        dfu_queue_page();
+                    }
+                    // the pages still get programmed but an image that
+                    // doesn't match its trailer will never be booted
+                    if( complete && ( dnload_aes || dfu_crc_ok() ) )
+                    {
+                        dfu_status.bState  = dfuMANIFEST_SYNC;
+                    }
+                    else
                     {
-                        need_to_write = 1;
-                        //flash_buffer_ptr = flash_buffer;
+                        dfu_error( errFILE );
                     }
-                    dfu_status.bState  = dfuMANIFEST_SYNC;
                     ep_send_zlp(EP_CTRL);
                     return;
                 }
             }
 
-            SI32_USB_A_clear_out_packet_ready_ep0(SI32_USB_0);
-
-            while(pcb->fifo[EP_CTRL].len < req->len)
+            // the blocks have to come in order. a missing block would shift
+            // the rest of the image.
+            if( req->val != dnload_block )
             {
-                //ep_read(EP_CTRL);
-            	i = pcb->fifo[EP_CTRL].len;
+                dfu_error( errADDRESS );
+                ep_set_stall(EP_CTRL);
+                return;
             }
+            dnload_block++;
 
-            // clear the setup flag if needed
-            pcb->flags &= ~(1<<SETUP_DATA_AVAIL);
-
-            // send out a zero-length packet to ack to the host that we received
-            // the new line coding
-            U8* byte_buf_ptr = ( U8* )flash_buffer_ptr;
-            U8 tmp_len = pcb->fifo[EP_CTRL].len;
-            for(i = 0; i < tmp_len; i++)
+#if defined( DFU_PACKED_IMAGES )
+            if( pack_mode != DFU_PACK_NONE )
             {
-                *byte_buf_ptr = usb_buf_read(EP_CTRL);
-                byte_buf_ptr++;
+                // the host has to wait until the last block has been unpacked
+                if( dfu_pack_busy() || ( req->len > sizeof( pack_in ) ) )
+                {
+                    dfu_error( errSTALLEDPKT );
+                    ep_set_stall(EP_CTRL);
+                    return;
+                }
+
+                ctrl_recv_data( pack_in, req->len, dfu_dnload_complete );
+                return;
             }
-            flash_buffer_ptr += i/4;
+#endif
 
-            if( flash_buffer_ptr == flash_buffer + BLOCK_SIZE_U32 )
+            // the host has to wait for a free buffer before sending the next block
+            if( prog_queue >= DFU_NUM_BUFS )
             {
-                // Reset buffer pointer
-                //flash_buffer_ptr = flash_buffer;
-                need_to_write = 1;
+                dfu_error( errSTALLEDPKT );
+                ep_set_stall(EP_CTRL);
+                return;
             }
 
-            if( flash_buffer_ptr > flash_buffer + BLOCK_SIZE_U32)
+            // the block has to fit in what's left of the page buffer
+            if( ( U8* )flash_buffer_ptr + req->len > ( U8* )( flash_buffer[fill_buf] + BLOCK_SIZE_U32 ) )
             {
-                dfu_status.bState  = dfuERROR;
-                hw_state_indicator( HW_STATE_ERROR );
+                dfu_error( errADDRESS );
+                ep_set_stall(EP_CTRL);
+                return;
             }
 
-            ep_send_zlp(EP_CTRL);
+            // have the control layer collect the block straight into the page
+            // buffer. a block can be up to DFU_XFER_SIZE (one page) so it
+            // arrives over several EP0 packets. dfu_dnload_complete() runs once
+            // the whole block is in.
+            ctrl_recv_data( ( U8* )flash_buffer_ptr, req->len, dfu_dnload_complete );
         }
         break;
 
@@ -208,8 +1408,52 @@ void dfu_req_handler(req_t *req)
             // wvalue is zero
             // wlength is length
             // data is firmware
-            // NOT SUPPORTED
+            U32 len;
+
+#if defined( DFU_DFUSE )
+            if( dfuse_mode )
+            {
+                dfu_dfuse_upload( req );
+                return;
+            }
+#endif
+
+#if defined( DFU_AES_KEY )
+            // the image went in encrypted. reading it back would hand it
+            // out in the clear.
+            dfu_error( errSTALLEDPKT );
             ep_set_stall(EP_CTRL);
+            return;
+#endif
+
+            if( dfu_status.bState == dfuIDLE )
+            {
+                upload_addr = HW_SLOT_BASE( hw_slot_active_get() );
+                upload_end  = hw_image_end_get( upload_addr );
+                dfu_status.bState = dfuUPLOAD_IDLE;
+            }
+            else if( dfu_status.bState != dfuUPLOAD_IDLE )
+            {
+                dfu_error( errSTALLEDPKT );
+                ep_set_stall(EP_CTRL);
+                return;
+            }
+
+            // the block is sent straight out of flash. a block that's shorter
+            // than what the host asked for ends the upload.
+            len = upload_end - upload_addr;
+            if( len >= req->len )
+            {
+                len = req->len;
+            }
+            else
+            {
+                dfu_status.bState = dfuIDLE;
+            }
+
+            usb_buf_clear_fifo(EP_CTRL);
+            ctrl_send_data( ( U8* )upload_addr, len, req->len, true );
+            upload_addr += len;
         }
         break;
 
@@ -220,46 +1464,116 @@ void dfu_req_handler(req_t *req)
                 hw_state_indicator( HW_STATE_CONNECTED );
 
             dfu_communication_started = 1;
-            // If we're still transmitting blocks
-            if( dfu_status.bState == dfuDNLOAD_SYNC )
+            erase_ms = dfu_erase_ms();
+
+            // If we're still transmitting blocks. the next block can come in as
+            // soon as there's a free buffer and the last compressed block has
+            // been unpacked. otherwise, tell the host how long it takes for the
+            // oldest page to get programmed.
+            if( dfu_status.bState == dfuDNLOAD_SYNC ||
+                dfu_status.bState == dfuDNBUSY )
             {
-                if( need_to_write == 0 )
+#if defined( DFU_DFUSE )
+                if( dfuse_cmd_busy )
                 {
-                    dfu_status.bState=dfuDNLOAD_IDLE;
-                    dfu_status.bwPollTimeout0 = 0x00;
+                    // a DfuSe host wants to see dnBUSY after a command. an
+                    // erase of any size is covered by a single poll timeout.
+                    dfuse_cmd_busy = 0;
+                    dfu_status.bState = dfuDNBUSY;
+                    dfu_set_poll_timeout( erase_ms );
                 }
                 else
+#endif
+                if( ( prog_queue < DFU_NUM_BUFS ) && !dfu_pack_busy() && ( erase_ms == 0 ) )
                 {
-                	dfu_status.bState=dfuDNBUSY;
-                    dfu_status.bwPollTimeout0 = 0x3F;
+                    dfu_status.bState = dfuDNLOAD_IDLE;
+                    dfu_set_poll_timeout( 0 );
+                }
+                else
+                {
+                    dfu_status.bState = dfuDNBUSY;
+                    dfu_set_poll_timeout( ( erase_ms != 0 ) ? erase_ms : page_ms );
                 }
             }
-            else if( dfu_status.bState == dfuDNBUSY )
+#if defined( DFU_DFUSE )
+            else if( ( dfu_status.bState == dfuMANIFEST_SYNC ) && dfuse_mode )
             {
-                if( need_to_write == 0)
-                    dfu_status.bState=dfuDNLOAD_SYNC;
+                // a DfuSe host only asks once after leaving so finish up now.
+                // there's no tail to erase and no image CRC to check since
+                // the host could have written anything anywhere.
+                while( prog_queue != 0 )
+                {
+                    dfu_poll();
+                }
+                if( dfu_status.bState != dfuERROR )
+                {
+                    dfu_mbox_update( HW_MBOX_UPDATE_DONE );
+                    dfu_status.bState = dfuMANIFEST_WAIT_RESET;
+                    hw_state_indicator( HW_STATE_DONE );
+                }
             }
+#endif
             else if( dfu_status.bState == dfuMANIFEST_SYNC)
             {
-            	dfu_status.bState=dfuMANIFEST;
-                dfu_status.bwPollTimeout0 = 0xFF;
+                // Finish erasing the slot from dfu_poll() so this request
+                // doesn't hold up the control endpoint for the whole of it.
+                // the last pages are all queued by now so the erase starts
+                // right behind them. only the pages that still hold
+                // something need it. the other slot and the config pages
+                // stay as they are.
+                erase_addr = flash_target;
+                erase_end = image_base + HW_SLOT_SIZE;
+                dfu_status.bState=dfuMANIFEST;
+                dfu_set_poll_timeout( prog_queue * page_ms + dfu_erase_ms() + 1 );
                 hw_state_indicator( HW_STATE_DONE );
             }
-            else if( dfu_status.bState == dfuMANIFEST &&
-                     need_to_write == 0)
+            else if( dfu_status.bState == dfuMANIFEST )
             {
-                // Finish erasing flash
-                while( flash_target < SI32_MCU_FLASH_SIZE)
+                if( ( prog_queue == 0 ) && ( erase_ms == 0 ) )
                 {
-                    if( 0 != hw_flash_erase( flash_target, 1 ) )
+#if defined( DFU_AES_KEY )
+                    // the reset vector only goes in once the image turns out
+                    // to be made with our key
+                    if( dnload_aes &&
+                        ( !dfu_image_mac_ok() || ( 0 != hw_flash_write( image_base + 4, &aes_vector, 1, 1 ) ) ) )
+                    {
+                        dfu_error( errVERIFY );
+                    }
+#endif
+                    // make sure what ended up in flash is what boot will accept
+                    if( ( dfu_status.bState == dfuMANIFEST ) && !hw_image_crc_ok( image_base ) )
+                    {
+                        dfu_error( errVERIFY );
+                    }
+                    else if( ( dfu_status.bState == dfuMANIFEST ) && !dfu_image_linked_ok() )
+                    {
+                        dfu_error( errTARGET );
+                    }
+                    if( dfu_status.bState == dfuMANIFEST )
                     {
-                        dfu_status.bState  = dfuERROR;
-                        dfu_status.bStatus = errERASE;
-                        hw_state_indicator( HW_STATE_ERROR );
+                        // the new image gets booted on trial
+                        hw_slot_trial( image_slot );
+#if defined( DFU_RESUME )
+                        // there's nothing left to resume
+                        dfu_journal_clear();
+#endif
+                        dfu_mbox_update( HW_MBOX_UPDATE_DONE );
+                        dfu_status.bState=dfuMANIFEST_WAIT_RESET;
                     }
-                    flash_target += BLOCK_SIZE_U8;
                 }
-                dfu_status.bState=dfuMANIFEST_WAIT_RESET;
+                else
+                {
+                    // the last pages are still being programmed or the end
+                    // of the slot erased
+                    dfu_set_poll_timeout( prog_queue * page_ms + erase_ms + 1 );
+                }
+            }
+
+            // a download that went wrong is reported to the image as well
+            if( ( dfu_status.bState == dfuERROR ) &&
+                ( hw_mbox_get()->update_status == HW_MBOX_UPDATE_STARTED ) )
+            {
+                dfu_mbox_update( HW_MBOX_UPDATE_FAILED );
             }
 
             for (i=0; i<STATUS_SZ; i++)
@@ -270,29 +1584,13 @@ void dfu_req_handler(req_t *req)
 
             if( dfu_status.bState == dfuMANIFEST_WAIT_RESET )
             {
-                hw_wait_ms(200);
+                // only wait for the status to be taken, not a fixed time
+                hw_ctrl_wait_sent( HW_CTRL_SENT_TIMEOUT_MS );
+                hw_delay_ms( HW_CTRL_STATUS_MS );
                 hw_boot_image( 1 );
-            }
 
-            if( need_to_write )
-            {
-                if( 0 != hw_flash_erase( flash_target, 1 ) )
-                {
-                    dfu_status.bState  = dfuERROR;
-                    dfu_status.bStatus = errERASE;
-                    hw_state_indicator( HW_STATE_ERROR );
-                }
-                if( 0 != hw_flash_write( flash_target, ( U32* )flash_buffer, flash_buffer_ptr - flash_buffer, 1 ) )
-                {
-                    dfu_status.bState  = dfuERROR;
-                    dfu_status.bStatus = errVERIFY;
-                    hw_state_indicator( HW_STATE_ERROR );
-                }
-                flash_buffer_ptr = flash_buffer;
-                flash_target += BLOCK_SIZE_U8;
-                need_to_write = 0;
-                if( dfu_status.bState != dfuMANIFEST )
-                    dfu_status.bState=dfuDNLOAD_SYNC;
+                // only comes back if there's no image that's fit to boot
+                dfu_error( errFIRMWARE );
             }
         }
         break;
@@ -335,15 +1633,19 @@ void dfu_req_handler(req_t *req)
                 dfu_status.bStatus = OK;
                 dfu_status.bState = dfuIDLE;
             }
+            else if( dfu_status.bState == dfuUPLOAD_IDLE )
+            {
+                dfu_status.bStatus = OK;
+                dfu_status.bState = dfuIDLE;
+                ep_send_zlp(EP_CTRL);
+            }
             else if ( dfu_status.bState == dfuDNLOAD_IDLE )
             {
-                flash_target = FLASH_TARGET;
-                if( 0 != hw_flash_erase( flash_target, 1 ) )
-                {
-                    dfu_status.bState  = dfuERROR;
-                    dfu_status.bStatus = errERASE;
-                    hw_state_indicator( HW_STATE_ERROR );
-                }
+                // the pages that are already in stay there. the image won't
+                // boot until it's complete since its CRC won't match, and with
+                // DFU_RESUME the download can be resumed from the journal.
+                dfu_reset_pages();
+                flash_target = image_base;
                 dfu_status.bStatus = OK;
                 dfu_status.bState = dfuIDLE;
                 ep_send_zlp(EP_CTRL);
@@ -383,6 +1685,10 @@ void dfu_ep_init()
 {
     // setup the endpoints
 
+#if defined( DFU_DFUSE )
+    // a new configuration starts out on the default alternate setting
+    dfuse_mode = 0;
+#endif
 }
 
 /**************************************************************************/
@@ -411,6 +1717,61 @@ int dfu_is_boot_pending( void )
     return dfu_pending_boot;
 }
 
+/**************************************************************************/
+/*!
+    Return 1 if dfu_poll() still has flash work to do, so the main loop
+    shouldn't go to sleep waiting for USB.
+*/
+/**************************************************************************/
+int dfu_is_busy( void )
+{
+    return ( erase_addr < erase_end ) || ( prog_queue != 0 ) || dfu_pack_busy();
+}
+
+/**************************************************************************/
+/*!
+    Return the ms from now until the hw_ms_get() time t, zero if it's
+    already gone by.
+*/
+/**************************************************************************/
+static U32 dfu_ms_until( U32 t )
+{
+    S32 left = ( S32 )( t - hw_ms_get() );
+
+    return ( left > 0 ) ? ( U32 )left : 0;
+}
+
+/**************************************************************************/
+/*!
+    Return how long the main loop can sleep before dfu_poll() needs to look
+    at the wait for the host again, in ms. That's the next timeout or the
+    next countdown blink. DFU_WAIT_FOREVER once nothing is timed.
+*/
+/**************************************************************************/
+U32 dfu_sleep_ms( void )
+{
+    U32 ms, lost, reset;
+
+    if( dfu_communication_started || dfu_is_boot_pending() || ( dfu_wait_ms == DFU_WAIT_FOREVER ) )
+        return DFU_WAIT_FOREVER;
+
+    if( !host_seen )
+        return dfu_ms_until( wait_start + DFU_HOST_DETECT_MS );
+
+    // the host only counts as gone once both its SOFs and its last bus
+    // reset are far enough back
+    lost = dfu_ms_until( sof_ms + DFU_HOST_LOST_MS );
+    reset = hw_usb_reset_ms_since();
+    if( ( reset < DFU_HOST_RESET_MS ) && ( lost < DFU_HOST_RESET_MS - reset ) )
+        lost = DFU_HOST_RESET_MS - reset;
+
+    ms = dfu_ms_until( wait_start + dfu_wait_ms );
+    if( ms > lost )
+        ms = lost;
+    lost = dfu_ms_until( blink_ms + 1000 );
+    return ( ms < lost ) ? ms : lost;
+}
+
 
 /**************************************************************************/
 /*!
@@ -420,12 +1781,26 @@ int dfu_is_boot_pending( void )
 /**************************************************************************/
 void dfu_init()
 {
+    hw_mbox_boot_reason_set();
+
+    image_slot = hw_slot_update_get();
+    image_base = HW_SLOT_BASE( image_slot );
+
     if( hw_check_skip_bootloader() )
         hw_boot_image( 0 );
 
-    // For software resets, extend the DFU countdown
-    if( hw_check_extend_bootloader() )
-        dfu_reset_counter = 30;
+    switch( hw_check_extend_bootloader() )
+    {
+    case HW_EXTEND_DFU_DETACH:
+        // The application sent us here through its DFU runtime interface so
+        // the host is about to start a download. Wait for it without a countdown.
+        dfu_wait_ms = DFU_WAIT_FOREVER;
+        break;
+    case HW_EXTEND_SW_RESET:
+        // For other software resets, extend the DFU countdown
+        dfu_wait_ms = DFU_WAIT_SW_RESET_MS;
+        break;
+    }
 
     // Otherwise prep for loading
     dfu_status.bStatus = OK;
@@ -435,13 +1810,18 @@ void dfu_init()
     dfu_status.bState = dfuIDLE;
     dfu_status.iString = 0x00;          /* all strings must be 0x00 until we make them! */
 
-    if( ( *( volatile uint32_t* ) FLASH_TARGET ) == 0xFFFFFFFF )
+    if( ( *( volatile uint32_t* ) HW_SLOT_BASE( hw_slot_active_get() ) ) == 0xFFFFFFFF )
     {
-        dfu_reset_counter = 0xFFFF;
+        dfu_wait_ms = DFU_WAIT_FOREVER;
     }
 
+    wait_start = hw_ms_get();
+    blink_ms = wait_start;
     hw_enable_watchdog();
 
     usb_reg_class_drvr(dfu_ep_init, dfu_req_handler, dfu_rx_handler);
+#if defined( DFU_DFUSE )
+    usb_reg_class_set_intf(dfu_set_intf);
+#endif
 }
 
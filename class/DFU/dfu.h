@@ -66,6 +66,7 @@
 #ifndef DFU_H
 #define DFU_H
 #include "types.h"
+#include "desc.h"
 
 typedef struct _DFUStatus {
   U8 bStatus;
@@ -76,8 +77,109 @@ typedef struct _DFUStatus {
   U8 iString;
 } DFUStatus;
 
+#ifndef NUM_EPS
 #define NUM_EPS             1
+#endif
 #define STATUS_SZ           6
+#define DFU_XFER_SIZE       1024    // wTransferSize in the DFU functional descriptor. one flash page.
+#define DFU_NUM_BUFS        2       // page buffers. one gets programmed while the next one is received
+#define DFU_PROG_CHUNK_U32  32      // words programmed per dfu_poll() call, usb_poll() runs in between
+#define DFU_PAGE_PROG_MS    0x3F    // page erase + write time used until the first page is measured
+
+// how long the bootloader waits before it starts the image. a host has to
+// reset the bus within DFU_HOST_DETECT_MS of the pull-up going on. that
+// covers its 100 ms connect debounce and a hub polling its status every
+// 256 ms. once there's a host, a DFU tool gets DFU_WAIT_MS to show up as long
+// as the host keeps sending SOFs. it only counts as gone after DFU_HOST_LOST_MS
+// without one, far more than the 3 ms that make a suspend, and no sooner than
+// DFU_HOST_RESET_MS after its last bus reset. a host that's enumerating can
+// reset the bus several times and holds off the SOFs around each reset.
+#define DFU_HOST_DETECT_MS      500
+#define DFU_HOST_LOST_MS        1000
+#define DFU_HOST_RESET_MS       500
+#define DFU_WAIT_MS             10000
+#define DFU_WAIT_SW_RESET_MS    30000   // after a software reset
+#define DFU_WAIT_FOREVER        0xFFFFFFFF
+
+// Build options. They're all off by default because the bootloader has to fit
+// below FLASH_TARGET (hw.h), and the linker script fails the link if it doesn't.
+// If the link fails with options turned on, raise FLASH_TARGET and the flash
+// LENGTH in the bootloader's linker script together, and relink the
+// applications at the new FLASH_TARGET. The page between the default LENGTH
+// and the journal page (hw.h) is free, so LENGTH can go up by one page before
+// FLASH_TARGET has to move.
+//
+// DFU_LZ       accept images packed with dfu_lz.pl and unpack them while they
+//              download.
+// DFU_DELTA    accept patches made by dfu_delta.pl against the installed image.
+// DFU_RESUME   journal the pages of a raw download so an interrupted one can
+//              be resumed by block number (DFU_GET_RESUME).
+// DFU_DFUSE    add the DfuSe alternate setting, which writes and erases at
+//              addresses the host picks.
+// DFU_AES_KEY  accept images encrypted by dfu_aes.pl. it's the AES-128 key as
+//              four little endian words of the key bytes, which the tool
+//              prints. lock the flash so it can't be read out with a debugger.
+//              with a key, alternate setting 0 only takes encrypted images
+//              that carry the right CMAC, and only the config pages can be
+//              written through DfuSe or read back.
+#if defined( DFU_LZ ) || defined( DFU_DELTA )
+#define DFU_PACKED_IMAGES
+#endif
+
+// the DfuSe interface is an alternate setting, and the control layer only
+// handles SET_INTERFACE with USB_ALT_SETTINGS
+#if defined( DFU_DFUSE ) && !defined( USB_ALT_SETTINGS )
+#error "DFU_DFUSE needs USB_ALT_SETTINGS"
+#endif
+
+// the first block of an image can be a header saying how the rest is sent
+#if defined( DFU_PACKED_IMAGES ) || defined( DFU_AES_KEY )
+#define DFU_IMAGE_HEADER
+#endif
+
+// how the image being downloaded is packed. see dfu_lz.h and dfu_delta.h.
+#define DFU_PACK_NONE       0
+#define DFU_PACK_LZ         1
+#define DFU_PACK_DELTA      2
+
+// Encrypted images start with a block of their own: this magic, the 16 byte
+// AES-CTR initial counter block and the 16 byte AES-CMAC of the plain image.
+// The rest of the block is ignored. What follows is a raw image encrypted
+// with AES-128-CTR.
+//
+// CTR only hides the image. Anyone can flip bits in it and, since the CRC0
+// trailer is linear, fix up the CRC to match, so the CRC says nothing about
+// who made the image. The CMAC does: it's checked on the decrypted image
+// in flash before the image is marked for booting. Its key is the image key's
+// encryption of DFU_AES_MAC_LABEL so the two keys are never the same.
+#define DFU_AES_MAGIC       0x30454146      // "FAE0"
+#define DFU_AES_CTR_SZ      16
+#define DFU_AES_MAC_SZ      16
+#define DFU_AES_MAC_LABEL   "FreakUSB DFU MAC"
+
+// a key of all zeros is what you get from a Makefile line nobody filled in
+#if defined( DFU_AES_KEY )
+#define DFU_AES_KEY_ZERO_(a, b, c, d)   ( ( ( a ) | ( b ) | ( c ) | ( d ) ) == 0 )
+#define DFU_AES_KEY_ZERO(key)           DFU_AES_KEY_ZERO_(key)
+#if DFU_AES_KEY_ZERO( DFU_AES_KEY )
+#error "DFU_AES_KEY is all zeros. Make a real key and set it from the Makefile."
+#endif
+#endif
+
+// alternate settings of the DFU interface
+#define DFU_ALT_IMAGE       0       // plain DFU. the image goes in sequentially from FLASH_TARGET
+#define DFU_ALT_DFUSE       1       // DfuSe. the host sets the address and erases pages itself
+
+// DFU functional descriptor
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U8  bmAttributes;
+    U16 wDetachTimeOut;
+    U16 wTransferSize;
+    U16 bcdDFUVersion;
+} dfu_func_desc_t;
 
 // DFU Request Definitions
                             // bmRequestType, wValue,    wIndex,    wLength, Data
@@ -89,6 +191,20 @@ typedef struct _DFUStatus {
 #define  DFU_GETSTATE  0x05 // 0xA1,          Zero,      Interface, 1,       State
 #define  DFU_ABORT     0x06 // 0x21,          Zero,      Interface, Zero,    None
 
+// Vendor Request Definitions
+                              // bmRequestType, wValue,    wIndex,    wLength, Data
+#define  DFU_GET_RESUME  0x01 // 0xC1,          Zero,      Interface, 4,       Resume block, block size
+#define  DFU_GET_SLOT    0x02 // 0xC1,          Zero,      Interface, 6,       Update slot, slot count, slot address
+#define  DFU_GET_TIMING  0x03 // 0xC1,          Zero,      Interface, 8,       Last page ms, its decryption us. DFU_AES_KEY only
+
+// DfuSe Commands. sent as block 0 of a DFU_DNLOAD on the DfuSe alternate setting.
+                                        // Data
+#define  DFUSE_CMD_GET            0x00  // None. the list of commands is read back with DFU_UPLOAD block 0
+#define  DFUSE_CMD_SET_ADDR       0x21  // Address pointer, 4 bytes LE
+#define  DFUSE_CMD_ERASE          0x41  // None = mass erase, page address, or page address + end address
+#define  DFUSE_CMD_READ_UNPROTECT 0x92  // None. refused
+#define  DFUSE_CMD_MAX_SZ         9     // command byte and two addresses
+
 // DFU Status Values
 #define  OK              0x00 // No error
 #define  errTARGET       0x01 // File is not appropriate for this device
@@ -129,6 +245,9 @@ void dfu_rx_handler();
 void dfu_reg_rx_handler(void (*rx)());
 void dfu_pend_boot_image( void );
 int dfu_is_boot_pending( void );
+void dfu_poll( void );
+int dfu_is_busy( void );
+U32 dfu_sleep_ms( void );
 
 #endif // DFU_H
 
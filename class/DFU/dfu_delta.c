@@ -0,0 +1,206 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file dfu_delta.c
+    \ingroup dfu_class
+
+    Delta updates. The host sends a patch made by dfu_delta.pl that builds
+    the new image out of pieces of the installed one plus new data. The new
+    pages replace the old ones in place. A copy can only read from the page
+    being built or the ones after it, so a page that has been rewritten is
+    never needed again and nothing is saved before it's erased.
+
+    A delta that was cut off can't be resumed. With a single slot the image
+    is left half old and half new, so its CRC fails and it isn't started.
+    The patch header names the image it was made from and the same patch
+    is refused from then on, so the host has to send a full image. With A/B
+    slots the installed image is never written and the patch can just be
+    sent again.
+*/
+/*******************************************************************/
+#include "freakusb.h"
+#include "dfu_delta.h"
+#include "sim3u1xx.h"
+
+enum
+{
+    DELTA_OP,
+    DELTA_INSERT,
+    DELTA_COPY_LEN,
+    DELTA_COPY_SRC,
+    DELTA_COPY,
+    DELTA_ERROR
+};
+
+static U8 delta_state;
+static U8 delta_src_bytes;  // bytes of the copy source received so far
+static U16 delta_count;     // bytes left in the current insert or copy
+static U32 delta_base;      // start of the installed image
+static U32 delta_src;       // copy source, as an offset from delta_base
+static U32 delta_out;       // bytes of the new image produced so far
+
+/**************************************************************************/
+/*!
+    Get ready for a new delta image against the installed image at base.
+    base_crc is the trailer CRC of the image the patch was made from. The
+    installed image has to be intact and be that image, otherwise the patch
+    would build garbage. Returns 0 if the patch can be applied.
+*/
+/**************************************************************************/
+U8 dfu_delta_init( U32 base, U32 base_crc )
+{
+    hw_image_trailer_t *trailer = ( hw_image_trailer_t* )( hw_image_end_get( base ) - sizeof( hw_image_trailer_t ) );
+
+    if( !hw_image_crc_ok( base ) || ( trailer->crc != base_crc ) )
+        return 1;
+
+    delta_base = base;
+    delta_state = DELTA_OP;
+    delta_count = 0;
+    delta_out = 0;
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Apply the patch from *in, producing new image bytes into out, until
+    either the input runs out or out_len bytes have been produced. *in and
+    *in_len are advanced past the input that was used. Returns the number of
+    bytes written to out.
+*/
+/**************************************************************************/
+U32 dfu_delta_decode( const U8 **in, U32 *in_len, U8 *out, U32 out_len )
+{
+    U32 n = 0;
+    U8 c;
+
+    while( n < out_len )
+    {
+        if( delta_state == DELTA_COPY )
+        {
+            // old pages before the one being built might be rewritten already
+            if( delta_src < ( delta_out & ~( BLOCK_SIZE_U8 - 1 ) ) )
+            {
+                delta_state = DELTA_ERROR;
+                break;
+            }
+            c = *( U8* )( delta_base + delta_src++ );
+        }
+        else if( ( delta_state == DELTA_ERROR ) || ( *in_len == 0 ) )
+        {
+            break;
+        }
+        else
+        {
+            c = *( *in )++;
+            ( *in_len )--;
+        }
+
+        switch( delta_state )
+        {
+        case DELTA_OP:
+            if( c & DFU_DELTA_COPY )
+            {
+                delta_count = ( U16 )( c & ~DFU_DELTA_COPY ) << 8;
+                delta_state = DELTA_COPY_LEN;
+            }
+            else
+            {
+                delta_count = c + 1;
+                delta_state = DELTA_INSERT;
+            }
+            continue;
+
+        case DELTA_COPY_LEN:
+            delta_count = ( delta_count | c ) + 1;
+            delta_src = 0;
+            delta_src_bytes = 0;
+            delta_state = DELTA_COPY_SRC;
+            continue;
+
+        case DELTA_COPY_SRC:
+            delta_src |= ( U32 )c << ( 8 * delta_src_bytes++ );
+            if( delta_src_bytes == 3 )
+            {
+                delta_state = ( delta_src + delta_count > HW_SLOT_SIZE ) ?
+                              DELTA_ERROR : DELTA_COPY;
+            }
+            continue;
+
+        default:
+            // DELTA_INSERT and DELTA_COPY both output c
+            break;
+        }
+
+        out[n++] = c;
+        delta_out++;
+
+        if( --delta_count == 0 )
+        {
+            delta_state = DELTA_OP;
+        }
+    }
+    return n;
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the decoder is in the middle of a copy. A copy doesn't need
+    any more input so it still has output to give after the input runs out.
+*/
+/**************************************************************************/
+U8 dfu_delta_pending( void )
+{
+    return ( delta_state == DELTA_COPY );
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the decoder stopped cleanly between two ops.
+*/
+/**************************************************************************/
+U8 dfu_delta_done( void )
+{
+    return ( delta_state == DELTA_OP );
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the patch was bad. The decoder stops producing output once
+    this happens.
+*/
+/**************************************************************************/
+U8 dfu_delta_error( void )
+{
+    return ( delta_state == DELTA_ERROR );
+}
@@ -0,0 +1,61 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file dfu_delta.h
+    \ingroup dfu_class
+*/
+/*******************************************************************/
+#ifndef DFU_DELTA_H
+#define DFU_DELTA_H
+#include "types.h"
+
+// a delta image starts with this word and the trailer CRC of the image it
+// was made from, followed by the ops that build the new image out of the one
+// that's already in flash.
+#define DFU_DELTA_MAGIC         0x314C4446  // "FDL1"
+#define DFU_DELTA_HDR_SZ        8
+
+// op byte. 0x00-0x7F inserts the (op + 1) bytes that follow. 0x80-0xFF copies
+// (((op & 0x7F) << 8 | next byte) + 1) bytes from the installed image. the
+// source offset from the start of the installed image follows as a little
+// endian 24 bit value. the pages are rewritten in order so a copy into a page
+// can only read from that page or the ones after it.
+#define DFU_DELTA_COPY          0x80
+
+U8 dfu_delta_init( U32 base, U32 base_crc );
+U32 dfu_delta_decode( const U8 **in, U32 *in_len, U8 *out, U32 out_len );
+U8 dfu_delta_pending( void );
+U8 dfu_delta_done( void );
+U8 dfu_delta_error( void );
+
+#endif // DFU_DELTA_H
@@ -0,0 +1,133 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file dfu_journal.c
+    \ingroup dfu_class
+
+    Flash journal of the pages programmed by a download. It lives in its own
+    flash page between the bootloader and the image, so it survives resets
+    and power loss. Records only get appended, so one page erase covers a lot
+    of programmed pages. Only the last record matters. It says how far an
+    interrupted download got, or which page a delta update was rewriting.
+*/
+/*******************************************************************/
+#include "freakusb.h"
+#include "dfu_journal.h"
+
+static dfu_journal_rec_t * const journal = ( dfu_journal_rec_t* )DFU_JOURNAL_PAGE;
+
+/**************************************************************************/
+/*!
+    Forget everything in the journal.
+*/
+/**************************************************************************/
+void dfu_journal_clear( void )
+{
+    if( !hw_flash_is_blank( DFU_JOURNAL_PAGE, FLASH_PAGE_SIZE_U32 ) )
+        hw_flash_erase( DFU_JOURNAL_PAGE, 1 );
+}
+
+/**************************************************************************/
+/*!
+    Append a record for the page at addr. It isn't done yet. Returns NULL if
+    the record couldn't be written.
+*/
+/**************************************************************************/
+dfu_journal_rec_t *dfu_journal_add( U32 addr )
+{
+    dfu_journal_rec_t *rec = journal;
+    U32 inv = ~addr;
+
+    while( ( rec < journal + DFU_JOURNAL_RECS ) && ( rec->addr != 0xFFFFFFFF ) )
+    {
+        rec++;
+    }
+
+    // when the journal is full, start it over
+    if( rec == journal + DFU_JOURNAL_RECS )
+    {
+        rec = journal;
+        if( 0 != hw_flash_erase( DFU_JOURNAL_PAGE, 1 ) )
+            return NULL;
+    }
+
+    if( ( 0 != hw_flash_write( ( U32 )&rec->addr, &addr, 1, 1 ) ) ||
+        ( 0 != hw_flash_write( ( U32 )&rec->addr_inv, &inv, 1, 1 ) ) )
+        return NULL;
+
+    return rec;
+}
+
+/**************************************************************************/
+/*!
+    Mark the page of a record as programmed.
+*/
+/**************************************************************************/
+void dfu_journal_done( dfu_journal_rec_t *rec )
+{
+    U32 done = 0;
+
+    if( rec != NULL )
+        hw_flash_write( ( U32 )&rec->done, &done, 1, 0 );
+}
+
+/**************************************************************************/
+/*!
+    Add a record for a page that has already been programmed.
+*/
+/**************************************************************************/
+void dfu_journal_commit( U32 addr )
+{
+    dfu_journal_done( dfu_journal_add( addr ) );
+}
+
+/**************************************************************************/
+/*!
+    Return the last record in the journal, or NULL if it's empty or the last
+    record didn't get written all the way.
+*/
+/**************************************************************************/
+dfu_journal_rec_t *dfu_journal_last( void )
+{
+    dfu_journal_rec_t *rec = journal;
+
+    while( ( rec < journal + DFU_JOURNAL_RECS ) && ( rec->addr != 0xFFFFFFFF ) )
+    {
+        rec++;
+    }
+
+    if( ( rec == journal ) || ( rec[-1].addr != ~rec[-1].addr_inv ) )
+        return NULL;
+
+    return rec - 1;
+}
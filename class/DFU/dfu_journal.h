@@ -0,0 +1,59 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file dfu_journal.h
+    \ingroup dfu_class
+*/
+/*******************************************************************/
+#ifndef DFU_JOURNAL_H
+#define DFU_JOURNAL_H
+#include "types.h"
+
+// journal record. it's added when a page is about to be programmed or has
+// just been programmed and it's marked done once the page is in.
+typedef struct
+{
+    U32 addr;       // page address
+    U32 addr_inv;   // ~addr. the record is only valid if it matches
+    U32 done;       // zero once the page is programmed
+} dfu_journal_rec_t;
+
+#define DFU_JOURNAL_RECS        ( FLASH_PAGE_SIZE_U8 / sizeof( dfu_journal_rec_t ) )
+
+void dfu_journal_clear( void );
+dfu_journal_rec_t *dfu_journal_add( U32 addr );
+void dfu_journal_done( dfu_journal_rec_t *rec );
+void dfu_journal_commit( U32 addr );
+dfu_journal_rec_t *dfu_journal_last( void );
+
+#endif // DFU_JOURNAL_H
@@ -0,0 +1,177 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file dfu_lz.c
+    \ingroup dfu_class
+
+    Decompressor for DFU images that were packed with dfu_lz.pl. It's a
+    small window LZ77 that keeps the last DFU_LZ_WINDOW bytes of output in
+    ram so matches never have to look into flash. The decoder is a state
+    machine so the compressed data can be fed in however it arrives and the
+    output can be taken a page at a time.
+*/
+/*******************************************************************/
+#include "freakusb.h"
+#include "dfu_lz.h"
+
+enum
+{
+    LZ_TOKEN,
+    LZ_LITERAL,
+    LZ_DIST_LO,
+    LZ_DIST_HI,
+    LZ_MATCH,
+    LZ_ERROR
+};
+
+static U8 window[DFU_LZ_WINDOW];
+static U16 win_pos;
+static U8 lz_state;
+static U8 lz_count;         // bytes left in the current literal run or match
+static U16 lz_dist;         // distance back for the current match
+
+/**************************************************************************/
+/*!
+    Get ready for a new compressed image.
+*/
+/**************************************************************************/
+void dfu_lz_init( void )
+{
+    win_pos = 0;
+    lz_state = LZ_TOKEN;
+    lz_count = 0;
+    lz_dist = 0;
+}
+
+/**************************************************************************/
+/*!
+    Decompress from *in into out until either the input runs out or out_len
+    bytes have been produced. *in and *in_len are advanced past the input
+    that was used. Returns the number of bytes written to out.
+*/
+/**************************************************************************/
+U32 dfu_lz_decode( const U8 **in, U32 *in_len, U8 *out, U32 out_len )
+{
+    U32 n = 0;
+    U8 c;
+
+    while( n < out_len )
+    {
+        if( lz_state == LZ_MATCH )
+        {
+            c = window[( win_pos - lz_dist ) & ( DFU_LZ_WINDOW - 1 )];
+        }
+        else if( ( lz_state == LZ_ERROR ) || ( *in_len == 0 ) )
+        {
+            break;
+        }
+        else
+        {
+            c = *( *in )++;
+            ( *in_len )--;
+        }
+
+        switch( lz_state )
+        {
+        case LZ_TOKEN:
+            if( c & DFU_LZ_MATCH )
+            {
+                lz_count = ( c & ~DFU_LZ_MATCH ) + DFU_LZ_MIN_MATCH;
+                lz_state = LZ_DIST_LO;
+            }
+            else
+            {
+                lz_count = c + 1;
+                lz_state = LZ_LITERAL;
+            }
+            continue;
+
+        case LZ_DIST_LO:
+            lz_dist = c;
+            lz_state = LZ_DIST_HI;
+            continue;
+
+        case LZ_DIST_HI:
+            lz_dist = ( lz_dist | ( ( U16 )c << 8 ) ) + 1;
+            lz_state = ( lz_dist > DFU_LZ_WINDOW ) ? LZ_ERROR : LZ_MATCH;
+            continue;
+
+        default:
+            // LZ_LITERAL and LZ_MATCH both output c
+            break;
+        }
+
+        out[n++] = c;
+        window[win_pos] = c;
+        win_pos = ( win_pos + 1 ) & ( DFU_LZ_WINDOW - 1 );
+
+        if( --lz_count == 0 )
+        {
+            lz_state = LZ_TOKEN;
+        }
+    }
+    return n;
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the decoder is in the middle of a match. A match doesn't need
+    any more input so it still has output to give after the input runs out.
+*/
+/**************************************************************************/
+U8 dfu_lz_pending( void )
+{
+    return ( lz_state == LZ_MATCH );
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the decoder stopped cleanly between two tokens. Anything else
+    at the end of an image means it got cut short.
+*/
+/**************************************************************************/
+U8 dfu_lz_done( void )
+{
+    return ( lz_state == LZ_TOKEN );
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the compressed data was bad. The decoder stops producing
+    output once this happens.
+*/
+/**************************************************************************/
+U8 dfu_lz_error( void )
+{
+    return ( lz_state == LZ_ERROR );
+}
@@ -0,0 +1,59 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file dfu_lz.h
+    \ingroup dfu_class
+*/
+/*******************************************************************/
+#ifndef DFU_LZ_H
+#define DFU_LZ_H
+#include "types.h"
+
+// a compressed image starts with this word, followed by the tokens. a raw
+// image starts with the initial stack pointer so it can't be mistaken for one.
+#define DFU_LZ_MAGIC            0x305A4C46  // "FLZ0"
+
+// token byte. 0x00-0x7F is a run of (token + 1) literal bytes that follow.
+// 0x80-0xFF copies ((token & 0x7F) + DFU_LZ_MIN_MATCH) bytes from earlier in
+// the output. the distance back, minus one, follows as a little endian U16.
+#define DFU_LZ_MATCH            0x80
+#define DFU_LZ_MIN_MATCH        3
+#define DFU_LZ_WINDOW           1024        // max distance back. must be a power of 2
+
+void dfu_lz_init( void );
+U32 dfu_lz_decode( const U8 **in, U32 *in_len, U8 *out, U32 out_len );
+U8 dfu_lz_pending( void );
+U8 dfu_lz_done( void );
+U8 dfu_lz_error( void );
+
+#endif // DFU_LZ_H
@@ -0,0 +1,148 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file dfu_rt.c
+    \ingroup dfu_class
+
+    DFU runtime interface. Applications add this interface to their
+    configuration so the host can switch the device into the bootloader
+    with DFU_DETACH. The device detaches itself (bitWillDetach) by leaving
+    a handoff token in retained ram and doing a software reset. The
+    bootloader picks up the token and goes straight into DFU mode.
+*/
+/*******************************************************************/
+#include "freakusb.h"
+#include "dfu_rt.h"
+
+static U8 dfu_rt_state = appIDLE;
+
+/**************************************************************************/
+/*!
+    Class init callback. There aren't any endpoints to set up so we just
+    go back to idle.
+*/
+/**************************************************************************/
+static void dfu_rt_ep_init()
+{
+    dfu_rt_state = appIDLE;
+}
+
+/**************************************************************************/
+/*!
+    Class request handler for the DFU runtime interface. Only DETACH,
+    GETSTATUS and GETSTATE are valid in the runtime states.
+*/
+/**************************************************************************/
+void dfu_rt_req_handler(req_t *req)
+{
+    switch (req->req)
+    {
+    case DFU_DETACH:
+        if (!(req->type & DEVICE_TO_HOST))
+        {
+            // wvalue is wTimeout, but we detach right away
+            dfu_rt_state = appDETACH;
+            ep_send_zlp(EP_CTRL);
+            hw_dfu_detach();
+        }
+        else
+        {
+            ep_set_stall(EP_CTRL);
+        }
+        break;
+
+    case DFU_GETSTATUS:
+        if (req->type & DEVICE_TO_HOST)
+        {
+            usb_buf_write(EP_CTRL, OK);     // bStatus
+            usb_buf_write(EP_CTRL, 0);      // bwPollTimeout
+            usb_buf_write(EP_CTRL, 0);
+            usb_buf_write(EP_CTRL, 0);
+            usb_buf_write(EP_CTRL, dfu_rt_state);
+            usb_buf_write(EP_CTRL, 0);      // iString
+            ep_write(EP_CTRL);
+        }
+        else
+        {
+            ep_set_stall(EP_CTRL);
+        }
+        break;
+
+    case DFU_GETSTATE:
+        if (req->type & DEVICE_TO_HOST)
+        {
+            usb_buf_write(EP_CTRL, dfu_rt_state);
+            ep_write(EP_CTRL);
+        }
+        else
+        {
+            ep_set_stall(EP_CTRL);
+        }
+        break;
+
+    default:
+        ep_set_stall(EP_CTRL);
+        break;
+    }
+}
+
+#if defined( USE_COMPOSITE )
+// class driver entry for a composite device. the runtime interface doesn't
+// have any endpoints.
+static const usb_class_drvr_t dfu_rt_drvr =
+{
+    DFU_RT_INTF,
+    1,
+    0,
+    dfu_rt_ep_init,
+    dfu_rt_req_handler,
+    NULL,
+    NULL
+};
+#endif
+
+/**************************************************************************/
+/*!
+    Register the DFU runtime interface with the USB core.
+*/
+/**************************************************************************/
+void dfu_rt_init()
+{
+    dfu_rt_state = appIDLE;
+
+#if defined( USE_COMPOSITE )
+    usb_reg_class(&dfu_rt_drvr);
+#else
+    usb_reg_class_drvr(dfu_rt_ep_init, dfu_rt_req_handler, NULL);
+#endif
+}
@@ -166,6 +166,8 @@ int main()
     // and off we go...
     while (1)
     {
+        // sleep until there's something for usb_poll() to do
+        usb_wait_event();
         usb_poll();
     }
 }
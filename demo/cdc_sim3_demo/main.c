@@ -168,9 +168,15 @@ int main()
     // register the rx handler function with the cdc
     cdc_reg_rx_handler(rx);
 
+    // made it this far so keep this image. with A/B slots the bootloader
+    // would otherwise go back to the old one on the next reset.
+    hw_slot_confirm();
+
     // and off we go...
     while (1)
     {
+        // sleep until there's something for usb_poll() to do
+        usb_wait_event();
         usb_poll();
     }
 }
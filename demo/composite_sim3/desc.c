@@ -0,0 +1,377 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file desc.c
+    \ingroup composite_demo
+
+    Descriptors for the composite device: a CDC virtual COM port grouped
+    by an interface association descriptor, a vendor specific interface
+    with a bulk OUT pipe, and a DFU runtime interface for getting into the
+    bootloader.
+*/
+/*******************************************************************/
+#include "freakusb.h"
+#include "hw.h"
+
+// interface numbers. the interface count in the cfg descriptor comes from here.
+enum
+{
+    CDC_INTF_COMM = CDC_INTF,
+    CDC_INTF_DATA,
+    VENDOR_INTF_NUM = VENDOR_INTF,
+    DFU_RT_INTF_NUM = DFU_RT_INTF,
+    NUM_INTF
+};
+
+// endpoint definitions: ep num, direction, transfer type, max packet size. these
+// are used for both the endpoint descriptors and the endpoint table.
+#define CDC_EP_INTP_DESC    CDC_EP_INTP,   DIR_IN,  XFER_INTP, PKTSZ_8
+#define CDC_EP_OUT_DESC     CDC_EP_OUT,    DIR_OUT, XFER_BULK, MAX_PACKET_SZ
+#define CDC_EP_IN_DESC      CDC_EP_IN,     DIR_IN,  XFER_BULK, MAX_PACKET_SZ
+#define VENDOR_EP_OUT_DESC  VENDOR_EP_OUT, DIR_OUT, XFER_BULK, MAX_PACKET_SZ
+
+// layout of the complete configuration descriptor. wTotalLength is the size of this.
+typedef struct DESC_PACKED
+{
+    usb_cfg_desc_t              cfg;
+
+    // cdc function
+    usb_iad_desc_t              cdc_iad;
+    usb_intf_desc_t             comm_intf;
+    cdc_hdr_func_desc_t         hdr;
+    cdc_call_mgmt_func_desc_t   call_mgmt;
+    cdc_acm_func_desc_t         acm;
+    cdc_union_func_desc_t       union_func;
+    usb_ep_desc_t               comm_eps[1];
+    usb_intf_desc_t             data_intf;
+    usb_ep_desc_t               data_eps[2];
+
+    // vendor function
+    usb_intf_desc_t             vendor_intf;
+    usb_ep_desc_t               vendor_eps[1];
+
+    // dfu runtime function
+    usb_intf_desc_t             dfu_rt_intf;
+    dfu_func_desc_t             dfu_func;
+} composite_cfg_desc_t;
+
+const usb_dev_desc_t dev_desc PROGMEM = DESC_DEV(
+    0x0200,     // bcdUSB: 0200 (2.0)
+    0xEF,       // bDeviceClass: Miscellaneous
+    0x02,       // bDeviceSubClass: Common Class
+    0x01,       // bDeviceProtocol: Interface Association Descriptor
+    0x10C4,     // idVendor: Silicon Laboratories Vendor ID (VID): 0x10C4
+    0x881A,     // idProduct: Composite PID: 0x881A
+    0x0100,     // bcdDevice: 0100 (v1.00)
+    1           // bNumConfigurations
+);
+
+// cfg descriptor
+const composite_cfg_desc_t cfg_desc PROGMEM =
+{
+    .cfg = DESC_CFG(composite_cfg_desc_t,
+        NUM_INTF,       // bNumInterfaces
+        0x01,           // bConfigurationValue: Configuration value
+        0xA0,           // bmAttributes: bus powered
+        0xFA            // MaxPower 500 mA
+    ),
+
+    // groups the cdc comm and data interfaces into a single function
+    .cdc_iad = DESC_IAD(
+        CDC_INTF_COMM,  // bFirstInterface
+        CDC_NUM_INTFS,  // bInterfaceCount
+        0x02,           // bFunctionClass: Communication Interface Class
+        0x02,           // bFunctionSubClass: Abstract Control Model
+        0x01,           // bFunctionProtocol: Common AT commands
+        0x00            // iFunction
+    ),
+
+    .comm_intf = DESC_INTF(
+        CDC_INTF_COMM,  // bInterfaceNumber
+        0x00,           // bAlternateSetting: Alternate setting
+        DESC_COUNT(composite_cfg_desc_t, comm_eps),
+        0x02,           // bInterfaceClass: Communication Interface Class
+        0x02,           // bInterfaceSubClass: Abstract Control Model
+        0x01,           // bInterfaceProtocol: Common AT commands
+        0x00            // iInterface
+    ),
+
+    // hdr functional descr
+    .hdr = { sizeof(cdc_hdr_func_desc_t), CS_INTERFACE, CDC_HDR_FUNC,
+        0x0110          // bcdCDC: spec release number 0110 (1.1)
+    },
+
+    // call mgmt functional descriptors
+    .call_mgmt = { sizeof(cdc_call_mgmt_func_desc_t), CS_INTERFACE, CDC_CALL_MGMT_FUNC,
+        0x00,           // bmCapabilities: D0+D1
+        CDC_INTF_DATA   // bDataInterface
+    },
+
+    // acm functional descr
+    .acm = { sizeof(cdc_acm_func_desc_t), CS_INTERFACE, CDC_ACM_FUNC,
+        0x02            // bmCapabilities
+    },
+
+    // union functional descr
+    .union_func = { sizeof(cdc_union_func_desc_t), CS_INTERFACE, CDC_UNION_FUNC,
+        CDC_INTF_COMM,  // bMasterInterface: Communication class interface
+        CDC_INTF_DATA   // bSlaveInterface0: Data Class Interface
+    },
+
+    .comm_eps = {
+        DESC_EP(CDC_EP_INTP_DESC, 0xFF)
+    },
+
+    // data class intf descr
+    .data_intf = DESC_INTF(
+        CDC_INTF_DATA,  // bInterfaceNumber
+        0x00,           // bAlternateSetting: Alternate setting
+        DESC_COUNT(composite_cfg_desc_t, data_eps),
+        0x0A,           // bInterfaceClass: CDC
+        0x00,           // bInterfaceSubClass
+        0x00,           // bInterfaceProtocol
+        0x00            // iInterface
+    ),
+
+    // bInterval is ignored for bulk transfers
+    .data_eps = {
+        DESC_EP(CDC_EP_OUT_DESC, 0x00),
+        DESC_EP(CDC_EP_IN_DESC, 0x00)
+    },
+
+    // vendor specific intf descr
+    .vendor_intf = DESC_INTF(
+        VENDOR_INTF_NUM,    // bInterfaceNumber
+        0x00,               // bAlternateSetting: Alternate setting
+        DESC_COUNT(composite_cfg_desc_t, vendor_eps),
+        0xFF,               // bInterfaceClass: Vendor Specific
+        0x00,               // bInterfaceSubClass
+        0x00,               // bInterfaceProtocol
+        0x00                // iInterface
+    ),
+
+    .vendor_eps = {
+        DESC_EP(VENDOR_EP_OUT_DESC, 0x00)
+    },
+
+    // dfu runtime intf descr
+    .dfu_rt_intf = DESC_INTF(
+        DFU_RT_INTF_NUM,    // bInterfaceNumber
+        0x00,               // bAlternateSetting: Alternate setting
+        0x00,               // bNumEndpoints: zero endpoints
+        0xFE,               // bInterfaceClass: Application Specific
+        0x01,               // bInterfaceSubClass: Device Firmware Upgrade
+        0x01,               // bInterfaceProtocol: Runtime protocol
+        0x00                // iInterface
+    ),
+
+    // the device detaches itself on DFU_DETACH so the host doesn't need to reset it
+    .dfu_func = {
+        sizeof(dfu_func_desc_t),
+        DFU_FUNC_DESCR,
+        DFU_ATTR_WILL_DETACH | DFU_ATTR_CAN_DNLOAD,
+        DFU_RT_DETACH_TIMEOUT,  // DetachTimeOut
+        DFU_XFER_SIZE,          // TransferSize of the bootloader
+        0x0110                  // bcdDFUVersion: 1.1
+    }
+};
+
+// endpoint table. the usb core configures these when the host sets the configuration.
+const usb_ep_cfg_t ep_tbl[] PROGMEM =
+{
+    DESC_EP_CFG(CDC_EP_IN_DESC),
+    DESC_EP_CFG(CDC_EP_INTP_DESC),
+    DESC_EP_CFG(CDC_EP_OUT_DESC),
+    DESC_EP_CFG(VENDOR_EP_OUT_DESC)
+};
+
+DESC_STR(lang_str_desc, "\u0409");     // Language: English (US)
+DESC_STR(vendor_str_desc, "http://www.gsat.us");
+DESC_STR(prod_str_desc, "GSatMicro Composite Device");
+DESC_STR(serial_str_desc, "Beta 0.50");
+
+static const U8 * const str_desc[] =
+{
+    (const U8 *)&lang_str_desc,
+    (const U8 *)&vendor_str_desc,
+    (const U8 *)&prod_str_desc,
+    (const U8 *)&serial_str_desc
+};
+
+/**************************************************************************/
+/*!
+    Return a pointer to the device descriptor.
+*/
+/**************************************************************************/
+U8 *desc_dev_get()
+{
+    return (U8 *)&dev_desc;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the device descriptor.
+*/
+/**************************************************************************/
+U8 desc_dev_get_len()
+{
+    return sizeof(dev_desc);
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the configuration descriptor.
+*/
+/**************************************************************************/
+U8 *desc_cfg_get()
+{
+    return (U8 *)&cfg_desc;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the complete configuration descriptor.
+*/
+/**************************************************************************/
+U16 desc_cfg_get_len()
+{
+    return sizeof(cfg_desc);
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the endpoint table for the configuration.
+*/
+/**************************************************************************/
+const usb_ep_cfg_t *desc_ep_tbl_get()
+{
+    return ep_tbl;
+}
+
+/**************************************************************************/
+/*!
+    Return the number of entries in the endpoint table.
+*/
+/**************************************************************************/
+U8 desc_ep_tbl_get_len()
+{
+    return sizeof(ep_tbl) / sizeof(ep_tbl[0]);
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the device qualifier. This is a full speed only
+    device so it doesn't have one.
+*/
+/**************************************************************************/
+U8 *desc_dev_qual_get()
+{
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the device qualifier.
+*/
+/**************************************************************************/
+U8 desc_dev_qual_get_len()
+{
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the BOS descriptor. Not used on this device.
+*/
+/**************************************************************************/
+U8 *desc_bos_get()
+{
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the BOS descriptor.
+*/
+/**************************************************************************/
+U16 desc_bos_get_len()
+{
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the MS OS 2.0 descriptor set.
+*/
+/**************************************************************************/
+U8 *desc_msos20_get()
+{
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the MS OS 2.0 descriptor set.
+*/
+/**************************************************************************/
+U16 desc_msos20_get_len()
+{
+    return 0;
+}
+
+/**************************************************************************/
+/*!
+    Return a pointer to the specified string descriptor.
+*/
+/**************************************************************************/
+U8 *desc_str_get(U8 index)
+{
+    if (index >= (sizeof(str_desc) / sizeof(str_desc[0])))
+    {
+        return NULL;
+    }
+    return (U8 *)str_desc[index];
+}
+
+/**************************************************************************/
+/*!
+    Return the length of the specified string descriptor. The length is
+    the bLength field which gets filled in by the compiler.
+*/
+/**************************************************************************/
+U8 desc_str_get_len(U8 index)
+{
+    U8 *desc = desc_str_get(index);
+
+    return (desc) ? hw_flash_get_byte(desc) : 0;
+}
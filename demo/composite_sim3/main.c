@@ -0,0 +1,177 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \defgroup composite_demo Composite Demo
+    \file main.c
+    \ingroup composite_demo
+
+    Composite device demo. A CDC virtual COM port, a vendor specific
+    bulk pipe and a DFU runtime interface share the same USB connection. Each one is registered with the
+    USB core as its own class driver and gets the requests and rx data for
+    the interfaces and endpoints it owns.
+*/
+/*******************************************************************/
+#include <stdio.h>
+#include "sim3u1xx.h"
+#include "sim3u1xx_Types.h"
+#include "main.h"
+#include "freakusb.h"
+#include "hw.h"
+
+static U8 msg[MAX_MSG_SIZE];
+static U8 *msg_ptr = msg;
+
+// number of bytes received on the vendor pipe
+static U32 vendor_rx_cnt;
+
+/**************************************************************************/
+/*!
+    Rx handler for the vendor pipe. Data coming in on the pipe is just
+    counted and dropped. This is where an application would hook in its own
+    bulk data handling.
+*/
+/**************************************************************************/
+static void vendor_rx()
+{
+    U8 i, len;
+    usb_pcb_t *pcb = usb_pcb_get();
+
+    len = pcb->fifo[VENDOR_EP_OUT].len;
+    for (i=0; i<len; i++)
+    {
+        usb_buf_read(VENDOR_EP_OUT);
+    }
+    vendor_rx_cnt += len;
+}
+
+// class driver entry for the vendor pipe. it doesn't have any class requests
+// so those get stalled by the usb core.
+static const usb_class_drvr_t vendor_drvr =
+{
+    VENDOR_INTF,
+    1,
+    (1<<VENDOR_EP_OUT),
+    NULL,
+    NULL,
+    vendor_rx,
+    NULL
+};
+
+/**************************************************************************/
+/*!
+    Register the vendor pipe with the USB core.
+*/
+/**************************************************************************/
+void vendor_init()
+{
+    vendor_rx_cnt = 0;
+    usb_reg_class(&vendor_drvr);
+}
+
+/**************************************************************************/
+/*!
+    This is the rx handling function for the CDC. It echoes the incoming
+    characters and reports the vendor pipe's byte count when it gets a
+    carriage return. Only the CDC's OUT endpoint is read since the vendor
+    pipe's data is handled separately.
+*/
+/**************************************************************************/
+void cdc_rx()
+{
+    U8 i, c, len;
+    usb_pcb_t *pcb = usb_pcb_get();
+
+    // get the length of data in the OUT buffer
+    len = pcb->fifo[CDC_EP_OUT].len;
+
+    for (i=0; i<len; i++)
+    {
+        c = usb_buf_read(CDC_EP_OUT);
+
+        switch (c)
+        {
+        case '\r':
+            *msg_ptr = '\0';
+            printf("\nvendor pipe: %lu bytes\n", (unsigned long)vendor_rx_cnt);
+            msg_ptr = msg;
+            break;
+
+        case '\b':
+            usb_buf_write(CDC_EP_IN, c);
+            if (msg_ptr > msg)
+            {
+                msg_ptr--;
+            }
+            break;
+
+        default:
+            usb_buf_write(CDC_EP_IN, c);
+            if (msg_ptr < &msg[MAX_MSG_SIZE - 1])
+            {
+                *msg_ptr++ = c;
+            }
+            break;
+        }
+    }
+    pcb->flags |= (1 << TX_DATA_AVAIL);
+}
+
+/**************************************************************************/
+/*!
+    This is the main function. Duh.
+*/
+/**************************************************************************/
+int main()
+{
+    usb_init();
+    hw_init();
+
+    // register the class drivers that make up the device. the order doesn't
+    // matter since requests are routed by interface and endpoint number.
+    cdc_init();
+    cdc_reg_rx_handler(cdc_rx);
+    vendor_init();
+    dfu_rt_init();
+
+    // made it this far so keep this image. with A/B slots the bootloader
+    // would otherwise go back to the old one on the next reset.
+    hw_slot_confirm();
+
+    // and off we go...
+    while (1)
+    {
+        // sleep until there's something for usb_poll() to do
+        usb_wait_event();
+        usb_poll();
+    }
+}
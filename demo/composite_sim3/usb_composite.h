@@ -0,0 +1,61 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file usb_composite.h
+    \ingroup composite_demo
+
+    Makeup of the composite device. This gets pulled in by freakusb.h when
+    USE_COMPOSITE is defined. It sets the number of endpoints used on the
+    device, the interface numbers of each function, and includes the headers
+    of the classes that the device is made of.
+*/
+/*******************************************************************/
+#ifndef USB_COMPOSITE_H
+#define USB_COMPOSITE_H
+
+// ep0 plus ep1-ep4
+#define NUM_EPS             5
+
+// interface numbers
+#define CDC_INTF            0   // cdc uses two interfaces: 0 and 1
+#define VENDOR_INTF         2
+#define DFU_RT_INTF         3
+
+// vendor bulk pipe. the cdc already takes up ep1-ep3 so the vendor pipe only
+// gets the one remaining endpoint.
+#define VENDOR_EP_OUT       4
+
+#include "cdc.h"
+#include "dfu_rt.h"
+
+#endif
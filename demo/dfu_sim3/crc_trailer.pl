@@ -0,0 +1,37 @@
+#!/usr/bin/perl
+# Append the CRC trailer the bootloader checks before it boots an image.
+#
+#   perl crc_trailer.pl app.bin app_dfu.bin
+#
+# The image is padded with 0xFF to a whole word, then the trailer is added:
+# the padded length, the CRC32 and the "CRC0" magic, all little endian words.
+# The CRC matches the SiM3U CRC0 engine set up by hw_crc_start(): polynomial
+# 0x04C11DB7 seeded with all ones, one word at a time msb first, no reflection
+# and no final xor.
+use strict;
+use warnings;
+
+my ($in, $out) = @ARGV;
+die "usage: $0 <image.bin> <output.bin>\n" unless defined $out;
+
+open(my $fh, '<:raw', $in) or die "Could not open file '$in' $!";
+my $image = do { local $/; <$fh> };
+close $fh;
+
+$image .= "\xFF" x ((4 - length($image) % 4) % 4);
+
+my $crc = 0xFFFFFFFF;
+foreach my $word (unpack('V*', $image))
+{
+    $crc ^= $word;
+    for (1 .. 32)
+    {
+        $crc = ($crc & 0x80000000) ? ((($crc << 1) ^ 0x04C11DB7) & 0xFFFFFFFF) : (($crc << 1) & 0xFFFFFFFF);
+    }
+}
+
+open($fh, '>:raw', $out) or die "Could not open file '$out' $!";
+print $fh $image, pack('VVV', length($image), $crc, 0x30435243);
+close $fh;
+
+printf "%s: %d bytes, CRC 0x%08X\n", $out, length($image), $crc;
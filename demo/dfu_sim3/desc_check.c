@@ -0,0 +1,287 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file desc_check.c
+    \ingroup dfu_class
+
+    Host side check of the DFU descriptors. It's built with the host compiler
+    against the same desc.c that goes into the bootloader and walks the
+    descriptors the way a host would, checking every bLength, wTotalLength
+    and count against what's actually there. Run it with "make check".
+*/
+/*******************************************************************/
+#include <stdlib.h>
+#include "freakusb.h"
+
+static int errors;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { printf("desc_check: " __VA_ARGS__); printf("\n"); errors++; } } while (0)
+
+// desc.c reads the string lengths through this. the flash is memory mapped on
+// the sim3u1xx so it's the same thing here.
+U8 hw_flash_get_byte(U8 *addr)
+{
+    return *addr;
+}
+
+static U16 get16(const U8 *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/**************************************************************************/
+/*!
+    Check that a string index is either zero or points at a string descriptor.
+*/
+/**************************************************************************/
+static void check_str_idx(const char *what, U8 idx)
+{
+    CHECK((idx == 0) || desc_str_get(idx), "%s string %d doesn't exist", what, idx);
+}
+
+/**************************************************************************/
+/*!
+    The device descriptor.
+*/
+/**************************************************************************/
+static void check_dev()
+{
+    const U8 *d = desc_dev_get();
+    U8 len = desc_dev_get_len();
+
+    CHECK(len == 18, "device descriptor is %d bytes", len);
+    CHECK(d[0] == len, "device bLength %d, descriptor is %d bytes", d[0], len);
+    CHECK(d[1] == DEV_DESCR, "device bDescriptorType %d", d[1]);
+    CHECK((d[7] == 8) || (d[7] == 16) || (d[7] == 32) || (d[7] == 64),
+          "bMaxPacketSize0 %d", d[7]);
+    CHECK(d[7] == EP_CTRL_PKT_SZ, "bMaxPacketSize0 %d, ep0 is %d", d[7], EP_CTRL_PKT_SZ);
+    check_str_idx("iManufacturer", d[14]);
+    check_str_idx("iProduct", d[15]);
+    check_str_idx("iSerialNumber", d[16]);
+    CHECK(d[17] == 1, "bNumConfigurations %d", d[17]);
+}
+
+/**************************************************************************/
+/*!
+    The configuration descriptor and everything in it. Each descriptor's
+    bLength has to land exactly on the next one and the last one has to end at
+    wTotalLength. The interface count and each interface's endpoint count have
+    to match what follows.
+*/
+/**************************************************************************/
+static void check_cfg()
+{
+    const U8 *d = desc_cfg_get();
+    U16 len = desc_cfg_get_len();
+    U16 pos;
+    U8 num_intf = 0, num_ep = 0, intf_eps = 0;
+    bool in_intf = false, dfu_func = false;
+
+    CHECK(d[0] == 9, "cfg bLength %d", d[0]);
+    CHECK(d[1] == CFG_DESCR, "cfg bDescriptorType %d", d[1]);
+    CHECK(get16(&d[2]) == len, "cfg wTotalLength %d, descriptor is %d bytes", get16(&d[2]), len);
+
+    for (pos = 0; pos < len; pos += d[pos])
+    {
+        if (d[pos] < 2)
+        {
+            CHECK(0, "bLength %d at offset %d", d[pos], pos);
+            return;
+        }
+        if (pos + d[pos] > len)
+        {
+            CHECK(0, "descriptor at offset %d runs %d bytes past wTotalLength",
+                  pos, pos + d[pos] - len);
+            return;
+        }
+
+        switch (d[pos + 1])
+        {
+        case INTF_DESCR:
+            CHECK(d[pos] == 9, "intf bLength %d at offset %d", d[pos], pos);
+            if (in_intf)
+            {
+                CHECK(num_ep == intf_eps, "intf before offset %d has %d endpoints, says %d",
+                      pos, num_ep, intf_eps);
+            }
+            if (d[pos + 3] == 0)
+            {
+                CHECK(d[pos + 2] == num_intf, "intf %d out of order at offset %d", d[pos + 2], pos);
+                num_intf++;
+            }
+            in_intf = true;
+            intf_eps = d[pos + 4];
+            num_ep = 0;
+            check_str_idx("iInterface", d[pos + 8]);
+            break;
+
+        case EP_DESCR:
+            CHECK(d[pos] == 7, "ep bLength %d at offset %d", d[pos], pos);
+            CHECK(in_intf, "ep outside an intf at offset %d", pos);
+            num_ep++;
+            break;
+
+        case IAD_DESCR:
+            CHECK(d[pos] == 8, "iad bLength %d at offset %d", d[pos], pos);
+            break;
+
+        case DFU_FUNC_DESCR:
+            CHECK(d[pos] == desc_dfu_func_get_len(), "dfu func bLength %d at offset %d", d[pos], pos);
+            CHECK(&d[pos] == desc_dfu_func_get(), "GET_DESCRIPTOR(DFU) isn't the copy in the cfg");
+            dfu_func = true;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    CHECK(pos == len, "descriptors end at %d, wTotalLength is %d", pos, len);
+    if (in_intf)
+    {
+        CHECK(num_ep == intf_eps, "last intf has %d endpoints, says %d", num_ep, intf_eps);
+    }
+    CHECK(d[4] == num_intf, "cfg bNumInterfaces %d, found %d", d[4], num_intf);
+    CHECK(dfu_func, "no dfu functional descriptor");
+}
+
+/**************************************************************************/
+/*!
+    The BOS descriptor, its capabilities, and the MS OS 2.0 descriptor set
+    the platform capability points at.
+*/
+/**************************************************************************/
+static void check_bos()
+{
+    const U8 *d = desc_bos_get();
+    const U8 *set = desc_msos20_get();
+    U16 len = desc_bos_get_len();
+    U16 set_len = desc_msos20_get_len();
+    U16 bcd_usb = get16(&desc_dev_get()[2]);
+    U16 pos;
+    U8 num_caps = 0;
+    bool msos20 = false;
+
+    if (d == NULL)
+    {
+        CHECK(len == 0, "no BOS descriptor but its length is %d", len);
+        CHECK(bcd_usb < 0x0201, "bcdUSB %04x but no BOS descriptor", bcd_usb);
+        return;
+    }
+
+    // a host only asks for the BOS descriptor from a 2.01 or later device
+    CHECK(bcd_usb >= 0x0201, "bcdUSB %04x, the BOS descriptor won't be read", bcd_usb);
+
+    CHECK(d[0] == 5, "bos bLength %d", d[0]);
+    CHECK(d[1] == BOS_DESCR, "bos bDescriptorType %d", d[1]);
+    CHECK(get16(&d[2]) == len, "bos wTotalLength %d, descriptor is %d bytes", get16(&d[2]), len);
+
+    for (pos = d[0]; pos < len; pos += d[pos])
+    {
+        if ((d[pos] < 3) || (pos + d[pos] > len))
+        {
+            CHECK(0, "bad capability bLength %d at offset %d", d[pos], pos);
+            return;
+        }
+        CHECK(d[pos + 1] == DEV_CAP_DESCR, "capability type %d at offset %d", d[pos + 1], pos);
+        num_caps++;
+
+        if (d[pos + 2] == DEV_CAP_PLATFORM)
+        {
+            CHECK(d[pos] == 28, "platform capability bLength %d", d[pos]);
+            CHECK(get16(&d[pos + 24]) == set_len, "MS OS 2.0 set is %d bytes, capability says %d",
+                  set_len, get16(&d[pos + 24]));
+            CHECK(d[pos + 26] == MS_OS_20_VENDOR_CODE, "MS OS 2.0 vendor code %d", d[pos + 26]);
+            msos20 = true;
+        }
+    }
+    CHECK(pos == len, "capabilities end at %d, wTotalLength is %d", pos, len);
+    CHECK(d[4] == num_caps, "bos bNumDeviceCaps %d, found %d", d[4], num_caps);
+
+    if (!msos20)
+    {
+        return;
+    }
+
+    // the set is a flat list of wLength prefixed descriptors
+    CHECK(get16(&set[0]) == 10, "set header wLength %d", get16(&set[0]));
+    CHECK(get16(&set[2]) == MS_OS_20_SET_HEADER, "set header wDescriptorType %d", get16(&set[2]));
+    CHECK(get16(&set[8]) == set_len, "set wTotalLength %d, set is %d bytes", get16(&set[8]), set_len);
+    for (pos = 0; pos < set_len; pos += get16(&set[pos]))
+    {
+        if ((get16(&set[pos]) < 4) || (pos + get16(&set[pos]) > set_len))
+        {
+            CHECK(0, "bad wLength %d at offset %d of the MS OS 2.0 set", get16(&set[pos]), pos);
+            return;
+        }
+    }
+    CHECK(pos == set_len, "MS OS 2.0 set ends at %d, wTotalLength is %d", pos, set_len);
+}
+
+/**************************************************************************/
+/*!
+    All the string descriptors. Index 0 is the language list.
+*/
+/**************************************************************************/
+static void check_str()
+{
+    const U8 *d;
+    U8 i;
+
+    for (i = 0; (d = desc_str_get(i)) != NULL; i++)
+    {
+        CHECK(d[0] == desc_str_get_len(i), "string %d bLength %d, length is %d",
+              i, d[0], desc_str_get_len(i));
+        CHECK((d[0] >= 2) && !(d[0] & 1), "string %d bLength %d", i, d[0]);
+        CHECK(d[1] == STR_DESCR, "string %d bDescriptorType %d", i, d[1]);
+    }
+    CHECK(i > 1, "only %d string descriptors", i);
+    CHECK((i == 0) || ((d = desc_str_get(0))[0] >= 4), "no language in string 0");
+}
+
+int main()
+{
+    check_dev();
+    check_cfg();
+    check_bos();
+    check_str();
+
+    if (errors)
+    {
+        printf("desc_check: %d error(s)\n", errors);
+        return EXIT_FAILURE;
+    }
+    printf("desc_check: descriptors ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+# Encrypt an image for the bootloader's AES-128-CTR download mode.
+#
+#   perl dfu_aes.pl 000102030405060708090a0b0c0d0e0f app_dfu.bin app_dfu.aes
+#
+# The key is 32 hex digits and has to match DFU_AES_KEY in the bootloader.
+# The Makefile line that sets it is printed. Add the CRC trailer before encrypting, the
+# bootloader checks it on the decrypted image.
+#
+# The output starts with a header block padded to the 1K transfer size: the
+# "FAE0" magic, a random 16 byte initial counter block and the AES-CMAC of the
+# plain image. The encrypted image follows. The CMAC key is the key's AES
+# encryption of DFU_AES_MAC_LABEL (dfu.h). The bootloader only boots an image
+# whose CMAC checks out. The encryption is done by openssl, which has to be on
+# the path.
+use strict;
+use warnings;
+
+my ($key, $in, $out) = @ARGV;
+die "usage: $0 <key hex> <image.bin> <output.aes>\n" unless defined $out;
+die "key has to be 32 hex digits\n" unless $key =~ /^[0-9a-fA-F]{32}$/;
+
+open(my $fh, '<:raw', $in) or die "Could not open file '$in' $!";
+my $image = do { local $/; <$fh> };
+close $fh;
+die "$in isn't a whole number of words, add the CRC trailer first\n" if length($image) % 4;
+
+open($fh, '<:raw', '/dev/urandom') or die "Could not open /dev/urandom $!";
+read($fh, my $ctr, 16) == 16 or die "Could not read /dev/urandom\n";
+close $fh;
+
+my $tmp = "$out.tmp";
+open($fh, '>:raw', $tmp) or die "Could not open file '$tmp' $!";
+print $fh $image;
+close $fh;
+my $ct = `openssl enc -aes-128-ctr -nosalt -K $key -iv @{[unpack('H*', $ctr)]} -in "$tmp"`;
+die "openssl failed\n" if $? || length($ct) != length($image);
+
+my $lbl = "$out.lbl";
+open($fh, '>:raw', $lbl) or die "Could not open file '$lbl' $!";
+print $fh 'FreakUSB DFU MAC';
+close $fh;
+my $mac_key = unpack('H*', `openssl enc -aes-128-ecb -nopad -nosalt -K $key -in "$lbl"`);
+unlink $lbl;
+die "openssl failed\n" if $? || length($mac_key) != 32;
+my $mac = `openssl dgst -mac cmac -macopt cipher:aes-128-cbc -macopt hexkey:$mac_key -binary "$tmp"`;
+unlink $tmp;
+die "openssl failed\n" if $? || length($mac) != 16;
+
+my $hdr = pack('V', 0x30454146) . $ctr . $mac;
+$hdr .= "\xFF" x (1024 - length($hdr));
+
+open($fh, '>:raw', $out) or die "Could not open file '$out' $!";
+print $fh $hdr, $ct;
+close $fh;
+
+printf "%s: %d bytes\n", $out, length($hdr) + length($ct);
+printf "CFLAGS += -D'DFU_AES_KEY=%s'\n", join(',', map { sprintf('0x%08X', $_) } unpack('V4', pack('H*', $key)));
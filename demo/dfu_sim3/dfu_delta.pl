@@ -0,0 +1,163 @@
+#!/usr/bin/perl
+# Make a delta image that updates the installed image to a new one.
+#
+#   perl dfu_delta.pl installed_dfu.bin new_dfu.bin update.delta
+#
+# Both images need to have been through crc_trailer.pl and the installed one
+# has to be exactly what's in the device. The bootloader checks the installed
+# image's trailer CRC against the one in the patch header before it starts.
+#
+# With a single slot the bootloader rewrites the pages in order, so a copy into
+# a page only reads from the same page of the installed image or the ones
+# after it. The patch is applied here the same way the
+# bootloader does it and compared with the new image before it's written out.
+use strict;
+use warnings;
+
+my $MAGIC     = 0x314C4446;     # DFU_DELTA_MAGIC, "FDL1"
+my $CRC_MAGIC = 0x30435243;     # HW_IMAGE_CRC_MAGIC, "CRC0"
+my $COPY      = 0x80;           # DFU_DELTA_COPY
+my $MAX_COPY  = 0x8000;
+my $MAX_INS   = 0x80;
+my $MIN_COPY  = 8;              # a copy op takes 5 bytes
+my $PAGE      = 1024;           # FLASH_PAGE_SIZE_U8
+
+my ($old_file, $new_file, $out) = @ARGV;
+die "usage: $0 <installed.bin> <new.bin> <output.delta>\n" unless defined $out;
+
+my $old = slurp($old_file);
+my $new = slurp($new_file);
+
+my ($base_crc, $crc_magic) = unpack('x4 V V', substr($old, -12));
+die "$old_file has no CRC trailer\n" unless length($old) >= 12 && $crc_magic == $CRC_MAGIC;
+
+my $packed = pack('VV', $MAGIC, $base_crc) . diff($old, $new);
+die "patch check failed\n" unless apply($old, substr($packed, 8)) eq $new;
+
+open(my $fh, '>:raw', $out) or die "Could not open file '$out' $!";
+print $fh $packed;
+close $fh;
+
+printf "%s: %d -> %d bytes (%.1f%%)\n", $out, length($new), length($packed),
+    length($new) ? 100 * length($packed) / length($new) : 0;
+
+sub slurp
+{
+    my ($file) = @_;
+    open(my $fh, '<:raw', $file) or die "Could not open file '$file' $!";
+    my $data = do { local $/; <$fh> };
+    close $fh;
+    return $data;
+}
+
+# number of bytes that match at the two offsets, up to max
+sub match_len
+{
+    my ($old, $src, $new, $dst, $max) = @_;
+    my $n = 0;
+
+    $max = length($old) - $src if $src + $max > length($old);
+    $max = length($new) - $dst if $dst + $max > length($new);
+    $n += 16 while $n + 16 <= $max && substr($old, $src + $n, 16) eq substr($new, $dst + $n, 16);
+    $n++ while $n < $max && substr($old, $src + $n, 1) eq substr($new, $dst + $n, 1);
+    return $n;
+}
+
+sub diff
+{
+    my ($old, $new) = @_;
+    my (%index, $lit, $packed);
+    my $pos = 0;
+
+    for (my $i = 0; $i + $MIN_COPY <= length($old); $i++)
+    {
+        push @{$index{substr($old, $i, $MIN_COPY)}}, $i;
+    }
+
+    $lit = $packed = '';
+    while ($pos < length($new))
+    {
+        my $floor = $pos - $pos % $PAGE;
+        my ($best_len, $best_src) = (0, 0);
+
+        # most of an update usually hasn't moved, so try the same place first
+        foreach my $src ($pos, reverse @{$index{substr($new, $pos, $MIN_COPY)} || []})
+        {
+            next if $src < $floor || $src >= length($old);
+
+            # a source behind the destination would fall into a page that's
+            # already been rewritten once the copy crosses into the next page
+            my $max = $src >= $pos ? $MAX_COPY : $floor + $PAGE - $pos;
+            my $n = match_len($old, $src, $new, $pos, $max);
+            ($best_len, $best_src) = ($n, $src) if $n > $best_len;
+            last if $n == $MAX_COPY;
+        }
+
+        if ($best_len >= $MIN_COPY)
+        {
+            $packed .= inserts($lit);
+            $lit = '';
+            $packed .= pack('CC', $COPY | (($best_len - 1) >> 8), ($best_len - 1) & 0xFF);
+            $packed .= substr(pack('V', $best_src), 0, 3);
+            $pos += $best_len;
+        }
+        else
+        {
+            $lit .= substr($new, $pos++, 1);
+        }
+    }
+    return $packed . inserts($lit);
+}
+
+sub inserts
+{
+    my ($lit) = @_;
+    my $packed = '';
+
+    while (length($lit))
+    {
+        my $run = substr($lit, 0, $MAX_INS, '');
+        $packed .= pack('C', length($run) - 1) . $run;
+    }
+    return $packed;
+}
+
+# rebuild the new image page by page on top of the old one
+sub apply
+{
+    my ($flash, $patch) = @_;
+    my ($page, $done) = ('', 0);
+    my $pos = 0;
+
+    my $emit = sub {
+        $page .= $_[0];
+        if (length($page) == $PAGE)
+        {
+            substr($flash, $done, $PAGE) = $page;
+            $done += $PAGE;
+            $page = '';
+        }
+    };
+
+    while ($pos < length($patch))
+    {
+        my $op = ord(substr($patch, $pos++, 1));
+        if ($op & $COPY)
+        {
+            my $n = ((($op & 0x7F) << 8) | ord(substr($patch, $pos++, 1))) + 1;
+            my $src = unpack('V', substr($patch, $pos, 3) . "\0");
+            $pos += 3;
+            for (1 .. $n)
+            {
+                die "copy from a rewritten page\n" if $src < $done;
+                $emit->(substr($flash, $src++, 1));
+            }
+        }
+        else
+        {
+            $emit->($_) foreach split(//, substr($patch, $pos, $op + 1));
+            $pos += $op + 1;
+        }
+    }
+    return substr($flash, 0, $done) . $page;
+}
@@ -0,0 +1,126 @@
+#!/usr/bin/perl
+# Compress an image for the bootloader's in-stream decompressor (dfu_lz.c).
+#
+#   perl dfu_lz.pl app_dfu.bin app_dfu.lz
+#
+# Compress the image after crc_trailer.pl has been run on it. The bootloader
+# checks the CRC of the unpacked image. The output is decompressed again here
+# and compared with the input before it's written out.
+use strict;
+use warnings;
+
+my $MAGIC     = 0x305A4C46;     # DFU_LZ_MAGIC, "FLZ0"
+my $MATCH     = 0x80;           # DFU_LZ_MATCH
+my $MIN_MATCH = 3;              # DFU_LZ_MIN_MATCH
+my $MAX_MATCH = 0x7F + $MIN_MATCH;
+my $MAX_LIT   = 0x80;
+my $WINDOW    = 1024;           # DFU_LZ_WINDOW
+
+my ($in, $out) = @ARGV;
+die "usage: $0 <image.bin> <output.lz>\n" unless defined $out;
+
+open(my $fh, '<:raw', $in) or die "Could not open file '$in' $!";
+my $image = do { local $/; <$fh> };
+close $fh;
+
+my $packed = pack('V', $MAGIC) . compress($image);
+die "round trip failed\n" unless decompress(substr($packed, 4)) eq $image;
+
+open($fh, '>:raw', $out) or die "Could not open file '$out' $!";
+print $fh $packed;
+close $fh;
+
+printf "%s: %d -> %d bytes (%.1f%%)\n", $out, length($image), length($packed),
+    length($image) ? 100 * length($packed) / length($image) : 0;
+
+# greedy LZ77. positions are looked up by their first MIN_MATCH bytes.
+sub compress
+{
+    my ($data) = @_;
+    my $len = length($data);
+    my (%chain, $lit, $packed);
+    my $pos = 0;
+
+    $lit = $packed = '';
+    while ($pos < $len)
+    {
+        my ($best_len, $best_dist) = (0, 0);
+        my $key = substr($data, $pos, $MIN_MATCH);
+
+        if (length($key) == $MIN_MATCH && $chain{$key})
+        {
+            foreach my $cand (reverse @{$chain{$key}})
+            {
+                last if $pos - $cand > $WINDOW;
+                my $n = $MIN_MATCH;
+                $n++ while $n < $MAX_MATCH && $pos + $n < $len &&
+                    substr($data, $cand + $n, 1) eq substr($data, $pos + $n, 1);
+                ($best_len, $best_dist) = ($n, $pos - $cand) if $n > $best_len;
+                last if $n == $MAX_MATCH;
+            }
+        }
+
+        my $step = $best_len >= $MIN_MATCH ? $best_len : 1;
+        if ($best_len >= $MIN_MATCH)
+        {
+            $packed .= literals($lit);
+            $lit = '';
+            $packed .= pack('Cv', $MATCH | ($best_len - $MIN_MATCH), $best_dist - 1);
+        }
+        else
+        {
+            $lit .= substr($data, $pos, 1);
+        }
+
+        # remember the positions we just covered and forget the ones that
+        # fell out of the window
+        for my $p ($pos .. $pos + $step - 1)
+        {
+            my $k = substr($data, $p, $MIN_MATCH);
+            next unless length($k) == $MIN_MATCH;
+            my $list = $chain{$k} ||= [];
+            push @$list, $p;
+            shift @$list while $p - $list->[0] > $WINDOW;
+        }
+        $pos += $step;
+    }
+    return $packed . literals($lit);
+}
+
+sub literals
+{
+    my ($lit) = @_;
+    my $packed = '';
+
+    while (length($lit))
+    {
+        my $run = substr($lit, 0, $MAX_LIT, '');
+        $packed .= pack('C', length($run) - 1) . $run;
+    }
+    return $packed;
+}
+
+sub decompress
+{
+    my ($packed) = @_;
+    my $data = '';
+    my $pos = 0;
+
+    while ($pos < length($packed))
+    {
+        my $token = ord(substr($packed, $pos++, 1));
+        if ($token & $MATCH)
+        {
+            my $n = ($token & 0x7F) + $MIN_MATCH;
+            my $dist = unpack('v', substr($packed, $pos, 2)) + 1;
+            $pos += 2;
+            $data .= substr($data, length($data) - $dist, 1) for 1 .. $n;
+        }
+        else
+        {
+            $data .= substr($packed, $pos, $token + 1);
+            $pos += $token + 1;
+        }
+    }
+    return $data;
+}
@@ -0,0 +1,136 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file lz_check.c
+    \ingroup dfu_class
+
+    Host side round trip of the LZ image format. It unpacks a file made by
+    dfu_lz.pl with the same dfu_lz.c that goes into the bootloader, the way
+    dfu_poll() does it: the input comes in pieces of odd sizes and the output
+    is taken a page at a time. The result has to match the original file.
+    Run it with "make check".
+*/
+/*******************************************************************/
+#include <stdlib.h>
+#include "freakusb.h"
+#include "dfu_lz.h"
+
+#define PAGE_SZ     1024        // BLOCK_SIZE_U8
+#define MAX_CHUNK   64          // biggest piece of input handed over at once
+
+static U8 *slurp(const char *name, U32 *len)
+{
+    FILE *f = fopen(name, "rb");
+    U8 *data;
+    long n;
+
+    if ((f == NULL) || fseek(f, 0, SEEK_END) || ((n = ftell(f)) < 0))
+    {
+        printf("lz_check: can't read %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    rewind(f);
+    data = malloc(n + 1);
+    if ((data == NULL) || (fread(data, 1, n, f) != (size_t)n))
+    {
+        printf("lz_check: can't read %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    *len = n;
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    U8 *image, *packed, *out;
+    const U8 *in;
+    U32 image_len, packed_len, in_len, out_len = 0, page_len = 0, chunk = 1, n;
+
+    if (argc != 3)
+    {
+        printf("usage: lz_check <image.bin> <image.lz>\n");
+        return EXIT_FAILURE;
+    }
+    image = slurp(argv[1], &image_len);
+    packed = slurp(argv[2], &packed_len);
+    out = malloc(image_len + PAGE_SZ);
+
+    if ((packed_len < 4) || (packed[0] | (packed[1] << 8) | (packed[2] << 16) | ((U32)packed[3] << 24)) != DFU_LZ_MAGIC)
+    {
+        printf("lz_check: %s doesn't start with the LZ magic\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    in = packed + 4;
+    packed_len -= 4;
+
+    dfu_lz_init();
+    while ((packed_len != 0) || dfu_lz_pending())
+    {
+        // hand over the next piece of input, 1 to MAX_CHUNK bytes
+        in_len = (chunk < packed_len) ? chunk : packed_len;
+        packed_len -= in_len;
+        chunk = chunk % MAX_CHUNK + 1;
+
+        // unpack it, a page at a time, until it's all used up
+        do
+        {
+            n = dfu_lz_decode(&in, &in_len, out + out_len + page_len, PAGE_SZ - page_len);
+            page_len += n;
+            if (page_len == PAGE_SZ)
+            {
+                out_len += page_len;
+                page_len = 0;
+            }
+            if (dfu_lz_error() || (out_len + page_len > image_len))
+            {
+                printf("lz_check: %s: bad data at output byte %u\n", argv[2], out_len + page_len);
+                return EXIT_FAILURE;
+            }
+        } while ((in_len != 0) || (dfu_lz_pending() && (n != 0)));
+    }
+    out_len += page_len;
+
+    if (!dfu_lz_done())
+    {
+        printf("lz_check: %s ends in the middle of a token\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    if ((out_len != image_len) || memcmp(out, image, image_len))
+    {
+        printf("lz_check: %s unpacks to %u bytes that don't match %s\n", argv[2], out_len, argv[1]);
+        return EXIT_FAILURE;
+    }
+    printf("lz_check: %s ok, %u -> %u bytes\n", argv[1], image_len, out_len);
+    return EXIT_SUCCESS;
+}
@@ -77,7 +77,19 @@ int main()
     // and off we go...
     while (1)
     {
+        // sleep until something happens. SysTick only wakes us when the
+        // wait for the host needs looking at.
+        if( !dfu_is_busy() )
+        {
+            hw_sleep_limit( dfu_sleep_ms() );
+            usb_wait_event();
+        }
+
         usb_poll();
+
+        // program any pages the host has sent
+        dfu_poll();
+
         if( dfu_is_boot_pending() )
             hw_boot_image( 1 );
     }
@@ -3,15 +3,17 @@ $git_version =~ s/\s+//g;
 
 print "Got version!";
 
+# this is a plain byte array since desc.c declares it as one. DESC_STR()
+# makes a struct with a length dependent type that can't be declared extern.
 my $string =<<EOF;
 #include "freakusb.h"
 #include "hw.h"
 
-U8 serial_str_desc[] PROGMEM =
+const U8 serial_str_desc[] PROGMEM =
 {
-    0x%x,       // bLength: 0x14 (20 bytes = sizeof str fields + string)
+    %d,         // bLength: 2 + the PCB revision and git version as UTF-16
     STR_DESCR,  // bDescriptorType: String
-                // Serial: Beta 0.50
+                // Serial: PCB revision followed by the git version
 #if defined( PCB_V7 )
     'V',0,'0',0,'7',0,'-',0,
 #elif defined( PCB_V8 )
@@ -30,5 +32,5 @@ $git_version_expanded =~ s/(.{1,1})/\'$1\'\,0\,/gs;
 
 my $filename = "version.c";
 open(my $fh, '>', $filename) or die "Could not open file '$filename' $!";
-printf $fh $string,length($git_version)*2+8+2, $git_version_expanded;
-close $fh;
\ No newline at end of file
+printf $fh $string, length($git_version)*2+8+2, $git_version_expanded;
+close $fh;
@@ -99,8 +99,9 @@ void ep_cfg_clear()
     Clear the specified endpoint's enable bit.
 */
 /**************************************************************************/
-void ep_disable()
+void ep_disable(U8 ep_num)
 {
+    ep_select(ep_num);
     UECONX &= ~(1 << EPEN);
 }
 
@@ -194,6 +195,61 @@ void ep_write(U8 ep_num)
     FIFOCON_INT_CLR();
 }
 
+/**************************************************************************/
+/*!
+    Write one packet straight from memory into the control endpoint's FIFO and
+    hand it to the hardware. The data doesn't go through the endpoint's ring
+    buffer so descriptors can be sent directly out of flash. A len of zero
+    sends a zero length packet. If the host moves on to the status stage or
+    sends a new setup packet before the bank frees up, the packet is dropped.
+*/
+/**************************************************************************/
+void ep_write_ctrl(U8 *data, U8 len, bool read_from_flash)
+{
+    U8 i;
+
+    cli();
+    ep_select(EP_CTRL);
+    while (!TX_FIFO_READY)
+    {
+        if (RX_SETUP_INT || RX_OUT_INT)
+        {
+            sei();
+            return;
+        }
+    }
+
+    for (i=0; i<len; i++)
+    {
+        UEDATX = read_from_flash ? hw_flash_get_byte(data + i) : data[i];
+    }
+
+    // clearing this sends the data out
+    TX_IN_INT_CLR();
+    sei();
+}
+
+/**************************************************************************/
+/*!
+    Tell the hardware that we're done with the OUT packet sitting in the
+    endpoint so that it can accept the next one. The ISR already releases
+    ep0 when it copies a packet into the fifo so this is usually a no-op
+    here, but it keeps the control transfer code the same on every port.
+*/
+/**************************************************************************/
+void ep_clear_out_ready(U8 ep_num)
+{
+    U8 ep_intp_num = UENUM;
+
+    ep_select(ep_num);
+    if (RX_OUT_INT)
+    {
+        RX_OUT_INT_CLR();
+        FIFOCON_INT_CLR();
+    }
+    ep_select(ep_intp_num);
+}
+
 /**************************************************************************/
 /*!
     Read data from the endpoint's FIFO. This is where data coming into the
@@ -296,7 +352,7 @@ void ep_init()
     UERST = 0;
 
     // configure the control endpoint first since that one is needed for enumeration
-    ep_config(EP_CTRL, CONTROL, DIR_OUT, MAX_PACKET_SZ);
+    ep_config(EP_CTRL, XFER_CONTROL, DIR_OUT, EP_CTRL_PKTSZ);
 
     // set the rx setup interrupt to received the enumeration interrupts
     ep_select(EP_CTRL);
@@ -41,6 +41,7 @@
 void hw_init();
 void hw_intp_disable();
 void hw_intp_enable();
+void hw_sleep();
 U8 hw_flash_get_byte(U8 *addr);
 
 #endif
@@ -70,6 +70,7 @@ void intp_suspend()
 
     // freeze the clock and turn off the USB PLL
     USBCON |= (1 << FRZCLK);
+    usb_evt_post(USB_EVT_SUSPEND);
 }
 
 /**************************************************************************/
@@ -82,6 +83,7 @@ void intp_resume()
     WAKEUP_INT_DIS();
     RESM_INT_CLR();
     RESM_INT_DIS();
+    usb_evt_post(USB_EVT_RESUME);
 }
 
 /**************************************************************************/
@@ -110,6 +112,7 @@ void intp_eor()
 {
     EOR_INT_CLR();
     ep_init();
+    usb_evt_post(USB_EVT_RESET);
 }
 
 /**************************************************************************/
@@ -156,6 +159,7 @@ ISR(USB_COM_vect)
 
         // clear the intp
         RX_SETUP_INT_CLR();
+        usb_evt_post(USB_EVT_SETUP);
         break;
     case RXOUTI:
         // mark a flag as having data in the EP bank that needs to be transferred to the fifo. 
@@ -177,12 +181,14 @@ ISR(USB_COM_vect)
             RX_OUT_INT_CLR();
             FIFOCON_INT_CLR();
         }
+        usb_evt_post((ep_intp_num == EP_CTRL) ? USB_EVT_SETUP : USB_EVT_RX);
         break;
     case TXINI:
         ep_write(ep_intp_num);
 
         // clear the intps
         TX_IN_INT_CLR();
+        usb_evt_post(USB_EVT_TX);
         break;
     case STALLEDI:
         break;
@@ -114,6 +114,7 @@ void intp_suspend()
 
     // freeze the clock and turn off the USB PLL
     USBCON |= (1 << FRZCLK);
+    usb_evt_post(USB_EVT_SUSPEND);
 }
 
 /**************************************************************************/
@@ -126,6 +127,7 @@ void intp_resume()
     WAKEUP_INT_DIS();
     RESM_INT_CLR();
     RESM_INT_DIS();
+    usb_evt_post(USB_EVT_RESUME);
 }
 
 /**************************************************************************/
@@ -154,6 +156,7 @@ void intp_eor()
 {
     EOR_INT_CLR();
     ep_init();
+    usb_evt_post(USB_EVT_RESET);
 }
 
 /**************************************************************************/
@@ -200,6 +203,7 @@ ISR(USB_COM_vect)
 
         // clear the intp
         RX_SETUP_INT_CLR();
+        usb_evt_post(USB_EVT_SETUP);
         break;
     case RXOUTI:
         // mark a flag as having data in the EP bank that needs to be transferred to the fifo. 
@@ -221,12 +225,14 @@ ISR(USB_COM_vect)
             RX_OUT_INT_CLR();
             FIFOCON_INT_CLR();
         }
+        usb_evt_post((ep_intp_num == EP_CTRL) ? USB_EVT_SETUP : USB_EVT_RX);
         break;
     case TXINI:
         ep_write(ep_intp_num);
 
         // clear the intps
         TX_IN_INT_CLR();
+        usb_evt_post(USB_EVT_TX);
         break;
     case STALLEDI:
         break;
@@ -39,6 +39,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
+#include <avr/sleep.h>
 #include <avr/pgmspace.h>
 #include "at90usb.h"
 #include "types.h"
@@ -107,3 +108,20 @@ void hw_intp_enable()
 {
     sei();
 }
+
+/**************************************************************************/
+/*!
+    Sleep in idle mode until the next interrupt. Call it with the interrupts
+    disabled. The instruction after sei() always runs before any interrupt
+    does, so one can't slip in ahead of the sleep. Returns with the
+    interrupts enabled.
+*/
+/**************************************************************************/
+void hw_sleep()
+{
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+}
@@ -38,9 +38,14 @@
 #ifndef HW_H
 #define HW_H
 
+// ep0 is configured smaller than the other endpoints on this part
+#define EP_CTRL_PKT_SZ  32
+#define EP_CTRL_PKTSZ   PKTSZ_32
+
 void hw_init();
 void hw_intp_disable();
 void hw_intp_enable();
+void hw_sleep();
 U8 hw_flash_get_byte(U8 *addr);
 
 #endif
@@ -42,7 +42,9 @@
 #endif
 
 
-static SI32_USBEP_A_Type* const usb_ep[] = { SI32_USB_0_EP1, SI32_USB_0_EP2, SI32_USB_0_EP3, SI32_USB_0_EP4 };
+// not const so it's in sram, where the usb interrupt can still read it while
+// the flash is busy
+static SI32_USBEP_A_Type* usb_ep[] = { SI32_USB_0_EP1, SI32_USB_0_EP2, SI32_USB_0_EP3, SI32_USB_0_EP4 };
 
 /**************************************************************************/
 /*!
@@ -60,7 +62,7 @@ void ep_select(U8 ep_num)
   Get the direction of the endpoint.
 */
 /**************************************************************************/
-U8 ep_dir_get( U8 ep_num )
+RAMFUNC U8 ep_dir_get( U8 ep_num )
 {
     if( ep_num == 1 || ep_num == 2 )
         return DIR_IN;
@@ -319,13 +321,37 @@ void ep_write(U8 ep_num)
     }
 }
 
+/**************************************************************************/
+/*!
+  Write one packet straight from memory into the control endpoint's FIFO and
+  hand it to the hardware. Unlike ep_write(), the data doesn't go through the
+  endpoint's ring buffer so large blocks can be sent without copying them
+  first. A len of zero sends a zero length packet. The flash is memory mapped
+  on this part so read_from_flash makes no difference here.
+*/
+/**************************************************************************/
+void ep_write_ctrl(U8 *data, U8 len, bool read_from_flash)
+{
+    U8 i;
+
+    // Make sure we're free to write
+    while( SI32_USB_A_read_ep0control(SI32_USB_0) & SI32_USB_A_EP0CONTROL_IPRDYI_MASK );
+
+    for (i=0; i<len; i++)
+    {
+        SI32_USB_A_write_ep0_fifo_u8( SI32_USB_0, read_from_flash ? hw_flash_get_byte( data + i ) : data[i] );
+    }
+
+    SI32_USB_0->EP0CONTROL.U32 = SI32_USB_A_read_ep0control(SI32_USB_0) | SI32_USB_A_EP0CONTROL_IPRDYI_MASK;
+}
+
 /**************************************************************************/
 /*!
   Read data from the endpoint's FIFO. This is where data coming into the
   device from the host is stored.
 */
 /**************************************************************************/
-void ep_read(U8 ep_num)
+RAMFUNC void ep_read(U8 ep_num)
 {
     U8 i, len = 0;
     usb_pcb_t *pcb = usb_pcb_get();
@@ -383,6 +409,21 @@ void ep_read(U8 ep_num)
     //cdc_demo_putchar("a", NULL);
 }
 
+/**************************************************************************/
+/*!
+  Tell the hardware that we're done with the OUT packet sitting in the
+  endpoint so that it can accept the next one. Until this is done, the
+  host will be NAK'd.
+*/
+/**************************************************************************/
+void ep_clear_out_ready(U8 ep_num)
+{
+    if( ep_num == 0 )
+        SI32_USB_A_clear_out_packet_ready_ep0( SI32_USB_0 );
+    else if( ep_num <= sizeof( usb_ep ) / sizeof( usb_ep[ 0 ] ) )
+        SI32_USBEP_A_clear_outpacket_ready( usb_ep[ ep_num - 1 ] );
+}
+
 /**************************************************************************/
 /*!
   Send a zero length packet on the specified endpoint. This is usually used
@@ -431,7 +472,7 @@ void ep_set_stall(U8 ep_num)
   This function will clear the stall on an endpoint.
 */
 /**************************************************************************/
-void ep_clear_stall(U8 ep_num)
+RAMFUNC void ep_clear_stall(U8 ep_num)
 {
     usb_pcb_t *pcb = usb_pcb_get();
 
@@ -489,7 +530,7 @@ void ep_init()
     //UERST = 0;
 
     // configure the control endpoint first since that one is needed for enumeration
-    ep_config( EP_CTRL, XFER_CONTROL, DIR_OUT, MAX_PACKET_SZ );
+    ep_config( EP_CTRL, XFER_CONTROL, DIR_OUT, EP_CTRL_PKTSZ );
 
     NVIC_EnableIRQ( USB0_IRQn );
 
@@ -51,6 +51,19 @@
 #include "freakusb.h"
 #include "types.h"
 
+// Nothing the bootloader keeps in flash may end up inside a slot, or an
+// update would wipe it. Checked here since hw.h is also read before the
+// part's flash size is known.
+#if ( DFU_JOURNAL_PAGE + FLASH_PAGE_SIZE_U8 > HW_SLOT_BASE( 0 ) )
+#error "DFU_JOURNAL_PAGE runs into the first application slot"
+#endif
+#if ( HW_SLOT_BASE( HW_SLOTS ) > HW_CONFIG_START )
+#error "the application slots run into the config pages"
+#endif
+#if defined( HW_AB_SLOTS ) && ( HW_BOOTCTL_PAGE + FLASH_PAGE_SIZE_U8 > HW_CONFIG_START )
+#error "HW_BOOTCTL_PAGE runs into the config pages"
+#endif
+
 /**************************************************************************/
 /*!
     Initialize the hardware.
@@ -82,27 +95,162 @@ bool SI32_USB_A_verify_clock_is_running(SI32_USB_A_Type * usb)
   return true;
 }
 
-void hw_wait_ms(U32 delay_amount)
+extern uint32_t SystemCoreClock;
+
+// ms since the timebase was started. counted by SysTick_Handler().
+extern volatile U32 hw_ms_ticks;
+
+// bus resets seen and when the last one ended. kept by intp_eor().
+extern volatile U8 hw_usb_resets;
+extern volatile U32 hw_usb_reset_ms;
+
+/**************************************************************************/
+/*!
+    Start the 1 ms timebase on SysTick. It runs off the core clock so it needs
+    to be started again if that's changed. It doesn't need the host, unlike
+    the USB frame number.
+*/
+/**************************************************************************/
+void hw_timebase_init( void )
+{
+    hw_ms_ticks = 0;
+    SysTick_Config( SystemCoreClock / 1000 );
+}
+
+/**************************************************************************/
+/*!
+    Return the current time in ms. Use hw_ms_since() to get the time that
+    has elapsed.
+*/
+/**************************************************************************/
+U32 hw_ms_get( void )
+{
+    return hw_ms_ticks;
+}
+
+/**************************************************************************/
+/*!
+    Return the number of ms since the specified hw_ms_get() time.
+*/
+/**************************************************************************/
+U32 hw_ms_since( U32 start )
+{
+    return hw_ms_ticks - start;
+}
+
+/**************************************************************************/
+/*!
+    Return the time in us since the timebase was started. It wraps after
+    about 71 minutes.
+*/
+/**************************************************************************/
+U32 hw_us_get( void )
+{
+    U32 ms, val;
+
+    // read both halves again if the ms tick went off in between
+    do
+    {
+        ms = hw_ms_ticks;
+        val = SysTick->VAL;
+    } while( ms != hw_ms_ticks );
+
+    return ( ms * 1000 ) + ( SysTick->LOAD - val ) / ( SystemCoreClock / 1000000 );
+}
+
+/**************************************************************************/
+/*!
+    Busy wait for the specified number of us. This counts SysTick down
+    directly so it works with interrupts disabled.
+*/
+/**************************************************************************/
+void hw_delay_us( U32 delay_us )
+{
+    U32 reload = SysTick->LOAD + 1;
+    U32 left = delay_us * ( SystemCoreClock / 1000000 );
+    U32 last = SysTick->VAL;
+    U32 now, elapsed;
+
+    while( left != 0 )
+    {
+        now = SysTick->VAL;
+        elapsed = ( last >= now ) ? ( last - now ) : ( last + reload - now );
+        last = now;
+
+        if( elapsed >= left )
+            break;
+        left -= elapsed;
+    }
+}
+
+/**************************************************************************/
+/*!
+    Busy wait for the specified number of ms.
+*/
+/**************************************************************************/
+void hw_delay_ms( U32 delay_ms )
+{
+    for( ; delay_ms != 0; delay_ms-- )
+    {
+        hw_delay_us( 1000 );
+    }
+}
+
+/**************************************************************************/
+/*!
+    Return the time the bootloader took from hw_init() to jumping into the
+    image in us. It's zero if the image wasn't started by the bootloader.
+*/
+/**************************************************************************/
+U32 hw_boot_time_get( void )
+{
+    return hw_mbox_get()->boot_time_us;
+}
+
+/**************************************************************************/
+/*!
+    Return the number of the last USB frame. It only moves while a host is
+    sending SOFs.
+*/
+/**************************************************************************/
+U32 hw_usb_frame_get( void )
 {
-   U32 elapsed_time, start_time, last_time;
+    return SI32_USB_0->FRAME.U32;
+}
 
-   elapsed_time = 0;
-   start_time = SI32_USB_0->FRAME.U32;
+/**************************************************************************/
+/*!
+    Return 1 if a host has reset the bus since hw_init().
+*/
+/**************************************************************************/
+U8 hw_usb_reset_seen( void )
+{
+    return ( hw_usb_resets != 0 );
+}
 
-   while (elapsed_time < delay_amount)
-   {
-      // Find how much time has elapsed
-      last_time = SI32_USB_0->FRAME.U32;
+/**************************************************************************/
+/*!
+    Return the ms since the host last reset the bus. Only means something
+    once hw_usb_reset_seen() says there was a reset.
+*/
+/**************************************************************************/
+U32 hw_usb_reset_ms_since( void )
+{
+    return hw_ms_since( hw_usb_reset_ms );
+}
 
-      if (last_time >= start_time)
-      {
-         elapsed_time = last_time - start_time;
-      }
-      else
-      {
-         elapsed_time = 2048 + last_time - start_time;
-      }
-   }
+/**************************************************************************/
+/*!
+    Wait until the host has taken the packet that's loaded into the control
+    endpoint, for up to timeout_ms.
+*/
+/**************************************************************************/
+void hw_ctrl_wait_sent( U32 timeout_ms )
+{
+    U32 start = hw_ms_get();
+
+    while( ( SI32_USB_A_read_ep0control( SI32_USB_0 ) & SI32_USB_A_EP0CONTROL_IPRDYI_MASK ) &&
+           ( hw_ms_since( start ) < timeout_ms ) );
 }
 
 // void hard_fault_handler_c(unsigned int * hardfault_args)
@@ -188,7 +336,6 @@ void mySystemInit()
 
 #if defined( USE_DFU_CLASS )
 
-extern uint32_t SystemCoreClock;
 U32 cmsis_get_cpu_frequency()
 {
   return SystemCoreClock;
@@ -206,9 +353,16 @@ static void gTIMER1_enter_auto_reload_config(void)
   SI32_TIMER_A_select_high_clock_source_apb_clock (SI32_TIMER_1);
   SI32_TIMER_A_select_high_auto_reload_mode (SI32_TIMER_1);
 
+#if defined( LED_HW_PWM )
+  // the EPCA does the duty cycle. the ISR reloads the count for whenever
+  // the next LED changes, this just gets it going.
+  SI32_TIMER_A_write_capture (SI32_TIMER_1, (unsigned) -(cmsis_get_cpu_frequency()/1000*LED_STEP_MS));
+  SI32_TIMER_A_write_count (SI32_TIMER_1, (unsigned) -(cmsis_get_cpu_frequency()/1000*LED_STEP_MS));
+#else
   // Set overflow frequency to SYSTICKHZ
   SI32_TIMER_A_write_capture (SI32_TIMER_1, (unsigned) -(cmsis_get_cpu_frequency()/LEDTICKHZ));
   SI32_TIMER_A_write_count (SI32_TIMER_1, (unsigned) -(cmsis_get_cpu_frequency()/LEDTICKHZ));
+#endif
 
   // Run Timer
   SI32_TIMER_A_start_high_timer(SI32_TIMER_1);
@@ -219,6 +373,58 @@ static void gTIMER1_enter_auto_reload_config(void)
   SI32_TIMER_A_enable_high_overflow_interrupt(SI32_TIMER_1);
 }
 
+#if defined( LED_HW_PWM )
+
+/**************************************************************************/
+/*!
+    Put EPCA0 CEX0..5 on the six LED pins. The crossbar hands out signals
+    to the first pins that aren't skipped, so every PB0 pin below the LEDs
+    gets skipped. All channels run edge-aligned PWM off one LED_PWM_LIMIT
+    period and start with the LEDs off. New duty cycles go through CCAPVUPD
+    so they only take effect at the end of a period.
+*/
+/**************************************************************************/
+static void gEPCA0_enter_pwm_config(void)
+{
+  SI32_EPCACH_A_Type * const ch[LED_PWM_CHANNELS] = {
+    SI32_EPCA_0_CH0, SI32_EPCA_0_CH1, SI32_EPCA_0_CH2,
+    SI32_EPCA_0_CH3, SI32_EPCA_0_CH4, SI32_EPCA_0_CH5
+  };
+  U8 i;
+
+  SI32_CLKCTRL_A_enable_apb_to_modules_0(SI32_CLKCTRL_0,
+    SI32_CLKCTRL_A_APBCLKG0_EPCA0CEN_ENABLED_U32);
+
+  SI32_EPCA_A_stop_counter_timer(SI32_EPCA_0);
+  SI32_EPCA_A_select_input_clock_apb(SI32_EPCA_0);
+  SI32_EPCA_A_set_clock_divider(SI32_EPCA_0, cmsis_get_cpu_frequency()/((LED_PWM_LIMIT+1)*LED_PWM_HZ));
+  SI32_EPCA_A_write_counter(SI32_EPCA_0, 0);
+  SI32_EPCA_A_write_limit(SI32_EPCA_0, LED_PWM_LIMIT);
+  SI32_EPCA_A_enable_internal_register_update_on_overflow(SI32_EPCA_0);
+
+  for(i=0;i<LED_PWM_CHANNELS;i++)
+  {
+    SI32_EPCACH_A_select_operating_mode_edge_aligned_pwm(ch[i]);
+    SI32_EPCACH_A_select_output_mode_toggle(ch[i]);
+    SI32_EPCACH_A_write_ccapv(ch[i], LED_PWM_LIMIT+1);
+    SI32_EPCACH_A_write_ccapvupd(ch[i], LED_PWM_LIMIT+1);
+  }
+
+#if defined( PCB_V8 )
+  SI32_PBSTD_A_write_pbskipen(SI32_PBSTD_0, 0x000F);  // PB0.0-3, LEDs are PB0.4-9
+  SI32_PBSTD_A_set_pins_push_pull_output(SI32_PBSTD_0, 0x03F0);
+#else
+  SI32_PBSTD_A_write_pbskipen(SI32_PBSTD_0, 0x00FF);  // PB0.0-7, LEDs are PB0.8-13
+  SI32_PBSTD_A_set_pins_push_pull_output(SI32_PBSTD_0, 0x3F00);
+#endif
+  SI32_PBCFG_A_enable_xbar0l_peripherals(SI32_PBCFG_0,
+    SI32_PBCFG_A_XBAR0L_EPCA0EN_STD_CEX0_5_U32);
+
+  SI32_EPCA_A_start_counter_timer(SI32_EPCA_0);
+}
+
+#endif // LED_HW_PWM
+
 #endif // USE_DFU_CLASS
 
 #if defined( PCB_V7 )
@@ -238,6 +444,8 @@ void hw_init()
 {
   usb_pcb_t *pcb = usb_pcb_get();
 
+  // first, so the boot time covers as much of the bootloader as it can
+  hw_timebase_init();
 
   SI32_CLKCTRL_0->APBCLKG0_SET = SI32_CLKCTRL_A_APBCLKG0_PLL0CEN_ENABLED_U32 |
                                  SI32_CLKCTRL_A_APBCLKG0_PB0CEN_ENABLED_U32 |
@@ -345,6 +553,9 @@ SI32_WDTIMER_A_stop_counter(SI32_WDTIMER_0);
   SI32_PBSTD_A_set_pins_push_pull_output(SI32_PBSTD_1, 0x0100); //Set external LEDS 0-4 as outputs
 #endif
 
+#if defined( LED_HW_PWM )
+  gEPCA0_enter_pwm_config();
+#endif
   gTIMER1_enter_auto_reload_config();
 
 #endif // USE_DFU_CLASS
@@ -404,107 +615,599 @@ U8 hw_flash_get_byte(U8 *addr)
     return ( U8 )*addr;
 }
 
+/**************************************************************************/
+/*!
+    Return 1 if count words of flash starting at address are all erased.
+*/
+/**************************************************************************/
+U8 hw_flash_is_blank( U32 address, U32 count )
+{
+    U32* word = ( U32* )address;
+
+    for( ; count != 0; count-- )
+    {
+        if( *word++ != 0xFFFFFFFF )
+            return 0;
+    }
+    return 1;
+}
+
 volatile U8 flash_key_mask  = 0x00;
 volatile U8 armed_flash_key = 0x00;
 
-U8 hw_flash_erase( U32 address, U8 verify)
+// set while an erase or write is in progress. interrupt code that lives in
+// flash checks it and leaves its work for the main loop.
+volatile U8 hw_flash_busy   = 0x00;
+
+// core exceptions plus the chip's interrupts
+#define HW_NUM_VECTORS      ( 16 + VREG0LOW_IRQn + 1 )
+
+// copy of the vector table for while the flash is busy. vtor wants it aligned
+// to the size of the table rounded up to a power of two.
+static U32 hw_ram_vectors[ HW_NUM_VECTORS ] __attribute__ ((aligned(512)));
+
+/**************************************************************************/
+/*!
+    Switch to a copy of the current vector table in sram. An interrupt that
+    comes in while the flash is busy would otherwise sit waiting on the fetch
+    of its vector. Returns the table that was in use so it can be put back.
+*/
+/**************************************************************************/
+static RAMFUNC U32 hw_flash_vectors_to_ram( void )
 {
+    U32 vtor = SCB->VTOR;
+    U32 i;
+
+    for( i = 0; i < HW_NUM_VECTORS; i++ )
+    {
+        hw_ram_vectors[ i ] = (( U32* )vtor)[ i ];
+    }
+    SCB->VTOR = ( U32 )hw_ram_vectors;
+    __DSB();
+
+    return vtor;
+}
+
+/**************************************************************************/
+/*!
+    Erase the flash page at address if data is NULL, otherwise program count
+    words from data at address. This runs from sram and only keeps interrupts
+    off while the flash is being unlocked, so the usb interrupt is still
+    serviced while the flash is busy. With verify, the flash is read back
+    afterwards and 1 is returned if it doesn't hold what it should.
+*/
+/**************************************************************************/
+static RAMFUNC U8 hw_flash_op( U32 address, U32* data, U32 count, U8 verify )
+{
+    U32* word = ( U32* )address;
+    U32 wc, vtor;
     flash_key_mask = 0x01;
 
     // Write the address of the Flash page to WRADDR
     SI32_FLASHCTRL_A_write_wraddr( SI32_FLASHCTRL_0, address );
-    // Enter Flash Erase Mode
-    SI32_FLASHCTRL_A_enter_flash_erase_mode( SI32_FLASHCTRL_0 );
+    if( data == NULL )
+        SI32_FLASHCTRL_A_enter_flash_erase_mode( SI32_FLASHCTRL_0 );
+    else
+        SI32_FLASHCTRL_A_exit_flash_erase_mode( SI32_FLASHCTRL_0 );
 
-    // Disable interrupts
-    hw_intp_disable();
+    hw_flash_busy = 1;
+    vtor = hw_flash_vectors_to_ram();
 
-    // Unlock the flash interface for a single access
+    // Disable interrupts. the keys have to go in back to back.
+    __disable_irq();
+
+    // Unlock the flash interface, for a single access to erase and for
+    // multiple accesses to write
     armed_flash_key = flash_key_mask ^ 0xA4;
     SI32_FLASHCTRL_A_write_flash_key(SI32_FLASHCTRL_0, armed_flash_key);
-    armed_flash_key = flash_key_mask ^ 0xF0;
+    armed_flash_key = flash_key_mask ^ ( ( data == NULL ) ? 0xF0 : 0xF3 );
     SI32_FLASHCTRL_A_write_flash_key(SI32_FLASHCTRL_0, armed_flash_key);
     armed_flash_key = 0;
 
-    // Write any value to initiate a page erase.
-    SI32_FLASHCTRL_A_write_wrdata(SI32_FLASHCTRL_0, 0xA5);
+    if( data == NULL )
+    {
+        // Write any value to initiate a page erase.
+        SI32_FLASHCTRL_A_write_wrdata(SI32_FLASHCTRL_0, 0xA5);
+    }
+
+    // re-enable interrupts. a write leaves the interface unlocked until it's
+    // relocked below, and nothing in an interrupt touches it.
+    __enable_irq();
+
+    if( data != NULL )
+    {
+        // Write word-sized
+        for( wc = 0; wc < count; wc++ )
+        {
+            SI32_FLASHCTRL_A_write_wrdata( SI32_FLASHCTRL_0, data[wc] );
+            SI32_FLASHCTRL_A_write_wrdata( SI32_FLASHCTRL_0, data[wc] >> 16 );
+        }
+
+        // Relock flash interface
+        SI32_FLASHCTRL_A_write_flash_key( SI32_FLASHCTRL_0, 0x5A );
+    }
 
     // Wait for flash operation to complete
-    while (SI32_FLASHCTRL_A_is_flash_busy(SI32_FLASHCTRL_0));
+    while( SI32_FLASHCTRL_A_is_flash_busy( SI32_FLASHCTRL_0 ) );
+
+    SCB->VTOR = vtor;
+    hw_flash_busy = 0;
 
     if( verify )
     {
-        address &= ~(FLASH_PAGE_SIZE_U8 - 1); // Round down to nearest even page address
-        U32* verify_address = (U32*)address;
-        U32 wc;
-
-        for( wc = FLASH_PAGE_SIZE_U32; wc != 0; wc-- )
+        for( wc = 0; wc < count; wc++ )
         {
-            if ( *verify_address != 0xFFFFFFFF )
+            if( word[wc] != ( ( data == NULL ) ? 0xFFFFFFFF : data[wc] ) )
+            {
                 return 1;
-
-            verify_address++;
+            }
         }
     }
 
-    hw_intp_enable();
-
     return 0;
 }
 
+/**************************************************************************/
+/*!
+    Erase the flash page that holds address.
+*/
+/**************************************************************************/
+RAMFUNC U8 hw_flash_erase( U32 address, U8 verify)
+{
+    // Round down to the start of the page
+    return hw_flash_op( address & ~( FLASH_PAGE_SIZE_U8 - 1 ), NULL, FLASH_PAGE_SIZE_U32, verify );
+}
 
-U8 hw_flash_write( U32 address, U32* data, U32 count, U8 verify )
+/**************************************************************************/
+/*!
+    Program count words at address.
+*/
+/**************************************************************************/
+RAMFUNC U8 hw_flash_write( U32 address, U32* data, U32 count, U8 verify )
 {
-    U32* tmpdata = data;
-    U32 wc;
-    flash_key_mask = 0x01;
+    return hw_flash_op( address, data, count, verify );
+}
 
-    // Write the address of the Flash page to WRADDR
-    SI32_FLASHCTRL_A_write_wraddr( SI32_FLASHCTRL_0, address );
-    // Enter flash erase mode
-    SI32_FLASHCTRL_A_exit_flash_erase_mode(SI32_FLASHCTRL_0);
+/**************************************************************************/
+/*!
+    Start a new CRC32 on the CRC0 engine. It's the 0x04C11DB7 polynomial
+    seeded with all ones and fed a 32 bit word at a time, most significant bit
+    first, with no reflection or final xor.
+*/
+/**************************************************************************/
+void hw_crc_start( void )
+{
+    SI32_CLKCTRL_A_enable_apb_to_modules_0( SI32_CLKCTRL_0,
+                                            SI32_CLKCTRL_A_APBCLKG0_CRC0CEN_ENABLED_U32 );
+
+    SI32_CRC_A_select_polynomial_32_bit_04C11DB7( SI32_CRC_0 );
+    SI32_CRC_A_select_word_mode( SI32_CRC_0 );
+    SI32_CRC_A_disable_bit_reversal( SI32_CRC_0 );
+    SI32_CRC_A_set_processing_order( SI32_CRC_0, SI32_CRC_A_PROCESSING_ORDER_NO_BYTE_REORIENTATION );
+    SI32_CRC_A_enable_module( SI32_CRC_0 );
+    SI32_CRC_A_initialize_seed_to_one( SI32_CRC_0 );
+}
 
-    // disable interrupts
-    hw_intp_disable();
+/**************************************************************************/
+/*!
+    Feed count words into the CRC that was started with hw_crc_start().
+*/
+/**************************************************************************/
+void hw_crc_add( const U32 *data, U32 count )
+{
+    for( ; count != 0; count-- )
+    {
+        SI32_CRC_A_write_data( SI32_CRC_0, *data++ );
+    }
+}
 
-    // Unlock flash interface for multiple accesses
-    armed_flash_key = flash_key_mask ^ 0xA4;
-    SI32_FLASHCTRL_A_write_flash_key(SI32_FLASHCTRL_0, armed_flash_key);
-    armed_flash_key = flash_key_mask ^ 0xF3;
-    SI32_FLASHCTRL_A_write_flash_key(SI32_FLASHCTRL_0, armed_flash_key);
-    armed_flash_key = 0;
+/**************************************************************************/
+/*!
+    Return the CRC of everything fed in since hw_crc_start().
+*/
+/**************************************************************************/
+U32 hw_crc_result( void )
+{
+    return SI32_CRC_A_read_result( SI32_CRC_0 );
+}
+
+/**************************************************************************/
+/*!
+    Get the AES engine ready to encrypt with the 128 bit key. CTR and CMAC
+    only ever encrypt so there's no decryption key to work out.
+*/
+/**************************************************************************/
+void hw_aes_start( const U32 *key )
+{
+    SI32_CLKCTRL_A_enable_apb_to_modules_0( SI32_CLKCTRL_0,
+                                            SI32_CLKCTRL_A_APBCLKG0_AES0CEN_ENABLED_U32 );
+
+    SI32_AES_A_write_control( SI32_AES_0, SI32_AES_A_CONTROL_KEYSIZE_KEY128_U32 |
+                                          SI32_AES_A_CONTROL_EDMD_ENCRYPT_U32 |
+                                          SI32_AES_A_CONTROL_SWMDEN_ENABLED_U32 );
+    SI32_AES_0->HWKEY0.U32 = key[0];
+    SI32_AES_0->HWKEY1.U32 = key[1];
+    SI32_AES_0->HWKEY2.U32 = key[2];
+    SI32_AES_0->HWKEY3.U32 = key[3];
+}
+
+/**************************************************************************/
+/*!
+    Encrypt one 16 byte block in place with the key from hw_aes_start(). In
+    software mode the data fifo only holds a block, more than that at once
+    takes DMA.
+*/
+/**************************************************************************/
+void hw_aes_block( U32 *block )
+{
+    U8 i;
 
-    // Write word-sized
-    for( wc = count; wc != 0; wc-- )
+    SI32_AES_A_write_xfrsize( SI32_AES_0, 0 );
+    for( i = 0; i < 4; i++ )
     {
-        SI32_FLASHCTRL_A_write_wrdata( SI32_FLASHCTRL_0, *data );
-        SI32_FLASHCTRL_A_write_wrdata( SI32_FLASHCTRL_0, *data >> 16 );
-        data++;
+        SI32_AES_A_write_datafifo( SI32_AES_0, block[i] );
     }
+    SI32_AES_A_start_operation( SI32_AES_0 );
+    while( SI32_AES_A_is_busy( SI32_AES_0 ) );
 
-    // Relock flash interface
-    SI32_FLASHCTRL_A_write_flash_key( SI32_FLASHCTRL_0, 0x5A );
+    for( i = 0; i < 4; i++ )
+    {
+        block[i] = SI32_AES_A_read_datafifo( SI32_AES_0 );
+    }
+}
 
-    // Wait for flash operation to complete
-    while( SI32_FLASHCTRL_A_is_flash_busy(SI32_FLASHCTRL_0 ) );
+/**************************************************************************/
+/*!
+    Decrypt count words in place with AES-CTR. ctr is the 16 byte big endian
+    counter block, it's advanced past the data so the next call carries on
+    from there.
+*/
+/**************************************************************************/
+void hw_aes_ctr( U32 *data, U32 count, U8 *ctr )
+{
+    U32 block[4];
+    U32 n, i;
 
-    if( verify )
+    while( count != 0 )
+    {
+        n = ( count < 4 ) ? count : 4;
+        memcpy( block, ctr, sizeof( block ) );
+        hw_aes_block( block );
+        for( i = 0; i < n; i++ )
+        {
+            data[i] ^= block[i];
+        }
+
+        for( i = 16; ( i != 0 ) && ( ++ctr[i - 1] == 0 ); i-- );
+
+        data += n;
+        count -= n;
+    }
+}
+
+/**************************************************************************/
+/*!
+    Double a block in GF(2^128), the way CMAC makes its subkeys.
+*/
+/**************************************************************************/
+static void hw_aes_dbl( U8 *b )
+{
+    U8 msb = b[0] & 0x80;
+    U8 i;
+
+    for( i = 0; i < 15; i++ )
     {
-        U32* verify_address = (U32*)address;
+        b[i] = ( b[i] << 1 ) | ( b[i + 1] >> 7 );
+    }
+    b[15] = ( b[15] << 1 ) ^ ( msb ? 0x87 : 0 );
+}
 
-        for( wc = count; wc != 0; wc-- )
+/**************************************************************************/
+/*!
+    Work out the AES-CMAC (RFC 4493) of count words with the key from
+    hw_aes_start(). The data can be read straight out of flash. mac comes in
+    as the chaining value, zeros to start a message or the encrypted XOR of
+    the blocks that went before it, and goes out as the 16 byte MAC.
+*/
+/**************************************************************************/
+void hw_aes_cmac( const U32 *data, U32 count, U32 *mac )
+{
+    U32 k[4];
+    U32 n, i;
+
+    // the subkey for a whole last block is the encrypted zero block doubled,
+    // a padded one gets it doubled again
+    memset( k, 0, sizeof( k ) );
+    hw_aes_block( k );
+    hw_aes_dbl( ( U8* )k );
+
+    do
+    {
+        n = ( count < 4 ) ? count : 4;
+        for( i = 0; i < n; i++ )
         {
-            if (*verify_address != *tmpdata++)
-                return 1;
+            mac[i] ^= data[i];
+        }
+
+        if( count <= 4 )
+        {
+            if( n < 4 )
+            {
+                ( ( U8* )mac )[n * 4] ^= 0x80;
+                hw_aes_dbl( ( U8* )k );
+            }
+            for( i = 0; i < 4; i++ )
+            {
+                mac[i] ^= k[i];
+            }
+        }
+        hw_aes_block( mac );
+
+        data += n;
+        count -= n;
+    } while( count != 0 );
+}
+
+/**************************************************************************/
+/*!
+    Return the address just past the application image in the slot at base.
+    Erased flash at the top of the slot isn't part of the image so it's
+    trimmed off, down to the last word that holds something.
+*/
+/**************************************************************************/
+U32 hw_image_end_get( U32 base )
+{
+    U32 end = base + HW_SLOT_SIZE;
+
+    // skip the blank pages first, then the blank words of the last used page
+    while( ( end > base ) && hw_flash_is_blank( end - BLOCK_SIZE_U8, FLASH_PAGE_SIZE_U32 ) )
+    {
+        end -= BLOCK_SIZE_U8;
+    }
+    while( ( end > base ) && hw_flash_is_blank( end - 4, 1 ) )
+    {
+        end -= 4;
+    }
+    return end;
+}
+
+/**************************************************************************/
+/*!
+    Return 1 if the application image in the slot at base ends in a CRC
+    trailer that matches the image. The trailer is the last thing in the image
+    so it's found by trimming off the erased flash above it.
+*/
+/**************************************************************************/
+U8 hw_image_crc_ok( U32 base )
+{
+    U32 end = hw_image_end_get( base );
+    hw_image_trailer_t *trailer = ( hw_image_trailer_t* )( end - sizeof( hw_image_trailer_t ) );
+
+    if( end < base + sizeof( hw_image_trailer_t ) )
+        return 0;
+
+    if( ( trailer->magic != HW_IMAGE_CRC_MAGIC ) ||
+        ( trailer->len != ( U32 )trailer - base ) )
+        return 0;
+
+    hw_crc_start();
+    hw_crc_add( ( U32* )base, trailer->len / 4 );
+    return ( hw_crc_result() == trailer->crc );
+}
+
+#if defined( HW_AB_SLOTS )
+// what the boot control page says
+typedef struct
+{
+    U8 active;                  // the slot that was last confirmed
+    U8 trial;                   // slot waiting for or on its trial boot, HW_SLOT_NONE if none
+    U8 tried;                   // the trial boot has started
+    hw_bootctl_rec_t *next;     // where the next record goes, NULL if the page is full
+} hw_bootctl_t;
+
+/**************************************************************************/
+/*!
+    Go through the records in the boot control page. Without any, slot 0 is
+    the active one since that's where a debugger puts the first image.
+*/
+/**************************************************************************/
+static void hw_bootctl_scan( hw_bootctl_t *ctl )
+{
+    hw_bootctl_rec_t *rec = ( hw_bootctl_rec_t* )HW_BOOTCTL_PAGE;
+    hw_bootctl_rec_t *end = rec + HW_BOOTCTL_RECS;
+    U8 slot;
+
+    ctl->active = 0;
+    ctl->trial = HW_SLOT_NONE;
+    ctl->tried = 0;
+    ctl->next = NULL;
+
+    for( ; rec < end; rec++ )
+    {
+        if( ( rec->rec == 0xFFFFFFFF ) && ( rec->rec_inv == 0xFFFFFFFF ) )
+        {
+            ctl->next = rec;
+            break;
+        }
+
+        slot = rec->rec & ~HW_BOOTCTL_TYPE_MASK;
+        if( ( rec->rec_inv != ~rec->rec ) || ( slot >= HW_SLOTS ) )
+            continue;
+
+        switch( rec->rec & HW_BOOTCTL_TYPE_MASK )
+        {
+        case HW_BOOTCTL_TRIAL:
+            ctl->trial = slot;
+            ctl->tried = 0;
+            break;
+        case HW_BOOTCTL_TRIED:
+            ctl->tried = ( slot == ctl->trial );
+            break;
+        case HW_BOOTCTL_CONFIRM:
+            // whichever slot confirms, a trial that was still open is over
+            ctl->active = slot;
+            ctl->trial = HW_SLOT_NONE;
+            break;
+        }
+    }
+}
+
+/**************************************************************************/
+/*!
+    Write a record to the next free spot in the boot control page.
+*/
+/**************************************************************************/
+static void hw_bootctl_write( hw_bootctl_t *ctl, U32 type, U8 slot )
+{
+    hw_bootctl_rec_t rec;
+
+    if( ctl->next == NULL )
+        return;
+
+    rec.rec = type | slot;
+    rec.rec_inv = ~rec.rec;
+    hw_flash_write( ( U32 )ctl->next, ( U32* )&rec, sizeof( rec ) / 4, 1 );
+
+    ctl->next++;
+    if( ctl->next == ( hw_bootctl_rec_t* )HW_BOOTCTL_PAGE + HW_BOOTCTL_RECS )
+    {
+        ctl->next = NULL;
+    }
+}
+
+/**************************************************************************/
+/*!
+    Add a record to the boot control page. A full page is erased and starts
+    over with the records it takes to say the same thing.
+*/
+/**************************************************************************/
+static void hw_bootctl_add( hw_bootctl_t *ctl, U32 type, U8 slot )
+{
+    if( ctl->next == NULL )
+    {
+        hw_flash_erase( HW_BOOTCTL_PAGE, 1 );
+        ctl->next = ( hw_bootctl_rec_t* )HW_BOOTCTL_PAGE;
 
-            verify_address++;
+        hw_bootctl_write( ctl, HW_BOOTCTL_CONFIRM, ctl->active );
+        if( ctl->trial != HW_SLOT_NONE )
+        {
+            hw_bootctl_write( ctl, HW_BOOTCTL_TRIAL, ctl->trial );
+            if( ctl->tried )
+            {
+                hw_bootctl_write( ctl, HW_BOOTCTL_TRIED, ctl->trial );
+            }
         }
     }
+    hw_bootctl_write( ctl, type, slot );
+}
+#endif // HW_AB_SLOTS
 
-    // re-enable interrupts
-    hw_intp_enable();
+/**************************************************************************/
+/*!
+    Return the slot that's running, or that will be booted if it's a new
+    image that hasn't been tried yet. Updates don't go there.
+*/
+/**************************************************************************/
+U8 hw_slot_active_get( void )
+{
+#if defined( HW_AB_SLOTS )
+    hw_bootctl_t ctl;
 
+    hw_bootctl_scan( &ctl );
+    return ctl.active;
+#else
     return 0;
+#endif
+}
+
+/**************************************************************************/
+/*!
+    Return the slot an update goes into.
+*/
+/**************************************************************************/
+U8 hw_slot_update_get( void )
+{
+#if defined( HW_AB_SLOTS )
+    return 1 - hw_slot_active_get();
+#else
+    return 0;
+#endif
+}
+
+/**************************************************************************/
+/*!
+    Have the next boot try the image in slot. It has to call
+    hw_slot_confirm() before the following reset or the bootloader goes back
+    to the slot that was active before.
+*/
+/**************************************************************************/
+void hw_slot_trial( U8 slot )
+{
+#if defined( HW_AB_SLOTS )
+    hw_bootctl_t ctl;
+
+    hw_bootctl_scan( &ctl );
+    hw_bootctl_add( &ctl, HW_BOOTCTL_TRIAL, slot );
+#endif
+}
+
+/**************************************************************************/
+/*!
+    Called by the application once it's sure it runs fine. The slot it's
+    running from becomes the active one. Nothing is written if it already is.
+*/
+/**************************************************************************/
+void hw_slot_confirm( void )
+{
+#if defined( HW_AB_SLOTS )
+    hw_bootctl_t ctl;
+    U32 slot = ( SCB->VTOR - FLASH_TARGET ) / HW_SLOT_SIZE;
+
+    hw_bootctl_scan( &ctl );
+    if( ( slot < HW_SLOTS ) && ( ( ctl.active != slot ) || ( ctl.trial != HW_SLOT_NONE ) ) )
+    {
+        hw_bootctl_add( &ctl, HW_BOOTCTL_CONFIRM, slot );
+    }
+#endif
+}
+
+/**************************************************************************/
+/*!
+    Pick the slot to boot. A new image gets one go, *trial is set when it's
+    the one picked. If it's still not confirmed by the time it gets here
+    again, the active slot is booted, which is the rollback. If the slot's
+    image isn't all there, the other slot is better than nothing. Each image
+    gets its CRC checked once at most. Returns HW_SLOT_NONE if there's
+    nothing to boot.
+*/
+/**************************************************************************/
+static U8 hw_slot_boot_get( U8 *trial )
+{
+#if defined( HW_AB_SLOTS )
+    hw_bootctl_t ctl;
+    U8 bad = HW_SLOT_NONE;
+
+    *trial = 0;
+    hw_bootctl_scan( &ctl );
+    if( ( ctl.trial != HW_SLOT_NONE ) && !ctl.tried )
+    {
+        if( hw_image_crc_ok( HW_SLOT_BASE( ctl.trial ) ) )
+        {
+            *trial = 1;
+            return ctl.trial;
+        }
+        bad = ctl.trial;
+    }
+
+    if( ( ctl.active != bad ) && hw_image_crc_ok( HW_SLOT_BASE( ctl.active ) ) )
+        return ctl.active;
+    if( ( 1 - ctl.active != bad ) && hw_image_crc_ok( HW_SLOT_BASE( 1 - ctl.active ) ) )
+        return 1 - ctl.active;
+    return HW_SLOT_NONE;
+#else
+    *trial = 0;
+    return hw_image_crc_ok( FLASH_TARGET ) ? 0 : HW_SLOT_NONE;
+#endif
 }
 
 
@@ -517,21 +1220,24 @@ void hw_enable_watchdog( void )
     SI32_WDTIMER_A_stop_counter(SI32_WDTIMER_0);
     SI32_WDTIMER_A_reset_counter (SI32_WDTIMER_0);
     while(SI32_WDTIMER_A_is_threshold_update_pending(SI32_WDTIMER_0));
-    SI32_WDTIMER_A_set_early_warning_threshold (SI32_WDTIMER_0, EARLY_WARNING_THRESHOLD);
-    while(SI32_WDTIMER_A_is_threshold_update_pending(SI32_WDTIMER_0));
     SI32_WDTIMER_A_set_reset_threshold (SI32_WDTIMER_0, RESET_THRESHOLD);
 
     // Enable Watchdog Timer
     SI32_WDTIMER_A_start_counter(SI32_WDTIMER_0);
 
-    /// Enable Watchdog Interrupt
-    NVIC_ClearPendingIRQ(WDTIMER0_IRQn);
-    NVIC_EnableIRQ(WDTIMER0_IRQn);
-    SI32_WDTIMER_A_enable_early_warning_interrupt(SI32_WDTIMER_0);
-
     SI32_RSTSRC_A_enable_watchdog_timer_reset_source(SI32_RSTSRC_0);
 }
 
+/**************************************************************************/
+/*!
+    Keep the watchdog from resetting us for another RESET_DELAY_MS.
+*/
+/**************************************************************************/
+void hw_watchdog_feed( void )
+{
+    SI32_WDTIMER_A_reset_counter( SI32_WDTIMER_0 );
+}
+
 
 void hw_disable_watchdog( void )
 {
@@ -547,23 +1253,56 @@ void hw_disable_watchdog( void )
 // http://www.keil.com/forum/17025/
 void hw_boot_image( int usb_started )
 {
-    volatile uint32_t * image_base = ( volatile uint32_t * )FLASH_TARGET;
+    U8 trial;
+    U8 slot = hw_slot_boot_get( &trial );
+    volatile uint32_t * image_base = ( volatile uint32_t * )HW_SLOT_BASE( slot );
     void ( *enter_image )( void );
-    volatile U32 down_count;
+#if defined( HW_AB_SLOTS )
+    hw_bootctl_t ctl;
+#endif
 
-    if( *image_base != 0xFFFFFFFF )
+    // only jump to an image that's all there
+    if( slot != HW_SLOT_NONE )
     {
         if( usb_started )
         {
+          // drop off the bus so the host sees the image come up as a new
+          // device. the hub only needs SE0 for 2.5 us to see the disconnect.
           SI32_USB_A_disable_internal_pull_up( SI32_USB_0 );
-          for( down_count = 0x147AE1; down_count != 0; down_count-- );
+          hw_delay_us( HW_PULLUP_RELEASE_US );
         }
 
         // Disable USB Interrupts
         NVIC_DisableIRQ( USB0_IRQn );
 
+        // the image sets up its own watchdog if it wants one
+        hw_disable_watchdog();
+
+#if defined( USE_DFU_CLASS )
+        // and finds the LED pins as plain GPIO again
+        hw_led_pwm_stop();
+#endif
+
+        // note when the image got started, then leave SysTick the way reset
+        // does for the image's own hw_init()
+        hw_mbox_get()->boot_count++;
+        hw_mbox_get()->boot_time_us = hw_us_get();
+        hw_mbox_commit();
+        SysTick->CTRL = 0;
+        SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+
+#if defined( HW_AB_SLOTS )
+        // the trial only counts as used once nothing can stop the jump. a
+        // reset before here leaves the new image its go.
+        if( trial )
+        {
+            hw_bootctl_scan( &ctl );
+            hw_bootctl_add( &ctl, HW_BOOTCTL_TRIED, slot );
+        }
+#endif
+
         // Update interrupt vector table
-        SCB->VTOR = FLASH_TARGET;
+        SCB->VTOR = ( U32 )image_base;
 
         // Configure image stack pointer
         __set_MSP( *image_base );
@@ -576,10 +1315,11 @@ void hw_boot_image( int usb_started )
 #if defined( USE_DFU_CLASS )
 
 extern U8 led_mask;
-extern U8 * led_pending_mode_ptr[LED_COUNT];
-extern U8 const * led_cled_ptr[12];
+extern led_seg_t const * led_pending_mode_ptr[LED_COUNT];
+extern led_seg_t const * led_cled_ptr[12];
 extern U8 led_pending_repeats_ptr[LED_COUNT];
-extern U8 * led_mode_ptr[LED_COUNT];
+extern led_seg_t const * led_mode_ptr[LED_COUNT];
+extern volatile U8 led_kick;
 
 void hw_led_set_mask( U8 mask )
 {
@@ -592,8 +1332,38 @@ void hw_led_set_mode(int led, int mode, int cycles)
     return;
   if(cycles > 255)
     cycles = 255;
-  led_pending_mode_ptr[led] = (U8 *)led_cled_ptr[mode];
   led_pending_repeats_ptr[led] = cycles;
+  led_pending_mode_ptr[led] = led_cled_ptr[mode];
+
+  // have the LED ISR work out when the new mode can start
+  led_kick = 1;
+#if defined( LED_HW_PWM )
+  NVIC_SetPendingIRQ(TIMER1H_IRQn);
+#endif
+}
+
+/**************************************************************************/
+/*!
+    Stop TIMER1 stepping the patterns and give the LED pins back from the
+    EPCA, leaving them driven low. Nothing to do for the software PWM,
+    which leaves the pins as GPIO anyway.
+*/
+/**************************************************************************/
+void hw_led_pwm_stop( void )
+{
+  NVIC_DisableIRQ(TIMER1H_IRQn);
+  SI32_TIMER_A_disable_high_overflow_interrupt(SI32_TIMER_1);
+#if defined( LED_HW_PWM )
+  SI32_PBCFG_A_disable_xbar0l_peripherals(SI32_PBCFG_0,
+    SI32_PBCFG_A_XBAR0L_EPCA0EN_MASK);
+  SI32_EPCA_A_stop_counter_timer(SI32_EPCA_0);
+  SI32_PBSTD_A_write_pbskipen(SI32_PBSTD_0, 0x0000);
+#if defined( PCB_V8 )
+  SI32_PBSTD_A_write_pins_low(SI32_PBSTD_0, 0x03F0);
+#else
+  SI32_PBSTD_A_write_pins_low(SI32_PBSTD_0, 0x3F00);
+#endif
+#endif
 }
 
 int hw_led_get_mode(int led)
@@ -658,11 +1428,24 @@ void hw_state_indicator( U32 state )
 
 #endif // USE_DFU_CLASS
 
+// the request the application left in the mailbox for this boot
+static U8 hw_mbox_req = HW_MBOX_REQ_NONE;
+
 int hw_check_skip_bootloader( void )
 {
     U32 reset_status = SI32_RSTSRC_0->RESETFLAG.U32;
     U32 pmu_status = SI32_PMU_0->STATUS.U32;
 
+    // take the request out of the mailbox whatever it is. it only counts for
+    // this reset, even if the image gets started below without looking at it.
+    hw_mbox_req = hw_mbox_get()->request;
+    if( hw_mbox_req != HW_MBOX_REQ_NONE )
+        hw_mbox_request( HW_MBOX_REQ_NONE );
+
+    // the application asked for its image to be started straight away
+    if( hw_mbox_req == HW_MBOX_REQ_BOOT )
+        return 1;
+
     // If the watchdog, software, pmu or RTC rest us, boot the image
     if ((reset_status & SI32_RSTSRC_A_RESETFLAG_WDTRF_MASK) || // watchdog
         (reset_status & SI32_RSTSRC_A_RESETFLAG_WAKERF_MASK) || // pmu wakeup
@@ -686,20 +1469,152 @@ int hw_check_skip_bootloader( void )
     return 0;
 }
 
+// boot mailbox shared between the application and the bootloader. it lives in
+// its own section which the linker scripts put at the start of .sret, so it's at
+// the same address in both images and isn't touched by the startup code.
+static hw_mbox_t hw_mbox __attribute__ ((section(".sret.dfu")));
+
+/**************************************************************************/
+/*!
+    CRC32 of the mailbox. It's the same CRC as the CRC0 engine's but done in
+    software since a download could be using the engine at the time.
+*/
+/**************************************************************************/
+static U32 hw_mbox_crc( void )
+{
+    U32 *word = ( U32* )&hw_mbox;
+    U32 crc = 0xFFFFFFFF;
+    U32 i, bit;
+
+    for( i = 0; i < ( sizeof( hw_mbox_t ) / 4 ) - 1; i++ )
+    {
+        crc ^= word[ i ];
+        for( bit = 0; bit < 32; bit++ )
+        {
+            crc = ( crc & 0x80000000 ) ? ( crc << 1 ) ^ 0x04C11DB7 : ( crc << 1 );
+        }
+    }
+    return crc;
+}
+
+/**************************************************************************/
+/*!
+    Return the boot mailbox. If what's in .sret isn't a valid mailbox, after
+    a power on reset for instance, it's started over empty. Call
+    hw_mbox_commit() after changing it.
+*/
+/**************************************************************************/
+hw_mbox_t *hw_mbox_get( void )
+{
+    if( ( hw_mbox.magic != HW_MBOX_MAGIC ) ||
+        ( hw_mbox.version != HW_MBOX_VERSION ) ||
+        ( hw_mbox.crc != hw_mbox_crc() ) )
+    {
+        memset( &hw_mbox, 0, sizeof( hw_mbox ) );
+        hw_mbox.magic = HW_MBOX_MAGIC;
+        hw_mbox.version = HW_MBOX_VERSION;
+        hw_mbox_commit();
+    }
+    return &hw_mbox;
+}
+
+/**************************************************************************/
+/*!
+    Seal the changes made to the mailbox.
+*/
+/**************************************************************************/
+void hw_mbox_commit( void )
+{
+    hw_mbox.crc = hw_mbox_crc();
+}
+
+/**************************************************************************/
+/*!
+    Leave a request for the bootloader to act on after the next reset.
+*/
+/**************************************************************************/
+void hw_mbox_request( U8 request )
+{
+    hw_mbox_get()->request = request;
+    hw_mbox_commit();
+}
+
+/**************************************************************************/
+/*!
+    Record why the bootloader was started. It's called by the bootloader
+    before anything else looks at the mailbox.
+*/
+/**************************************************************************/
+void hw_mbox_boot_reason_set( void )
+{
+    U32 reset_status = SI32_RSTSRC_0->RESETFLAG.U32;
+    hw_mbox_t *mbox = hw_mbox_get();
+
+    if( reset_status & ( SI32_RSTSRC_A_RESETFLAG_PORRF_MASK | SI32_RSTSRC_A_RESETFLAG_VMONRF_MASK ) )
+        mbox->boot_reason = HW_BOOT_REASON_POWER;
+    else if( reset_status & SI32_RSTSRC_A_RESETFLAG_WDTRF_MASK )
+        mbox->boot_reason = HW_BOOT_REASON_WATCHDOG;
+    else if( reset_status & SI32_RSTSRC_A_RESETFLAG_SWRF_MASK )
+        mbox->boot_reason = HW_BOOT_REASON_SW;
+    else if( reset_status & SI32_RSTSRC_A_RESETFLAG_PINRF_MASK )
+        mbox->boot_reason = HW_BOOT_REASON_PIN;
+    else if( ( reset_status & ( SI32_RSTSRC_A_RESETFLAG_WAKERF_MASK |
+                                SI32_RSTSRC_A_RESETFLAG_RTC0RF_MASK |
+                                SI32_RSTSRC_A_RESETFLAG_CMP0RF_MASK ) ) ||
+             ( SI32_PMU_0->STATUS.U32 & SI32_PMU_A_STATUS_PM9EF_MASK ) )
+        mbox->boot_reason = HW_BOOT_REASON_WAKEUP;
+    else
+        mbox->boot_reason = HW_BOOT_REASON_OTHER;
+
+    // nothing's been started yet on this boot
+    mbox->boot_time_us = 0;
+    hw_mbox_commit();
+}
+
+/**************************************************************************/
+/*!
+    Check if the bootloader should wait longer than usual for the host.
+    Returns HW_EXTEND_DFU_DETACH if the application asked for the bootloader
+    through its DFU runtime interface, HW_EXTEND_SW_RESET for any other
+    software reset, and 0 otherwise. hw_check_skip_bootloader() has to be
+    called first, it takes the request out of the mailbox.
+*/
+/**************************************************************************/
 int hw_check_extend_bootloader( void )
 {
     U32 reset_status = SI32_RSTSRC_0->RESETFLAG.U32;
+    U8 request = hw_mbox_req;
+
     if( reset_status & SI32_RSTSRC_A_RESETFLAG_SWRF_MASK )
     {
         if ((((reset_status & SI32_RSTSRC_A_RESETFLAG_PORRF_MASK)
             || (reset_status & SI32_RSTSRC_A_RESETFLAG_VMONRF_MASK ))) == 0 )
         {
-            return 1;
+            if( request == HW_MBOX_REQ_DFU )
+                return HW_EXTEND_DFU_DETACH;
+            return HW_EXTEND_SW_RESET;
         }
     }
     return 0;
 }
 
+/**************************************************************************/
+/*!
+    Reset into the bootloader. This is called by the DFU runtime interface
+    when the host sends DFU_DETACH. The mailbox request tells the bootloader
+    to go straight into DFU mode instead of running its countdown.
+*/
+/**************************************************************************/
+void hw_dfu_detach( void )
+{
+    // give the status stage of the detach request time to go out
+    hw_delay_ms( HW_DFU_DETACH_DELAY_MS );
+
+    hw_mbox_request( HW_MBOX_REQ_DFU );
+    SI32_USB_A_disable_internal_pull_up( SI32_USB_0 );
+    NVIC_SystemReset();
+}
+
 
 /**************************************************************************/
 /*!
@@ -720,3 +1635,83 @@ void hw_intp_enable()
 {
   __enable_irq();
 }
+
+// how long the next hw_sleep() may go on for, see hw_sleep_limit()
+static U32 hw_sleep_ms = 1;
+
+// SysTick counts less than a ms left over from the last stretched sleep
+static U32 hw_sleep_frac = 0;
+
+/**************************************************************************/
+/*!
+    Let the next hw_sleep() go on for up to ms instead of waking up on
+    every 1 ms tick, because nothing that goes by time needs to run before
+    then. Any other interrupt still ends the sleep early.
+*/
+/**************************************************************************/
+void hw_sleep_limit( U32 ms )
+{
+  hw_sleep_ms = ms;
+}
+
+/**************************************************************************/
+/*!
+    Stop SysTick, add the time it ran since it was last started to the ms
+    count and start it again with a new reload. A reload that already ran
+    out can't get to its handler with the interrupts off, so it's counted
+    here. What's left over from a ms is kept for next time.
+*/
+/**************************************************************************/
+static void hw_systick_restart( U32 load )
+{
+  U32 per_ms = SystemCoreClock / 1000;
+  U32 elapsed;
+
+  SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+  elapsed = hw_sleep_frac + SysTick->LOAD - SysTick->VAL;
+  if( SCB->ICSR & SCB_ICSR_PENDSTSET_Msk )
+  {
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+    elapsed += SysTick->LOAD + 1;
+  }
+  hw_ms_ticks += elapsed / per_ms;
+  hw_sleep_frac = elapsed % per_ms;
+
+  SysTick->LOAD = load;
+  SysTick->VAL = 0;
+  SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+}
+
+/**************************************************************************/
+/*!
+    Sleep until the next interrupt. Call it with the interrupts disabled, a
+    pending interrupt still wakes the WFI up. Returns with the interrupts
+    enabled, so the interrupt that woke us has been serviced.
+
+    With a limit from hw_sleep_limit(), SysTick gets stretched to the whole
+    sleep so it doesn't wake us every ms. That's capped by its 24 bit reload
+    and by the watchdog, which the main loop has to feed. On the way out
+    the ms count is brought up to date before any interrupt can look at it.
+*/
+/**************************************************************************/
+void hw_sleep()
+{
+  U32 per_ms = SystemCoreClock / 1000;
+  U32 ms = hw_sleep_ms;
+
+  hw_sleep_ms = 1;
+  if( ms > RESET_DELAY_MS / 2 )
+    ms = RESET_DELAY_MS / 2;
+  if( ms > ( SysTick_LOAD_RELOAD_Msk + 1 ) / per_ms )
+    ms = ( SysTick_LOAD_RELOAD_Msk + 1 ) / per_ms;
+
+  if( ms > 1 )
+    hw_systick_restart( ms * per_ms - 1 );
+
+  __WFI();
+
+  if( ms > 1 )
+    hw_systick_restart( per_ms - 1 );
+
+  __enable_irq();
+}
@@ -96,11 +96,27 @@ enum {
 #define LED_CONTINUOUS 255
 #define LED_REPEATS_FOREVER 255
 #define LEDTICKHZ 1000
-#define LEDTICK_DIVIDER 2
-//NOTE! These must be sized by a factor of 2 to calculate properly
-//First byte is size of the array
+#define LED_PWM_STEPS 16                  // brightness levels, 0 is fully on
+#define LED_STEP_MS 42                    // time each pattern segment step lasts
+#define LED_IDLE_STEPS 256                // longest the LED timer sleeps for
+
+// one run of a pattern: the LED sits at level for steps pattern steps
+typedef struct
+{
+    U8 level;
+    U8 steps;
+} led_seg_t;
+
+// the V8/V10 LEDs all sit on PB0 where the crossbar can hand them to the EPCA,
+// so the duty cycle is done in hardware and TIMER1 only fires when one changes.
+// V7 has one of them on PBHD4 and keeps the software PWM.
+#if defined( PCB_V8 ) || defined( PCB_V10 )
+#define LED_HW_PWM
+#define LED_PWM_LIMIT 255                 // EPCA counts per PWM period
+#define LED_PWM_HZ 2000
+#define LED_PWM_CHANNELS 6
+#endif
 #define LED_COUNT 5
-#define LED_MAX_ARRAY 32
 
 #endif // USE_DFU_CLASS
 
@@ -114,33 +130,172 @@ enum {
 #define BLOCK_SIZE_U32        FLASH_PAGE_SIZE_U32
 #define DFU_START             (BLOCK_CAPACITY *  BLOCK_SIZE_U8)
 #define VECTOR_TABLE_ADDRESS  (SI32_MCU_FLASH_SIZE - BLOCK_SIZE_U8)
+#define DFU_JOURNAL_PAGE      (FLASH_TARGET - FLASH_PAGE_SIZE_U8)   // between the bootloader and the image
+
+// Config pages at the top of flash, just under the page with the lock word.
+// They're kept out of the application image so an update leaves them alone.
+// The host can still write them through the DfuSe alternate setting.
+#define HW_CONFIG_PAGES       2
+#define HW_CONFIG_END         (SI32_MCU_FLASH_SIZE & ~(FLASH_PAGE_SIZE_U8 - 1))
+#define HW_CONFIG_START       (HW_CONFIG_END - HW_CONFIG_PAGES * FLASH_PAGE_SIZE_U8)
+
+// Application slots. With HW_AB_SLOTS defined, the application area is split
+// into two slots and a boot control page. An update goes into the slot that
+// isn't running and the bootloader switches over to it on trial. Each slot's
+// image has to be linked to run from that slot's address.
+#if defined( HW_AB_SLOTS )
+#define HW_SLOTS              2
+#define HW_SLOT_SIZE          ((((HW_CONFIG_START - FLASH_TARGET) / FLASH_PAGE_SIZE_U8 - 1) / 2) * FLASH_PAGE_SIZE_U8)
+#define HW_BOOTCTL_PAGE       (FLASH_TARGET + HW_SLOTS * HW_SLOT_SIZE)
+#else
+#define HW_SLOTS              1
+#define HW_SLOT_SIZE          (HW_CONFIG_START - FLASH_TARGET)
+#endif
+#define HW_SLOT_BASE(slot)    (FLASH_TARGET + (slot) * HW_SLOT_SIZE)
+#define HW_SLOT_NONE          0xFF
 
-// Watchdog timer
-#define EARLY_WARNING_DELAY_MS        1000   // Will result in approx a 1 s
-                                             // periodic early warning interrupt
+// Watchdog timer. it's only there to get the bootloader out of a hang, the
+// main loop keeps feeding it with hw_watchdog_feed().
 #define RESET_DELAY_MS                2000  // Will result in approx a 2 s
-                                            // reset delay (if early warning isn't captured)
-#define EARLY_WARNING_THRESHOLD       (uint32_t)((16400*EARLY_WARNING_DELAY_MS)/1000)
+                                            // reset delay if it isn't fed
 #define RESET_THRESHOLD               (uint32_t)((16400*RESET_DELAY_MS)/1000)
 
 
+// DFU runtime to bootloader handoff
+#define HW_DFU_DETACH_DELAY_MS        10
+
+// Handoff to the image. the pull-up is released for well over the 2.5 us
+// the hub needs to see a disconnect, to give the line time to discharge.
+#define HW_PULLUP_RELEASE_US          100
+#define HW_CTRL_SENT_TIMEOUT_MS       50    // wait for the last status to go out
+#define HW_CTRL_STATUS_MS             1     // then a frame for its status stage
+#define HW_EXTEND_SW_RESET            1
+#define HW_EXTEND_DFU_DETACH          2
+
+// Application image trailer. It's appended to the end of the image, which is
+// padded to a whole word, and holds the CRC of everything before it.
+#define HW_IMAGE_CRC_MAGIC            0x30435243    // "CRC0"
+#define HW_IMAGE_TRAILER_U32          3
+
+typedef struct
+{
+    U32 len;        // image length in bytes, not counting the trailer
+    U32 crc;        // CRC of the image computed by hw_crc_start()/hw_crc_add()
+    U32 magic;      // HW_IMAGE_CRC_MAGIC
+} hw_image_trailer_t;
+
+// Boot control records. They're appended to the boot control page, so
+// switching slots is a single flash write. The page is only erased once it
+// fills up. The slot number is in the low byte of the record.
+#define HW_BOOTCTL_TRIAL              0x54524900    // boot the slot on trial next time
+#define HW_BOOTCTL_TRIED              0x54524400    // the trial boot has started
+#define HW_BOOTCTL_CONFIRM            0x434F4E00    // the slot is good, boot it from now on
+#define HW_BOOTCTL_TYPE_MASK          0xFFFFFF00
+
+typedef struct
+{
+    U32 rec;        // HW_BOOTCTL_xxx | slot
+    U32 rec_inv;    // ~rec, so a record that was cut off by a reset is skipped
+} hw_bootctl_rec_t;
+
+#define HW_BOOTCTL_RECS               (FLASH_PAGE_SIZE_U8 / sizeof(hw_bootctl_rec_t))
+
+// Boot mailbox. It's kept in .sret, which survives everything but a power on
+// reset, and is how the application and the bootloader pass things to each
+// other across a reset.
+#define HW_MBOX_MAGIC                 0x584F424D    // "MBOX"
+#define HW_MBOX_VERSION               1
+
+// why the bootloader was last started
+#define HW_BOOT_REASON_POWER          0             // power on or supply monitor
+#define HW_BOOT_REASON_PIN            1
+#define HW_BOOT_REASON_SW             2
+#define HW_BOOT_REASON_WATCHDOG       3
+#define HW_BOOT_REASON_WAKEUP         4             // pmu wakeup, rtc or comparator
+#define HW_BOOT_REASON_OTHER          5
+
+// what the application wants the bootloader to do after the next reset
+#define HW_MBOX_REQ_NONE              0
+#define HW_MBOX_REQ_DFU               1             // stay in DFU mode without a countdown
+#define HW_MBOX_REQ_BOOT              2             // start the image without a countdown
+
+// outcome of the last download
+#define HW_MBOX_UPDATE_NONE           0
+#define HW_MBOX_UPDATE_STARTED        1             // never finished, the power or the host went away
+#define HW_MBOX_UPDATE_DONE           2
+#define HW_MBOX_UPDATE_FAILED         3             // update_error holds the DFU bStatus
+
+typedef struct
+{
+    U32 magic;
+    U8  version;
+    U8  boot_reason;    // HW_BOOT_REASON_xxx
+    U8  request;        // HW_MBOX_REQ_xxx, cleared once the bootloader reads it
+    U8  update_status;  // HW_MBOX_UPDATE_xxx
+    U8  update_error;
+    U8  update_slot;
+    U16 reserved;
+    U32 boot_count;     // images started since power on
+    U32 boot_time_us;   // bootloader hw_init() to the jump into the image
+    U32 update_time_ms; // first block to manifest of the last download
+    U32 crc;            // of everything above
+} hw_mbox_t;
+
 #define PROGMEM
 
+// code that has to keep running while the flash is busy being erased or
+// programmed. it's copied into sram along with .data at startup.
+#define RAMFUNC __attribute__ ((section(".ramfunc"), noinline, long_call))
+
 #define PSTR(a) (a)
 #define printf_P(a) fputs(a, stdout)
 
 void hw_init();
 void hw_intp_disable();
 void hw_intp_enable();
+void hw_sleep();
+void hw_sleep_limit( U32 ms );
 U8 hw_flash_get_byte(U8 *addr);
-U8 hw_flash_erase( U32 address, U8 verify);
-U8 hw_flash_write( U32 address, U32* data, U32 count, U8 verify );
+extern volatile U8 hw_flash_busy;
+RAMFUNC U8 hw_flash_erase( U32 address, U8 verify);
+U8 hw_flash_is_blank( U32 address, U32 count );
+RAMFUNC U8 hw_flash_write( U32 address, U32* data, U32 count, U8 verify );
+void hw_crc_start( void );
+void hw_crc_add( const U32 *data, U32 count );
+U32 hw_crc_result( void );
+void hw_aes_start( const U32 *key );
+void hw_aes_block( U32 *block );
+void hw_aes_ctr( U32 *data, U32 count, U8 *ctr );
+void hw_aes_cmac( const U32 *data, U32 count, U32 *mac );
+U32 hw_image_end_get( U32 base );
+U8 hw_image_crc_ok( U32 base );
+U8 hw_slot_active_get( void );
+U8 hw_slot_update_get( void );
+void hw_slot_trial( U8 slot );
+void hw_slot_confirm( void );
 void hw_enable_watchdog( void );
 void hw_disable_watchdog( void );
+void hw_watchdog_feed( void );
+U32 hw_usb_frame_get( void );
+U8 hw_usb_reset_seen( void );
+U32 hw_usb_reset_ms_since( void );
 void hw_boot_image( int usb_started );
 void hw_state_indicator( U32 state );
-void hw_wait_ms(U32 delay_amount);
+void hw_timebase_init( void );
+U32 hw_ms_get( void );
+U32 hw_ms_since( U32 start );
+U32 hw_us_get( void );
+void hw_delay_us( U32 delay_us );
+void hw_delay_ms( U32 delay_ms );
+U32 hw_boot_time_get( void );
+hw_mbox_t *hw_mbox_get( void );
+void hw_mbox_commit( void );
+void hw_mbox_request( U8 request );
+void hw_mbox_boot_reason_set( void );
+void hw_ctrl_wait_sent( U32 timeout_ms );
 int hw_check_skip_bootloader( void );
 int hw_check_extend_bootloader( void );
+void hw_dfu_detach( void );
 void hw_led_set_mode(int led, int mode, int cycles);
+void hw_led_pwm_stop( void );
 #endif
@@ -49,7 +49,9 @@
 #include "sim3u1xx.h"
 #include "sim3u1xx_Types.h"
 
-static SI32_USBEP_A_Type* const usb_ep[] = { SI32_USB_0_EP1, SI32_USB_0_EP2, SI32_USB_0_EP3, SI32_USB_0_EP4 };
+// not const so it's in sram, where the usb interrupt can still read it while
+// the flash is busy
+static SI32_USBEP_A_Type* usb_ep[] = { SI32_USB_0_EP1, SI32_USB_0_EP2, SI32_USB_0_EP3, SI32_USB_0_EP4 };
 
 /**************************************************************************/
 /*!
@@ -91,12 +93,13 @@ void intp_clear_all()
     Suspend interrupt handler.
 */
 /**************************************************************************/
-void intp_suspend()
+RAMFUNC void intp_suspend()
 {
     SI32_USB_A_clear_suspend_interrupt( SI32_USB_0 );
 
     // freeze the clock and turn off the USB PLL
     SI32_USB_A_suspend_usb_oscillator( SI32_USB_0 );
+    usb_evt_post( USB_EVT_SUSPEND );
 }
 
 /**************************************************************************/
@@ -104,9 +107,10 @@ void intp_suspend()
     Resume interrupt handler.
 */
 /**************************************************************************/
-void intp_resume()
+RAMFUNC void intp_resume()
 {
     SI32_USB_A_clear_resume_interrupt( SI32_USB_0 );
+    usb_evt_post( USB_EVT_RESUME );
 }
 
 /**************************************************************************/
@@ -126,6 +130,11 @@ void intp_wakeup()
     //WAKEUP_INT_DIS();
 }
 
+// bus resets seen since startup. the bootloader uses it to tell if there's
+// a host out there at all.
+volatile U8 hw_usb_resets = 0;
+volatile U32 hw_usb_reset_ms = 0;   // hw_ms_get() at the end of the last one
+
 /**************************************************************************/
 /*!
     End of Reset interrupt handler. Gets triggered at the end of a bus reset.
@@ -134,10 +143,15 @@ void intp_wakeup()
 void intp_eor()
 {
     SI32_USB_A_clear_reset_interrupt( SI32_USB_0 );
+    if( hw_usb_resets != 0xFF )
+        hw_usb_resets++;
+    hw_usb_reset_ms = hw_ms_get();
+    ctrl_reset();
     ep_init();
+    usb_evt_post( USB_EVT_RESET );
 }
 
-U8 get_usbep_num()
+RAMFUNC U8 get_usbep_num()
 {
     if( SI32_USB_A_is_ep1_in_interrupt_pending( SI32_USB_0 ) ||
         SI32_USB_A_is_ep1_out_interrupt_pending( SI32_USB_0 ))
@@ -158,7 +172,7 @@ U8 get_usbep_num()
     return 0xFF;
 }
 
-void ep0_handler( void )
+RAMFUNC void ep0_handler( void )
 {
     uint32_t ControlReg = SI32_USB_A_read_ep0control(SI32_USB_0);
 
@@ -166,16 +180,30 @@ void ep0_handler( void )
         ep_clear_stall( 0 );
 
     if (ControlReg & SI32_USB_A_EP0CONTROL_SUENDI_MASK)
+    {
+        // the host ended the transfer early so drop any data stage in progress
         SI32_USB_A_clear_setup_end_early_ep0( SI32_USB_0 );
+        ctrl_reset();
+        usb_buf_clear_fifo( EP_CTRL );
+    }
 
     if( SI32_USB_A_is_out_packet_ready_ep0( SI32_USB_0 ) )
     {
         ep_read( 0 );
+#if defined( USB_STD_REQ_IN_ISR )
+        // ctrl_isr_handler() runs from flash. while the flash is busy the
+        // request waits for usb_poll() instead.
+        if( !hw_flash_busy )
+        {
+            ctrl_isr_handler();
+        }
+#endif
+        usb_evt_post( USB_EVT_SETUP );
         return;
     }
 }
 
-void usbep_handler( U8 ep_intp_num )
+RAMFUNC void usbep_handler( U8 ep_intp_num )
 {
     if( ( ep_intp_num > 0 ) && ep_intp_num <= sizeof( usb_ep ) / sizeof( usb_ep[ 0 ] ) )
     {
@@ -190,6 +218,7 @@ void usbep_handler( U8 ep_intp_num )
         {
             ep_read( ep_intp_num );
             //pcb->pending_data |= ( 1 << ep_intp_num );
+            usb_evt_post( USB_EVT_RX );
             return;
         }
     }
@@ -200,9 +229,13 @@ void usbep_handler( U8 ep_intp_num )
 /*!
     This is the ISR that handles communications for the AT90USB. These interrupts
     are endpoint specific and are mostly used for data transfers and communications.
+
+    It runs from sram along with the endpoint handlers so packets keep getting
+    pulled out of the fifos while the flash is being erased or programmed. The
+    end of a bus reset still runs from flash and waits for it to finish.
 */
 /**************************************************************************/
-void USB0_IRQHandler( void )
+RAMFUNC void USB0_IRQHandler( void )
 {
 
     uint32_t usbCommonInterruptMask = SI32_USB_A_read_cmint(SI32_USB_0);
@@ -242,6 +275,13 @@ void USB0_IRQHandler( void )
         usbep_handler( ep_intp_num );
     }
 
+    // an IN packet went out so there's room for the next one
+    if( usbEpInterruptMask & ( SI32_USB_A_IOINT_IN1I_MASK | SI32_USB_A_IOINT_IN2I_MASK |
+                               SI32_USB_A_IOINT_IN3I_MASK | SI32_USB_A_IOINT_IN4I_MASK ) )
+    {
+        usb_evt_post( USB_EVT_TX );
+    }
+
     if( usbEpInterruptMask & SI32_USB_A_IOINT_EP0I_MASK )
     {
         ep0_handler();
@@ -257,55 +297,45 @@ void USB0_IRQHandler( void )
         intp_eor();
 }
 
-#if defined( USE_DFU_CLASS )
-
-extern volatile U8 dfu_communication_started;
-extern volatile U16 dfu_reset_counter;
+/**************************************************************************/
+/*!
+    1 ms timebase tick. It's in sram so no ticks get lost while the flash is
+    being erased or programmed, which is when the page time gets measured.
+*/
+/**************************************************************************/
+volatile U32 hw_ms_ticks = 0;
 
-void WDTIMER0_IRQHandler(void)
+RAMFUNC void SysTick_Handler( void )
 {
-
-
-    if ((SI32_WDTIMER_A_is_early_warning_interrupt_pending(SI32_WDTIMER_0) &
-        SI32_WDTIMER_A_is_early_warning_interrupt_enabled(SI32_WDTIMER_0)))
-    {
-        if( dfu_communication_started == 1 )
-        {
-            hw_disable_watchdog();
-        }
-        else if( dfu_reset_counter > 0 )
-        {
-            hw_state_indicator( HW_STATE_COUNTDOWN );
-            SI32_WDTIMER_A_reset_counter(SI32_WDTIMER_0);
-            SI32_WDTIMER_A_clear_early_warning_interrupt(SI32_WDTIMER_0);
-
-            if( dfu_reset_counter != 0xFFFF)
-                dfu_reset_counter--;
-
-            if( dfu_reset_counter == 0 )
-            {
-              dfu_pend_boot_image();
-            }
-        }
-    }
+    hw_ms_ticks++;
 }
 
+#if defined( USE_DFU_CLASS )
+
+#if !defined( LED_HW_PWM )
 static SI32_PBSTD_A_Type* const port_std[] = { SI32_PBSTD_0, SI32_PBSTD_1, SI32_PBSTD_2, SI32_PBSTD_3 };
+#endif
 
-static U8 const CLED_FADEUP[] = { LED_MAX_ARRAY/2, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 };
-static U8 const CLED_FADEDOWN[] = { LED_MAX_ARRAY/2, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
-static U8 const CLED_OFF[] = { 1, 15 };
-static U8 const CLED_ON[] = { 1, 0 };
-static U8 const CLED_FASTFLASH[] = { LED_MAX_ARRAY/4, 0, 15, 15, 15, 15, 15, 15, 15 };
-static U8 const CLED_MEDIUMFLASH[] = { LED_MAX_ARRAY/2, 0, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15 };
-static U8 const CLED_SLOWFLASH[] = { LED_MAX_ARRAY, 0, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
-static U8 const CLED_FLASH1[] = { LED_MAX_ARRAY, 0, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
-static U8 const CLED_FLASH2[] = { LED_MAX_ARRAY, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
-static U8 const CLED_FLASH3[] = { LED_MAX_ARRAY, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
-static U8 const CLED_FLASH4[] = { LED_MAX_ARRAY, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
-static U8 const CLED_FLASH5[] = { LED_MAX_ARRAY, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 0, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
-
-U8 const * led_cled_ptr[] = {
+// run-length patterns: { level, steps } segments ending with a zero length one.
+// the lengths are powers of two so patterns started on a multiple of their
+// own length stay in step with each other.
+static led_seg_t const CLED_FADEUP[] = { { 15, 1 }, { 14, 1 }, { 13, 1 }, { 12, 1 }, { 11, 1 }, { 10, 1 }, { 9, 1 }, { 8, 1 },
+                                         { 7, 1 }, { 6, 1 }, { 5, 1 }, { 4, 1 }, { 3, 1 }, { 2, 1 }, { 1, 1 }, { 0, 1 }, { 0, 0 } };
+static led_seg_t const CLED_FADEDOWN[] = { { 0, 1 }, { 1, 1 }, { 2, 1 }, { 3, 1 }, { 4, 1 }, { 5, 1 }, { 6, 1 }, { 7, 1 },
+                                           { 8, 1 }, { 9, 1 }, { 10, 1 }, { 11, 1 }, { 12, 1 }, { 13, 1 }, { 14, 1 }, { 15, 1 }, { 0, 0 } };
+static led_seg_t const CLED_OFF[] = { { 15, 1 }, { 0, 0 } };
+static led_seg_t const CLED_ON[] = { { 0, 1 }, { 0, 0 } };
+static led_seg_t const CLED_FASTFLASH[] = { { 0, 1 }, { 15, 7 }, { 0, 0 } };
+static led_seg_t const CLED_MEDIUMFLASH[] = { { 0, 1 }, { 15, 15 }, { 0, 0 } };
+static led_seg_t const CLED_SLOWFLASH[] = { { 0, 1 }, { 15, 31 }, { 0, 0 } };
+static led_seg_t const CLED_FLASH1[] = { { 0, 1 }, { 15, 31 }, { 0, 0 } };
+static led_seg_t const CLED_FLASH2[] = { { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 26 }, { 0, 0 } };
+static led_seg_t const CLED_FLASH3[] = { { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 21 }, { 0, 0 } };
+static led_seg_t const CLED_FLASH4[] = { { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 16 }, { 0, 0 } };
+static led_seg_t const CLED_FLASH5[] = { { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 4 }, { 0, 1 }, { 15, 4 },
+                                         { 0, 1 }, { 15, 11 }, { 0, 0 } };
+
+led_seg_t const * led_cled_ptr[] = {
   CLED_FADEUP,
   CLED_FADEDOWN,
   CLED_OFF,
@@ -320,23 +350,25 @@ U8 const * led_cled_ptr[] = {
   CLED_FLASH5
 };
 
-
-U8 led_pointer_tick = 0;
-U8 led_tick = 0;
-U8 led_repeat_tick = 0;
-U8 led_divider_tick = 0;
-
 U8 led_ticks = 0;
 
-U8 led_ticks_ptr[LED_COUNT] = { 0, 0, 0, 0, 0 };
+U8 led_level[LED_COUNT] = { 15, 15, 15, 15, 15 };
 U8 led_background[LED_COUNT] = { 0, 0, 0, 0, 0 };
 
-U8 * led_mode_ptr[] = { (U8 *)CLED_OFF, (U8 *)CLED_OFF, (U8 *)CLED_OFF, (U8 *)CLED_OFF, (U8 *)CLED_OFF };
-U8 led_repeats_ptr[LED_COUNT] = { 10, 10, 10, 10, 10 };
+led_seg_t const * led_mode_ptr[] = { CLED_OFF, CLED_OFF, CLED_OFF, CLED_OFF, CLED_OFF };
+U8 led_repeats_ptr[LED_COUNT] = { 0, 0, 0, 0, 0 };
+
+// where each LED is in its pattern and the step its next segment starts at
+static led_seg_t const * led_seg_ptr[LED_COUNT] = { CLED_OFF, CLED_OFF, CLED_OFF, CLED_OFF, CLED_OFF };
+static U32 led_next_step[LED_COUNT] = { 0, 0, 0, 0, 0 };
+
+// hw_ms_ticks time the next LED changes at
+static U32 led_wake_ms = 0;
 
-//Pending variables here...wait for new "frame"
-U8 * led_pending_mode_ptr[LED_COUNT] = { NULL, NULL, NULL, NULL, NULL };
+//Pending variables here...wait for the pattern's next start
+led_seg_t const * led_pending_mode_ptr[LED_COUNT] = { NULL, NULL, NULL, NULL, NULL };
 U8 led_pending_repeats_ptr[LED_COUNT] = { 0, 0, 0, 0, 0 };
+volatile U8 led_kick = 0;
 
 U8 led_mask = 0x00;
 
@@ -362,61 +394,166 @@ U8 led_mask = 0x00;
 #define MLED_PIN_5 13
 #endif
 
-void TIMER1H_IRQHandler(void)
+/**************************************************************************/
+/*!
+    Return how many steps one pass through a pattern takes.
+*/
+/**************************************************************************/
+static U32 led_pattern_steps( led_seg_t const * seg )
 {
-  led_ticks=((led_ticks+1) & 0x0F);
-  if(!led_ticks)
+  U32 steps = 0;
+
+  for( ; seg->steps; seg++ )
+    steps += seg->steps;
+  return steps;
+}
+
+/**************************************************************************/
+/*!
+    Bring every LED up to the current step and work out when the next one
+    changes. An LED only gets looked at when its segment runs out, and a
+    pending mode only takes over on a multiple of its own length so all
+    the patterns stay in step with each other. A finite repeat count is in
+    passes through the pattern, the LED keeps its last level after that.
+*/
+/**************************************************************************/
+static void led_update( void )
+{
+  U32 now = hw_ms_ticks / LED_STEP_MS;
+  U32 wake = now + LED_IDLE_STEPS;
+  U32 len, start;
+  U8 lednum;
+
+  for(lednum=0;lednum<LED_COUNT;lednum++)
   {
-    if(led_pointer_tick == 3)
+    if(led_pending_mode_ptr[lednum] != NULL)
     {
-      led_pointer_tick = 0;
-
-      //load next values here
-      if(led_repeat_tick == 0)
+      len = led_pattern_steps( led_pending_mode_ptr[lednum] );
+      start = ( ( now + len - 1 ) / len ) * len;
+      if( start == now )
       {
-        led_repeat_tick = 0;
-
-        int lednum;
-        for(lednum=0;lednum<LED_COUNT;lednum++)
-        {
-          if(led_pending_mode_ptr[lednum] != NULL)
-          {
-            led_mode_ptr[lednum] = led_pending_mode_ptr[lednum];
-            led_repeats_ptr[lednum] = led_pending_repeats_ptr[lednum];
-            led_pending_mode_ptr[lednum] = NULL;
-            led_pending_repeats_ptr[lednum] = 0;
-          }
-        }
+        led_mode_ptr[lednum] = led_pending_mode_ptr[lednum];
+        led_repeats_ptr[lednum] = led_pending_repeats_ptr[lednum];
+        led_pending_mode_ptr[lednum] = NULL;
+        led_pending_repeats_ptr[lednum] = 0;
+        led_seg_ptr[lednum] = led_mode_ptr[lednum];
+        led_next_step[lednum] = now;
+      }
+      else if( ( S32 )( start - wake ) < 0 )
+      {
+        wake = start;
       }
+    }
+
+    if(led_repeats_ptr[lednum] == 0)
+      continue;
 
-      int lednum;
-      if( led_divider_tick == 0 )
+    while( ( S32 )( now - led_next_step[lednum] ) >= 0 )
+    {
+      led_level[lednum] = led_seg_ptr[lednum]->level;
+      led_next_step[lednum] += led_seg_ptr[lednum]->steps;
+      led_seg_ptr[lednum]++;
+      if( led_seg_ptr[lednum]->steps == 0 )
       {
-        for(lednum=0;lednum<LED_COUNT;lednum++)
-        {
-          if(led_repeats_ptr[lednum] > 0)
-          {
-            if((led_repeats_ptr[lednum] != LED_REPEATS_FOREVER) && ((led_tick % led_mode_ptr[lednum][0]) == 0))
-              led_repeats_ptr[lednum]--;
-            if(led_repeats_ptr[lednum] > 0)
-              led_ticks_ptr[lednum] = led_mode_ptr[lednum][(led_tick % led_mode_ptr[lednum][0])+1];
-          }
-        }
-        led_tick++;
-        led_repeat_tick = (led_repeat_tick+1) % LED_MAX_ARRAY;
+        led_seg_ptr[lednum] = led_mode_ptr[lednum];
+        if( ( led_repeats_ptr[lednum] != LED_REPEATS_FOREVER ) && ( --led_repeats_ptr[lednum] == 0 ) )
+          break;
       }
-      led_divider_tick++;
-      led_divider_tick %= LEDTICK_DIVIDER;
     }
-    led_pointer_tick++;
+
+    // a single segment never changes, so there's nothing to wake up for
+    if( led_mode_ptr[lednum][1].steps == 0 )
+      led_repeats_ptr[lednum] = 0;
+
+    if( ( led_repeats_ptr[lednum] != 0 ) && ( ( S32 )( led_next_step[lednum] - wake ) < 0 ) )
+      wake = led_next_step[lednum];
+  }
+
+  led_wake_ms = wake * LED_STEP_MS;
+}
+
+#if defined( LED_HW_PWM )
+
+/**************************************************************************/
+/*!
+    Turn an LED's pattern level into an EPCA compare value. It's the same
+    duty the software PWM gave: on for the frame steps where
+    led_ticks + background > level.
+*/
+/**************************************************************************/
+static U32 led_pwm_ccapv( U8 lednum )
+{
+  int on = ( LED_PWM_STEPS - 1 ) - led_level[lednum] + led_background[lednum];
+
+  if( !( led_mask & ( 1 << lednum ) ) || ( on <= 0 ) )
+    return LED_PWM_LIMIT + 1;
+  if( on >= LED_PWM_STEPS - 1 )
+    return 0;
+  return ( LED_PWM_LIMIT + 1 ) - ( on * ( LED_PWM_LIMIT + 1 ) ) / ( LED_PWM_STEPS - 1 );
+}
+
+/**************************************************************************/
+/*!
+    Hand the new levels to the EPCA. CEXn drives MLED_PIN_n, and the
+    EPCA picks the update values up at the end of the current period.
+*/
+/**************************************************************************/
+static void led_pwm_update( void )
+{
+  U32 led1 = led_pwm_ccapv( 1 );
+  U32 led2 = led_pwm_ccapv( 2 );
+
+#if defined( MEMBRANE_V1 )
+  SI32_EPCACH_A_write_ccapvupd( SI32_EPCA_0_CH0, led2 );
+#else
+  SI32_EPCACH_A_write_ccapvupd( SI32_EPCA_0_CH0, led1 );
+#endif
+  SI32_EPCACH_A_write_ccapvupd( SI32_EPCA_0_CH1, led_pwm_ccapv( 0 ) );
+  SI32_EPCACH_A_write_ccapvupd( SI32_EPCA_0_CH2, led1 );
+  SI32_EPCACH_A_write_ccapvupd( SI32_EPCA_0_CH3, led2 );
+  SI32_EPCACH_A_write_ccapvupd( SI32_EPCA_0_CH4, led_pwm_ccapv( 3 ) );
+  SI32_EPCACH_A_write_ccapvupd( SI32_EPCA_0_CH5, led_pwm_ccapv( 4 ) );
+}
+
+#endif // LED_HW_PWM
+
+/**************************************************************************/
+/*!
+    TIMER1 overflow. With the EPCA doing the PWM it only fires when an LED
+    changes or a new mode has been set, and gets reloaded for the next
+    change. Otherwise it runs at LEDTICKHZ and does the duty cycle on the
+    pins itself.
+*/
+/**************************************************************************/
+void TIMER1H_IRQHandler(void)
+{
+#if defined( LED_HW_PWM )
+  S32 wait_ms;
+
+  led_kick = 0;
+  led_update();
+  led_pwm_update();
+
+  // sleep until the next LED changes
+  wait_ms = ( S32 )( led_wake_ms - hw_ms_ticks );
+  if( wait_ms < 1 )
+    wait_ms = 1;
+  SI32_TIMER_A_write_count (SI32_TIMER_1, (unsigned) -((U32)wait_ms*(SystemCoreClock/1000)));
+#else
+  led_ticks=((led_ticks+1) & 0x0F);
+  if( led_kick || ( ( S32 )( hw_ms_ticks - led_wake_ms ) >= 0 ) )
+  {
+    led_kick = 0;
+    led_update();
   }
-  else
+
+  if(led_ticks)
   {
-    if(led_ticks + led_background[0] > led_ticks_ptr[0] && (led_mask & 1 ) )
+    if(led_ticks + led_background[0] > led_level[0] && (led_mask & 1 ) )
       SI32_PBSTD_A_write_pins_high( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_1 ) );
     else
       SI32_PBSTD_A_write_pins_low( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_1 ) );
-    if(led_ticks + led_background[1] > led_ticks_ptr[1] && (led_mask & 1<<1 ) )
+    if(led_ticks + led_background[1] > led_level[1] && (led_mask & 1<<1 ) )
     {
       SI32_PBSTD_A_write_pins_high( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_2 ) );
     #if !defined( MEMBRANE_V1)
@@ -438,7 +575,7 @@ void TIMER1H_IRQHandler(void)
     #endif
     #endif
     }
-    if(led_ticks + led_background[2] > led_ticks_ptr[2] && (led_mask & 1<<2 ) )
+    if(led_ticks + led_background[2] > led_level[2] && (led_mask & 1<<2 ) )
     {
     #if defined( MEMBRANE_V1)
     #if defined( PCB_V8 ) || defined( PCB_V10 )
@@ -460,15 +597,16 @@ void TIMER1H_IRQHandler(void)
     #endif
       SI32_PBSTD_A_write_pins_low( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_3 ) );
     }
-    if(led_ticks + led_background[3] > led_ticks_ptr[3] && (led_mask & 1<<3 ) )
+    if(led_ticks + led_background[3] > led_level[3] && (led_mask & 1<<3 ) )
       SI32_PBSTD_A_write_pins_high( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_4 ) );
     else
       SI32_PBSTD_A_write_pins_low( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_4 ) );
-    if(led_ticks + led_background[4] > led_ticks_ptr[4] && (led_mask & 1<<4 ) )
+    if(led_ticks + led_background[4] > led_level[4] && (led_mask & 1<<4 ) )
       SI32_PBSTD_A_write_pins_high( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_5 ) );
     else
       SI32_PBSTD_A_write_pins_low( port_std[ LED_PORT ], ( ( U32 ) 1 << MLED_PIN_5 ) );
   }
+#endif
   // Clear the interrupt flag
   SI32_TIMER_A_clear_high_overflow_interrupt(SI32_TIMER_1);
 }
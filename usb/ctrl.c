@@ -43,28 +43,44 @@
 
 /**************************************************************************/
 /*!
-    Handle the descriptor requests coming in from the host. This function will
-    respond to device, configuration, and string descriptor requests by
-    returning the relevant descriptor stored in flash.
+    Send a descriptor stored in flash to the host on the control endpoint.
+    The transfer is cut down to the length the host asked for.
 */
 /**************************************************************************/
-void ctrl_get_desc(req_t *req)
+static void ctrl_write_desc(U8 *desc, U16 desc_len, U16 req_len)
+{
+    // since ctrl endpoints are the only endpoints that transfer data in both directions, we need
+    // to have special handling of the buffers to accomodate this. now that we've decoded the request,
+    // discard the request data by clearing the fifo.
+    usb_buf_clear_fifo(EP_CTRL);
+
+    ctrl_send_data(desc, desc_len, req_len, true);
+}
+
+/**************************************************************************/
+/*!
+    Look up the descriptor that wValue of a GET_DESCRIPTOR request asks for.
+    Returns NULL if we don't have it.
+*/
+/**************************************************************************/
+static U8 *ctrl_desc_find(U16 val, U16 *len)
 {
-    U8 i = 0, desc_len = 0, desc_type, desc_idx;
+    U16 desc_len = 0;
+    U8 desc_type, desc_idx;
     U8 *desc = NULL;
 
-    desc_type = (req->val >> 8);
-    desc_idx = req->val & 0x00ff;
+    desc_type = (val >> 8);
+    desc_idx = val & 0x00ff;
 
     switch (desc_type)
     {
     case DEV_DESCR:
         desc        = desc_dev_get();
-        desc_len    = desc_dev_get_len(); // size is first byte of dev desc
+        desc_len    = desc_dev_get_len();
         break;
     case CFG_DESCR:
         desc        = desc_cfg_get();
-        desc_len    = desc_cfg_get_len(); // total len is third byte of cfg desc
+        desc_len    = desc_cfg_get_len();
         break;
     case DEV_QUAL_DESCR:
         desc        = desc_dev_qual_get();
@@ -80,42 +96,41 @@ void ctrl_get_desc(req_t *req)
         desc        = desc_str_get(desc_idx);
         desc_len    = desc_str_get_len(desc_idx);
         break;
+#if defined( USB_MSOS20 )
+    case BOS_DESCR:
+        desc        = desc_bos_get();
+        desc_len    = desc_bos_get_len();
+        break;
+#endif
     }
 
-    // check to see if the get desc specified length is greater than the
-    // desc len. if it is, then send the whole descriptor plus a possible
-    // zero packet. otherwise, just send the amount of data that's being requested
-    // with no zero packet.
-    if (req->len < desc_len)
-    {
-        desc_len = req->len;
-    }
+    *len = desc_len;
+    return desc;
+}
 
-    // since ctrl endpoints are the only endpoints that transfer data in both directions, we need
-    // to have special handling of the buffers to accomodate this. now that we've decoded the request,
-    // discard the request data by clearing the fifo. then we will reuse the buffer to transmit the
-    // descriptor info.
-    usb_buf_clear_fifo(EP_CTRL);
+/**************************************************************************/
+/*!
+    Handle the descriptor requests coming in from the host. This function will
+    respond to device, configuration, and string descriptor requests by
+    returning the relevant descriptor stored in flash.
+*/
+/**************************************************************************/
+void ctrl_get_desc(req_t *req)
+{
+    U16 desc_len;
+    U8 *desc;
 
-    // this is a bit inefficient since we're copying the data out of flash and into a buffer
-    // before we transfer it. however this way, we can re-use the ep_write function since it requires
-    // data to be in the buffer. otherwise, we need a separate function that can write to the ep
-    // from flash memory.
-    do
-    {
-        usb_buf_write(EP_CTRL, hw_flash_get_byte(desc++));
-        i++;
+    desc = ctrl_desc_find(req->val, &desc_len);
 
-        if ((i % MAX_BUF_SZ) == 0)
-        {
-            // if we hit a max buf size, then send out the data before we continue. we need to empty
-            // out the buffer before we can add more data into it.
-            ep_write(EP_CTRL);
-        }
-    } while (i < desc_len);
+    // we don't have the requested descriptor. stall the request so the host
+    // knows it isn't supported.
+    if ((desc == NULL) || (desc_len == 0))
+    {
+        ep_set_stall(EP_CTRL);
+        return;
+    }
 
-    // now write the data from the buffer to the endpoint tx fifo. yes...a double copy.
-    ep_write(EP_CTRL);
+    ctrl_write_desc(desc, desc_len, req->len);
 }
 
 /**************************************************************************/
@@ -176,12 +191,19 @@ void ctrl_get_status(req_t *req)
 
 /**************************************************************************/
 /*!
-    Set the configuration. This function will call the class init callback,
-    which will setup the endpoints according to the device class.
+    Set the configuration. The endpoints are configured from the endpoint
+    table that's built alongside the configuration descriptor so the two
+    can't disagree. Then the class init callback is called to handle any
+    class specific setup.
 */
 /**************************************************************************/
 void ctrl_set_config(req_t *req)
 {
+    U8 i;
+#if (NUM_EPS > 1)
+    U8 tbl_len;
+    const usb_ep_cfg_t *tbl;
+#endif
     usb_pcb_t *pcb;
 
     ep_send_zlp(EP_CTRL);
@@ -189,14 +211,130 @@ void ctrl_set_config(req_t *req)
     pcb = usb_pcb_get();
     pcb->cfg_num = req->val;
 
+#if defined( USB_ALT_SETTINGS )
+    // setting the configuration puts all interfaces back to their default setting
+    memset(pcb->intf_alt, 0, sizeof(pcb->intf_alt));
+#endif
+
     // we only have one config for now
-    pcb->class_init();
+#if (NUM_EPS > 1) //No data endpoints to configure if we only define 1 control endpoint
+    tbl     = desc_ep_tbl_get();
+    tbl_len = desc_ep_tbl_get_len();
+    for (i=0; i<tbl_len; i++)
+    {
+        ep_config(tbl[i].ep_num, tbl[i].type, tbl[i].dir, tbl[i].size);
+    }
+#endif
+
+    for (i=0; i<pcb->num_class_drvrs; i++)
+    {
+        if (pcb->class_drvr[i]->init)
+        {
+            pcb->class_drvr[i]->init();
+        }
+    }
 
     // signal that the device is enumerated
     pcb->flags |= (1<<ENUMERATED);
 
 }
 
+#if defined( USB_ALT_SETTINGS )
+/**************************************************************************/
+/*!
+    Walk the configuration descriptor and check if it has an interface
+    descriptor with the specified interface number and alternate setting.
+*/
+/**************************************************************************/
+static bool ctrl_intf_alt_exists(U8 intf, U8 alt)
+{
+    U8 *desc = desc_cfg_get();
+    U16 i = 0, len = desc_cfg_get_len();
+    U8 desc_len;
+
+    while (i < len)
+    {
+        desc_len = hw_flash_get_byte(desc + i);
+        if (desc_len == 0)
+        {
+            break;
+        }
+
+        if ((hw_flash_get_byte(desc + i + 1) == INTF_DESCR) &&
+            (hw_flash_get_byte(desc + i + 2) == intf) &&
+            (hw_flash_get_byte(desc + i + 3) == alt))
+        {
+            return true;
+        }
+        i += desc_len;
+    }
+    return false;
+}
+
+/**************************************************************************/
+/*!
+    Return the current alternate setting of the specified interface to the host.
+*/
+/**************************************************************************/
+void ctrl_get_intf(req_t *req)
+{
+    usb_pcb_t *pcb = usb_pcb_get();
+
+    if (!(pcb->flags & (1<<ENUMERATED)) || (req->idx >= MAX_INTFS) ||
+        !ctrl_intf_alt_exists(req->idx, 0))
+    {
+        ep_set_stall(EP_CTRL);
+        return;
+    }
+
+    usb_buf_write(EP_CTRL, pcb->intf_alt[req->idx]);
+    ep_write(EP_CTRL);
+}
+
+/**************************************************************************/
+/*!
+    Select an alternate setting for an interface. The setting has to exist in
+    the configuration descriptor. Then the class gets a chance to reconfigure
+    the endpoints that belong to the interface. If the class that owns the
+    interface doesn't have a set interface callback, only the default alternate
+    setting is accepted.
+*/
+/**************************************************************************/
+void ctrl_set_intf(req_t *req)
+{
+    usb_pcb_t *pcb = usb_pcb_get();
+    const usb_class_drvr_t *drvr;
+    U8 intf = req->idx, alt = req->val;
+    bool ok;
+
+    if (!(pcb->flags & (1<<ENUMERATED)) || (req->idx >= MAX_INTFS) ||
+        !ctrl_intf_alt_exists(intf, alt))
+    {
+        ep_set_stall(EP_CTRL);
+        return;
+    }
+
+    drvr = usb_class_drvr_get(intf);
+    if (drvr && drvr->set_intf)
+    {
+        ok = drvr->set_intf(intf, alt);
+    }
+    else
+    {
+        ok = (alt == 0);
+    }
+
+    if (!ok)
+    {
+        ep_set_stall(EP_CTRL);
+        return;
+    }
+
+    pcb->intf_alt[intf] = alt;
+    ep_send_zlp(EP_CTRL);
+}
+#endif // USB_ALT_SETTINGS
+
 /**************************************************************************/
 /*!
     Set the specified feature. Currently there are only three features defined
@@ -260,39 +398,242 @@ void ctrl_clear_feat(req_t *req)
     }
 }
 
+/**************************************************************************/
+/*!
+    Abort any control transfer in progress and go back to waiting for a
+    SETUP packet. This gets called on a bus reset or when the host ends a
+    control transfer early by sending a new SETUP.
+*/
+/**************************************************************************/
+RAMFUNC void ctrl_reset()
+{
+    usb_pcb_t *pcb = usb_pcb_get();
+
+    pcb->ctrl.stage     = CTRL_STAGE_SETUP;
+    pcb->ctrl.buf       = NULL;
+    pcb->ctrl.len       = 0;
+    pcb->ctrl.count     = 0;
+    pcb->ctrl.complete  = NULL;
+}
+
+/**************************************************************************/
+/*!
+    Send the IN data stage of the current control request straight from
+    memory, one EP0 packet at a time. The transfer is cut down to req_len, the
+    length the host asked for. If less than that is sent and the last packet
+    is a full one, a zero length packet ends the transfer. This blocks until
+    the last packet has been loaded into the endpoint.
+*/
+/**************************************************************************/
+void ctrl_send_data(U8 *data, U16 len, U16 req_len, bool read_from_flash)
+{
+    U8 pkt_len;
+    bool zlp;
+
+    if (req_len < len)
+    {
+        len = req_len;
+    }
+    zlp = (len < req_len) && ((len % EP_CTRL_PKT_SZ) == 0);
+
+    while (len > 0)
+    {
+        pkt_len = (len > EP_CTRL_PKT_SZ) ? EP_CTRL_PKT_SZ : len;
+        ep_write_ctrl(data, pkt_len, read_from_flash);
+        data += pkt_len;
+        len  -= pkt_len;
+    }
+
+    if (zlp)
+    {
+        ep_write_ctrl(data, 0, read_from_flash);
+    }
+}
+
+/**************************************************************************/
+/*!
+    Start the OUT data stage of the current control request. This is called
+    by a class request handler when the request carries data from the host.
+    The data will be accumulated into buf over as many packets as needed and
+    once len bytes have arrived, the complete callback is called with the
+    original request and the status stage is acknowledged. Nothing blocks
+    here, the data is collected as it shows up in ctrl_handler().
+*/
+/**************************************************************************/
+void ctrl_recv_data(U8 *buf, U16 len, void (*complete)(req_t *req))
+{
+    usb_pcb_t *pcb = usb_pcb_get();
+
+    if (len == 0)
+    {
+        // no data stage so go straight to the status stage
+        if (complete)
+        {
+            complete((req_t *)pcb->ctrl.setup);
+        }
+        ep_send_zlp(EP_CTRL);
+        return;
+    }
+
+    pcb->ctrl.buf       = buf;
+    pcb->ctrl.len       = len;
+    pcb->ctrl.count     = 0;
+    pcb->ctrl.complete  = complete;
+    pcb->ctrl.stage     = CTRL_STAGE_DATA_OUT;
+
+    // release the setup packet so that the hardware can accept the first data packet
+    ep_clear_out_ready(EP_CTRL);
+}
+
+/**************************************************************************/
+/*!
+    Move the data from an OUT data stage packet into the buffer that was
+    registered with ctrl_recv_data(). When the last packet comes in, call the
+    completion callback and send the status stage. Otherwise release the
+    endpoint so the host can send the next packet.
+*/
+/**************************************************************************/
+static void ctrl_data_out()
+{
+    usb_pcb_t *pcb = usb_pcb_get();
+    U8 i, len;
+
+    len = pcb->fifo[EP_CTRL].len;
+    for (i=0; i<len; i++)
+    {
+        if (pcb->ctrl.count < pcb->ctrl.len)
+        {
+            pcb->ctrl.buf[pcb->ctrl.count++] = usb_buf_read(EP_CTRL);
+        }
+    }
+
+    // drain anything the host sent past wLength. the fifo needs to be empty
+    // before we release the endpoint, otherwise the isr will append to it.
+    usb_buf_clear_fifo(EP_CTRL);
+
+    // a short packet also ends the data stage
+    if ((pcb->ctrl.count < pcb->ctrl.len) && (len == EP_CTRL_PKT_SZ))
+    {
+        ep_clear_out_ready(EP_CTRL);
+        return;
+    }
+
+    pcb->ctrl.stage = CTRL_STAGE_SETUP;
+    if (pcb->ctrl.complete)
+    {
+        pcb->ctrl.complete((req_t *)pcb->ctrl.setup);
+    }
+    ep_send_zlp(EP_CTRL);
+}
+
+#if defined( USB_MSOS20 )
+/**************************************************************************/
+/*!
+    Handle the vendor requests that belong to the usb core. Right now that's
+    just the request for the Microsoft OS 2.0 descriptor set that Windows sends
+    after it finds the platform capability in the BOS descriptor. Returns 1 if
+    the request was handled, otherwise 0 so it can be passed to the class.
+*/
+/**************************************************************************/
+static U8 ctrl_vendor_req(req_t *req)
+{
+    U8 *desc;
+    U16 desc_len;
+
+    if ((req->type & DEVICE_TO_HOST) &&
+        (req->req == MS_OS_20_VENDOR_CODE) &&
+        (req->idx == MS_OS_20_DESC_INDEX))
+    {
+        desc        = desc_msos20_get();
+        desc_len    = desc_msos20_get_len();
+
+        if ((desc == NULL) || (desc_len == 0))
+        {
+            ep_set_stall(EP_CTRL);
+        }
+        else
+        {
+            ctrl_write_desc(desc, desc_len, req->len);
+        }
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/**************************************************************************/
+/*!
+    Find the class driver a class or vendor request should go to. Interface
+    and endpoint requests go to the driver that owns the interface or endpoint
+    in wIndex. Device requests go to the first driver that was registered.
+*/
+/**************************************************************************/
+static const usb_class_drvr_t *ctrl_class_drvr_get(req_t *req)
+{
+    usb_pcb_t *pcb = usb_pcb_get();
+
+    switch (req->type & RECIPIENT_MASK)
+    {
+    case RECIPIENT_INTF:
+        return usb_class_drvr_get(req->idx & 0xFF);
+
+    case RECIPIENT_EP:
+        return usb_class_drvr_get_ep(req->idx & 0x0F);
+
+    default:
+        return (pcb->num_class_drvrs) ? pcb->class_drvr[0] : NULL;
+    }
+}
+
 /**************************************************************************/
 /*!
     Handle the control requests from the host. This is the meat of the USB stack
     where the requests are divided into standard requests (handled by the USB layer)
-    or class specific (handled by the class driver). If its an unsupported request,
-    then we'll stall the endpoint.
+    or class specific (handled by the class driver that owns the interface or
+    endpoint). Vendor requests that the USB layer doesn't recognize are also
+    passed to the class driver. If its an unsupported request,
+    then we'll stall the endpoint. If we're in the middle of an OUT data stage,
+    the received data is handed off to the data stage handler instead.
 */
 /**************************************************************************/
 void ctrl_handler()
 {
     usb_pcb_t *pcb = usb_pcb_get();
-    U8 i, req[CTRL_IN_REQ_SZ];
+    U8 i, *req = pcb->ctrl.setup;
     req_t *reqp;
+    const usb_class_drvr_t *drvr;
+
+    if (pcb->ctrl.stage == CTRL_STAGE_DATA_OUT)
+    {
+        ctrl_data_out();
+        return;
+    }
 
     if(pcb->fifo[0].len < CTRL_IN_REQ_SZ)
     {
 #ifdef DEBUG_USB
       printf("USB: CTRL INVALID\n");
 #endif
+      usb_buf_clear_fifo(EP_CTRL);
       return;
     }
 
-    // read out the request from the buffers
+    // read out the request from the buffers. the request is kept in the pcb
+    // in case it has a data stage that completes later on.
     for (i=0; i<CTRL_IN_REQ_SZ; i++)
     {
         req[i] = usb_buf_read(EP_CTRL);
     }
 
+    // discard anything left over before we hand the request off. once a handler
+    // releases the setup packet, the isr can start filling the fifo again.
+    usb_buf_clear_fifo(EP_CTRL);
+
     // do a pointer overlay on the requst
     reqp = (req_t *)req;
 
     // decode the standard request
-    if (!(reqp->type & TYPE_CLASS))
+    if ((reqp->type & TYPE_MASK) == TYPE_STD)
     {
         // this is a standard request
         switch (reqp->req)
@@ -326,6 +667,23 @@ void ctrl_handler()
             ctrl_set_config(reqp);
             break;
 
+#if defined( USB_ALT_SETTINGS )
+        case GET_INTERFACE:
+            if (reqp->type & DEVICE_TO_HOST)
+            {
+                ctrl_get_intf(reqp);
+            }
+            else
+            {
+                ep_set_stall(EP_CTRL);
+            }
+            break;
+
+        case SET_INTERFACE:
+            ctrl_set_intf(reqp);
+            break;
+#endif
+
         case SET_FEATURE:
             ctrl_set_feat(reqp);
             break;
@@ -339,12 +697,20 @@ void ctrl_handler()
             break;
         }
     }
+#if defined( USB_MSOS20 )
+    else if (((reqp->type & TYPE_MASK) == TYPE_VENDOR) && ctrl_vendor_req(reqp))
+    {
+        // vendor request was handled by the usb core
+    }
+#endif
     else
     {
-        // if the class req handler has been registered, then send the packet to the req handler
-        if (pcb->class_req_handler)
+        // if a class req handler has been registered for the request's recipient,
+        // then send the packet to the req handler
+        drvr = ctrl_class_drvr_get(reqp);
+        if (drvr && drvr->req_handler)
         {
-            pcb->class_req_handler(reqp);
+            drvr->req_handler(reqp);
         }
         else
         {
@@ -352,3 +718,86 @@ void ctrl_handler()
         }
     }
 }
+
+#if defined( USB_STD_REQ_IN_ISR )
+/**************************************************************************/
+/*!
+    Called from the USB interrupt right after a packet has been read into the
+    EP0 fifo. The standard requests needed for enumeration are handled right
+    here so that enumeration doesn't have to wait for the main loop to get
+    around to calling usb_poll():
+
+    - SET_ADDRESS, GET_STATUS and GET_CONFIGURATION.
+    - GET_DESCRIPTOR, as long as the answer goes out in a single packet.
+      Anything longer, like most configuration descriptors, would have the
+      interrupt wait on the host for each packet, so it's left for
+      usb_poll().
+    - The first SET_CONFIGURATION. Nothing runs on the class endpoints
+      before it, so the class init can't get in the way of usb_poll().
+      Later ones go to usb_poll().
+
+    Class and vendor requests, the rest of the standard requests, data stage
+    packets and everything that comes in while usb_poll() is in the middle of
+    a request itself are left for usb_poll() as usual.
+*/
+/**************************************************************************/
+void ctrl_isr_handler()
+{
+    usb_pcb_t *pcb = usb_pcb_get();
+    usb_buffer_t *fifo = &pcb->fifo[EP_CTRL];
+    U8 i, setup[CTRL_IN_REQ_SZ];
+    req_t *reqp = (req_t *)setup;
+    U16 len;
+
+    if (pcb->ctrl.busy || (pcb->ctrl.stage != CTRL_STAGE_SETUP) || (fifo->len < CTRL_IN_REQ_SZ))
+    {
+        return;
+    }
+
+    // peek at the request without consuming it from the fifo
+    for (i=0; i<CTRL_IN_REQ_SZ; i++)
+    {
+        setup[i] = fifo->buf[(fifo->rd_ptr + i) % (MAX_BUF_SZ + 1)];
+    }
+
+    if (reqp->type & (TYPE_CLASS | TYPE_VENDOR))
+    {
+        return;
+    }
+
+    switch (reqp->req)
+    {
+    case GET_DESCRIPTOR:
+        // only if the whole answer goes out in one packet without a zlp
+        ctrl_desc_find(reqp->val, &len);
+        if (len > reqp->len)
+        {
+            len = reqp->len;
+        }
+        if ((len > EP_CTRL_PKT_SZ) || ((len == EP_CTRL_PKT_SZ) && (len < reqp->len)))
+        {
+            return;
+        }
+        break;
+
+    case SET_CONFIGURATION:
+        if (pcb->flags & (1<<ENUMERATED))
+        {
+            return;
+        }
+        break;
+
+    case SET_ADDRESS:
+    case GET_STATUS:
+    case GET_CONFIGURATION:
+        break;
+
+    default:
+        return;
+    }
+
+    // we're taking care of it so the main loop doesn't need to
+    pcb->flags &= ~(1<<SETUP_DATA_AVAIL);
+    ctrl_handler();
+}
+#endif
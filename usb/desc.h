@@ -0,0 +1,276 @@
+/*******************************************************************
+    Copyright (C) 2009 FreakLabs
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+    3. Neither the name of the the copyright holder nor the names of its contributors
+       may be used to endorse or promote products derived from this software
+       without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+    OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+    HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+
+    Originally written by Christopher Wang aka Akiba.
+    Please post support questions to the FreakLabs forum.
+*******************************************************************/
+/*!
+    \file desc.h
+    \ingroup usb
+
+    Descriptor builder. The class descriptor files lay out their descriptors
+    as packed structs using the types and initializer macros in here. That
+    way the compiler works out wTotalLength, bLength of the string descriptors
+    and the interface and endpoint counts instead of us keeping them in sync
+    by hand every time a descriptor gets edited.
+*/
+/*******************************************************************/
+#ifndef DESC_H
+#define DESC_H
+
+#include "types.h"
+
+#define DESC_PACKED __attribute__((packed))
+
+// split a 16-bit value into little endian bytes for byte array descriptors
+#define DESC_U16(x)         (U8)((x) & 0xFF), (U8)(((x) >> 8) & 0xFF)
+
+// max packet size in bytes from the PKTSZ_xx code used by ep_config()
+#define DESC_PKTSZ(code)    (8 << (code))
+
+// endpoint address from the endpoint number and direction
+#define DESC_EP_ADDR(num, dir)  ((num) | ((dir) << 7))
+
+// number of entries in an array member of a descriptor struct. used to fill in
+// bNumEndpoints from the endpoint array that follows an interface descriptor.
+#define DESC_COUNT(type, member)    (sizeof(((type *)0)->member) / sizeof(((type *)0)->member[0]))
+
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U16 bcdUSB;
+    U8  bDeviceClass;
+    U8  bDeviceSubClass;
+    U8  bDeviceProtocol;
+    U8  bMaxPacketSize;
+    U16 idVendor;
+    U16 idProduct;
+    U16 bcdDevice;
+    U8  iManufacturer;
+    U8  iProduct;
+    U8  iSerialNumber;
+    U8  bNumConfigurations;
+} usb_dev_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U16 bcdUSB;
+    U8  bDeviceClass;
+    U8  bDeviceSubClass;
+    U8  bDeviceProtocol;
+    U8  bMaxPacketSize;
+    U8  bNumConfigurations;
+    U8  bReserved;
+} usb_dev_qual_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U16 wTotalLength;
+    U8  bNumInterfaces;
+    U8  bConfigurationValue;
+    U8  iConfiguration;
+    U8  bmAttributes;
+    U8  bMaxPower;
+} usb_cfg_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U8  bInterfaceNumber;
+    U8  bAlternateSetting;
+    U8  bNumEndpoints;
+    U8  bInterfaceClass;
+    U8  bInterfaceSubClass;
+    U8  bInterfaceProtocol;
+    U8  iInterface;
+} usb_intf_desc_t;
+
+// interface association descriptor. groups the interfaces of one function on
+// a composite device, ie: the comm and data interfaces of a CDC.
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U8  bFirstInterface;
+    U8  bInterfaceCount;
+    U8  bFunctionClass;
+    U8  bFunctionSubClass;
+    U8  bFunctionProtocol;
+    U8  iFunction;
+} usb_iad_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U8  bEndpointAddress;
+    U8  bmAttributes;
+    U16 wMaxPacketSize;
+    U8  bInterval;
+} usb_ep_desc_t;
+
+/*
+    Initializers for the structs above. The endpoint initializer takes the same
+    (num, dir, type, size) arguments as ep_config() so the endpoint table
+    and the endpoint descriptors can be generated from a single definition, ie:
+
+    #define MY_EP_IN    EP_1, DIR_IN, XFER_BULK, MAX_PACKET_SZ
+
+    DESC_EP(MY_EP_IN, 0)        in the configuration descriptor
+    DESC_EP_CFG(MY_EP_IN)       in the endpoint table
+*/
+#define DESC_DEV(bcd_usb, cls, sub, proto, vid, pid, bcd_dev, num_cfg) \
+    { sizeof(usb_dev_desc_t), DEV_DESCR, (bcd_usb), (cls), (sub), (proto), EP_CTRL_PKT_SZ, \
+      (vid), (pid), (bcd_dev), MANUF_DESC_IDX, PROD_DESC_IDX, SERIAL_DESC_IDX, (num_cfg) }
+
+#define DESC_DEV_QUAL(bcd_usb, cls, sub, proto, num_cfg) \
+    { sizeof(usb_dev_qual_desc_t), DEV_QUAL_DESCR, (bcd_usb), (cls), (sub), (proto), EP_CTRL_PKT_SZ, (num_cfg), 0 }
+
+#define DESC_CFG(type, num_intf, cfg_val, attr, power) \
+    { sizeof(usb_cfg_desc_t), CFG_DESCR, sizeof(type), (num_intf), (cfg_val), 0, (attr), (power) }
+
+#define DESC_IAD(first, count, cls, sub, proto, str) \
+    { sizeof(usb_iad_desc_t), IAD_DESCR, (first), (count), (cls), (sub), (proto), (str) }
+
+#define DESC_INTF(num, alt, num_eps, cls, sub, proto, str) \
+    { sizeof(usb_intf_desc_t), INTF_DESCR, (num), (alt), (num_eps), (cls), (sub), (proto), (str) }
+
+#define DESC_EP(...)                        DESC_EP_(__VA_ARGS__)
+#define DESC_EP_(num, dir, type, size, interval) \
+    { sizeof(usb_ep_desc_t), EP_DESCR, DESC_EP_ADDR(num, dir), (type), DESC_PKTSZ(size), (interval) }
+
+#define DESC_EP_CFG(...)                    DESC_EP_CFG_(__VA_ARGS__)
+#define DESC_EP_CFG_(num, dir, type, size)  { (num), (type), (dir), (size) }
+
+/*
+    String descriptors are built from a string literal. The compiler does the
+    UTF-16 encoding and the length calculation.
+
+    DESC_STR(prod_str_desc, "My Product");
+*/
+#define DESC_STR(name, text) \
+    const struct DESC_PACKED \
+    { \
+        U8  bLength; \
+        U8  bDescriptorType; \
+        U16 bString[(sizeof(u"" text) / 2) - 1]; \
+    } name PROGMEM = { sizeof(u"" text), STR_DESCR, u"" text }
+
+/*
+    BOS descriptor and the Microsoft OS 2.0 descriptors. A device that reports
+    bcdUSB 0x0201 or higher gets asked for its BOS descriptor. If it carries
+    the MS OS 2.0 platform capability, Windows follows up with a vendor request
+    (bRequest = MS_OS_20_VENDOR_CODE, wIndex = MS_OS_20_DESC_INDEX) for the
+    descriptor set, which tells it to bind WinUSB without an INF file.
+*/
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U16 wTotalLength;
+    U8  bNumDeviceCaps;
+} usb_bos_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U8  bLength;
+    U8  bDescriptorType;
+    U8  bDevCapabilityType;
+    U8  bReserved;
+    U8  PlatformCapabilityUUID[16];
+    U32 dwWindowsVersion;
+    U16 wMSOSDescriptorSetTotalLength;
+    U8  bMS_VendorCode;
+    U8  bAltEnumCode;
+} usb_msos20_platform_desc_t;
+
+typedef struct DESC_PACKED
+{
+    U16 wLength;
+    U16 wDescriptorType;
+    U32 dwWindowsVersion;
+    U16 wTotalLength;
+} usb_msos20_set_hdr_t;
+
+typedef struct DESC_PACKED
+{
+    U16 wLength;
+    U16 wDescriptorType;
+    U8  CompatibleID[8];
+    U8  SubCompatibleID[8];
+} usb_msos20_compat_id_t;
+
+// registry property holding the DeviceInterfaceGUIDs value. the GUID string is
+// REG_MULTI_SZ so it's terminated by two nulls.
+typedef struct DESC_PACKED
+{
+    U16 wLength;
+    U16 wDescriptorType;
+    U16 wPropertyDataType;
+    U16 wPropertyNameLength;
+    U16 PropertyName[sizeof(u"DeviceInterfaceGUIDs") / 2];
+    U16 wPropertyDataLength;
+    U16 PropertyData[sizeof(u"{00000000-0000-0000-0000-000000000000}\0") / 2];
+} usb_msos20_guid_prop_t;
+
+#define MS_OS_20_WINDOWS_VER        0x06030000  // Windows 8.1
+#define MS_OS_20_SET_HEADER         0x00
+#define MS_OS_20_FEATURE_COMPAT_ID  0x03
+#define MS_OS_20_FEATURE_REG_PROP   0x04
+#define MS_OS_20_REG_MULTI_SZ       0x07
+
+#define DESC_BOS(type, num_caps) \
+    { sizeof(usb_bos_desc_t), BOS_DESCR, sizeof(type), (num_caps) }
+
+// {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F}
+#define DESC_MSOS20_PLATFORM(set_len) \
+    { sizeof(usb_msos20_platform_desc_t), DEV_CAP_DESCR, DEV_CAP_PLATFORM, 0, \
+      { 0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C, \
+        0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F }, \
+      MS_OS_20_WINDOWS_VER, (set_len), MS_OS_20_VENDOR_CODE, 0 }
+
+#define DESC_MSOS20_SET_HDR(type) \
+    { sizeof(usb_msos20_set_hdr_t), MS_OS_20_SET_HEADER, MS_OS_20_WINDOWS_VER, sizeof(type) }
+
+#define DESC_MSOS20_WINUSB \
+    { sizeof(usb_msos20_compat_id_t), MS_OS_20_FEATURE_COMPAT_ID, "WINUSB", { 0 } }
+
+// guid is a string literal in registry format, ie: "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}"
+#define DESC_MSOS20_GUID(guid) \
+    { sizeof(usb_msos20_guid_prop_t), MS_OS_20_FEATURE_REG_PROP, MS_OS_20_REG_MULTI_SZ, \
+      sizeof(((usb_msos20_guid_prop_t *)0)->PropertyName), u"DeviceInterfaceGUIDs", \
+      sizeof(((usb_msos20_guid_prop_t *)0)->PropertyData), u"" guid "\0" }
+
+#endif // DESC_H
@@ -42,9 +42,13 @@
 #include <string.h>
 #include <stdio.h>
 #include "types.h"
+#include "desc.h"
 
-// class specific
-#if defined( USE_CDC_CLASS )
+// class specific. a composite device supplies usb_composite.h, which sets
+// NUM_EPS and pulls in the headers of the classes it's made of.
+#if defined( USE_COMPOSITE )
+#include "usb_composite.h"
+#elif defined( USE_CDC_CLASS )
 #include "cdc.h"
 #elif defined( USE_DFU_CLASS )
 #include "dfu.h"
@@ -53,6 +57,12 @@
 // hw specific
 #include "hw.h"
 
+// the hw layer marks what the usb interrupt needs while flash is being
+// written with RAMFUNC. it's nothing on parts that don't need it.
+#ifndef RAMFUNC
+#define RAMFUNC
+#endif
+
 // packet sizes
 #define PKTSZ_8         0
 #define PKTSZ_16        1
@@ -93,6 +103,18 @@
 #   endif
 #endif
 
+// ep0 max packet size. this is bMaxPacketSize0 in the device descriptor and
+// what the control transfers get split on. ports that configure ep0 smaller
+// than the other endpoints override it in their hw.h.
+#ifndef EP_CTRL_PKT_SZ
+#   define EP_CTRL_PKT_SZ  MAX_BUF_SZ
+#   define EP_CTRL_PKTSZ   MAX_PACKET_SZ
+#endif
+
+#if (EP_CTRL_PKT_SZ > MAX_BUF_SZ)
+#   error "EP_CTRL_PKT_SZ can't be bigger than the endpoint fifo (MAX_BUF_SZ)"
+#endif
+
 // config
 #define FLASHMEM            PROGMEM     ///< AVR Specific for storing data in flash
 #define MAX_RX_ENTRIES      5
@@ -100,6 +122,27 @@
 #define POWER_SRC           BUS_POWERED
 #define MAX_REQUEST_SIZE    32
 #define CTRL_IN_REQ_SZ      8
+#define MAX_INTFS           4           ///< Max number of interfaces we track alternate settings for
+#define MAX_CLASS_DRVRS     4           ///< Max number of class drivers on a composite device
+#define MS_OS_20_VENDOR_CODE    0x20    ///< bRequest used by the host to fetch the MS OS 2.0 descriptor set
+
+// define USB_STD_REQ_IN_ISR (ie: in the makefile CFLAGS) to have
+// SET_ADDRESS, GET_STATUS, GET_CONFIGURATION, the first SET_CONFIGURATION and
+// GET_DESCRIPTOR requests handled directly in the USB interrupt instead of
+// waiting for usb_poll(). a GET_DESCRIPTOR only gets handled there if the
+// answer fits in one EP0 packet (EP_CTRL_PKT_SZ). longer ones, like the
+// configuration descriptor of a composite device, still wait for usb_poll().
+// class and vendor requests are always handled from usb_poll().
+
+// define USB_MSOS20 (ie: in the makefile CFLAGS) to serve the class's BOS
+// descriptor and answer the MS_OS_20_VENDOR_CODE request with its MS OS 2.0
+// descriptor set, so Windows binds WinUSB without an INF file. without it,
+// BOS requests are stalled and vendor requests all go to the class.
+
+// define USB_ALT_SETTINGS (ie: in the makefile CFLAGS) to have SET_INTERFACE
+// and GET_INTERFACE handled, for classes with alternate settings. without
+// it, they're stalled like any other unsupported request, which USB allows
+// for interfaces that only have their default setting.
 
 // eps
 #define EP_CTRL         0
@@ -148,6 +191,9 @@
 #define INTF_DESCR          4
 #define EP_DESCR            5
 #define DEV_QUAL_DESCR      6
+#define IAD_DESCR           11
+#define BOS_DESCR           15
+#define DEV_CAP_DESCR       16
 #define DFU_FUNC_DESCR      33
 
 // request types
@@ -156,9 +202,11 @@
 #define TYPE_STD            0x00
 #define TYPE_CLASS          0x20
 #define TYPE_VENDOR         0x40
+#define TYPE_MASK           0x60
 #define RECIPIENT_DEV       0x00
 #define RECIPIENT_INTF      0x01
 #define RECIPIENT_EP        0x02
+#define RECIPIENT_MASK      0x1F
 
 // get status requests
 #define GET_DEVICE_STATUS   0x80
@@ -171,6 +219,12 @@
 #define PROD_DESC_IDX       2
 #define SERIAL_DESC_IDX     3
 
+// device capability types
+#define DEV_CAP_PLATFORM    5
+
+// ms os 2.0 vendor request index
+#define MS_OS_20_DESC_INDEX 7
+
 // control features
 #define ENDPOINT_HALT       0
 #define REMOTE_WAKEUP       1
@@ -182,6 +236,20 @@
 #define REMOTE_WAKEUP_ENB   3
 #define ENUMERATED          4
 
+// events the usb interrupt posts for usb_wait_event()
+#define USB_EVT_NONE        0
+#define USB_EVT_SETUP       1           ///< Setup or control data stage packet received
+#define USB_EVT_RX          2           ///< Data received on an OUT endpoint
+#define USB_EVT_TX          3           ///< An IN endpoint has room for more data
+#define USB_EVT_SUSPEND     4
+#define USB_EVT_RESUME      5
+#define USB_EVT_RESET       6
+#define USB_EVT_QUEUE_SZ    8           ///< Must be a power of 2
+
+// control transfer stages
+#define CTRL_STAGE_SETUP    0
+#define CTRL_STAGE_DATA_OUT 1
+
 // power sources
 #define SELF_POWERED        1
 #define BUS_POWERED         0
@@ -197,6 +265,16 @@ typedef struct req_t
     U8 data[];
 } req_t;
 
+// endpoint table entry. the class descriptor file generates a table of these
+// from the same definitions as its endpoint descriptors.
+typedef struct _usb_ep_cfg_t
+{
+    U8 ep_num;
+    U8 type;
+    U8 dir;
+    U8 size;
+} usb_ep_cfg_t;
+
 // buffer used for circular fifo
 typedef struct _usb_buffer_t
 {
@@ -207,7 +285,36 @@ typedef struct _usb_buffer_t
     U8 buf[(MAX_BUF_SZ + 1)];
 } usb_buffer_t;
 
+// control transfer state. this tracks an OUT data stage that is being
+// accumulated into a class supplied buffer across multiple packets.
+typedef struct _usb_ctrl_t
+{
+    volatile U8 stage;
+    volatile bool busy;             ///< usb_poll() is handling a request, keep the isr out of it
+    U8 setup[CTRL_IN_REQ_SZ];
+    U8 *buf;
+    U16 len;
+    U16 count;
+    void (*complete)(req_t *req);
+} usb_ctrl_t;
+
 // protocol control block
+/*
+    Class driver. Each class driver on the device owns a range of interfaces
+    and a set of endpoints. Class and vendor requests are routed to the driver
+    that owns the interface or endpoint in wIndex.
+*/
+typedef struct _usb_class_drvr_t
+{
+    U8 intf;                                ///< First interface owned by the driver
+    U8 num_intfs;                           ///< Number of interfaces owned by the driver
+    U8 ep_mask;                             ///< Bit n is set if the driver owns endpoint n
+    void (*init)();                         ///< Called on SET_CONFIGURATION
+    void (*req_handler)(req_t *req);        ///< Class and vendor requests
+    void (*rx_handler)();                   ///< Called when rx data is available
+    bool (*set_intf)(U8 intf, U8 alt);      ///< Optional. Alternate setting selected
+} usb_class_drvr_t;
+
 typedef struct _usb_pcb_t
 {
     bool connected;
@@ -218,24 +325,38 @@ typedef struct _usb_pcb_t
     U8 pending_data;
     U8 test;
     usb_buffer_t fifo[NUM_EPS];
-    void (*class_init)();
-    void (*class_req_handler)(req_t *req);
-    void (*class_rx_handler)();
+    usb_ctrl_t ctrl;
+    U8 intf_alt[MAX_INTFS];
+    const usb_class_drvr_t *class_drvr[MAX_CLASS_DRVRS];
+    U8 num_class_drvrs;
 } usb_pcb_t;
 
 // prototypes
 
 // usb.c
 void usb_init();
-usb_pcb_t *usb_pcb_get();
+RAMFUNC usb_pcb_t *usb_pcb_get();
 void usb_reg_class_drvr(void (*class_cfg_init)(),
                         void (*class_req_handler)(),
                         void (*class_rx_handler)());
+void usb_reg_class_set_intf(bool (*class_set_intf)(U8 intf, U8 alt));
+bool usb_reg_class(const usb_class_drvr_t *drvr);
+const usb_class_drvr_t *usb_class_drvr_get(U8 intf);
+const usb_class_drvr_t *usb_class_drvr_get_ep(U8 ep_num);
 void usb_poll();
+RAMFUNC void usb_evt_post(U8 evt);
+U8 usb_evt_get();
+U8 usb_wait_event();
 bool usb_ready();
 
 // req.c
 void ctrl_handler();
+RAMFUNC void ctrl_reset();
+void ctrl_recv_data(U8 *buf, U16 len, void (*complete)(req_t *req));
+void ctrl_send_data(U8 *data, U16 len, U16 req_len, bool read_from_flash);
+#if defined( USB_STD_REQ_IN_ISR )
+void ctrl_isr_handler();
+#endif
 
 // ep.c
 void ep_init();
@@ -243,34 +364,42 @@ void ep_select(U8 ep_num);
 void ep_write_from_flash(U8 ep_num, U8 *data, U8 len);
 void ep_write(U8 ep_num);
 void ep_write_ctrl(U8 *data, U8 len, bool read_from_flash);
-void ep_read(U8 ep_num);
+RAMFUNC void ep_read(U8 ep_num);
+void ep_clear_out_ready(U8 ep_num);
 void ep_set_addr(U8 addr);
 U8 ep_intp_get_num();
 U8 ep_intp_get_src();
 void ep_set_stall(U8 ep_num);
-void ep_clear_stall(U8 ep_num);
+RAMFUNC void ep_clear_stall(U8 ep_num);
 void ep_reset_toggle(U8 ep_num);
 void ep_send_zlp(U8 ep_num);
 void ep_config(U8 ep_num, U8 type, U8 dir, U8 size);
+void ep_disable(U8 ep_num);
 void ep_drain_fifo(U8 ep);
 
 // desc.c
 U8 *desc_dev_get();
 U8 desc_dev_get_len();
 U8 *desc_cfg_get();
-U8 desc_cfg_get_len();
+U16 desc_cfg_get_len();
+const usb_ep_cfg_t *desc_ep_tbl_get();
+U8 desc_ep_tbl_get_len();
 U8 *desc_dev_qual_get();
 U8 *desc_dfu_func_get();
 U8 desc_dev_qual_get_len();
 U8 desc_dfu_func_get_len();
 U8 *desc_str_get(U8 index);
 U8 desc_str_get_len(U8 index);
+U8 *desc_bos_get();
+U16 desc_bos_get_len();
+U8 *desc_msos20_get();
+U16 desc_msos20_get_len();
 
 // buf
 void usb_buf_init(U8 ep_num, U8 ep_dir);
 U8 usb_buf_read(U8 ep_num);
-U8 usb_buf_write(U8 ep_num, U8 data);
-void usb_buf_clear_fifo(U8 ep_num);
+RAMFUNC U8 usb_buf_write(U8 ep_num, U8 data);
+RAMFUNC void usb_buf_clear_fifo(U8 ep_num);
 U8 usb_buf_data_pending(U8 ep_dir);
 U8 usb_buf_space(U8 ep_num);
 
@@ -46,6 +46,15 @@
 
 static usb_pcb_t pcb;
 
+// driver used when a single class registers itself with usb_reg_class_drvr()
+static usb_class_drvr_t single_drvr;
+
+// event queue. only the usb interrupt moves evt_wr and only the main loop
+// moves evt_rd, so neither side has to lock the other out.
+static volatile U8 evt_queue[USB_EVT_QUEUE_SZ];
+static volatile U8 evt_wr;
+static volatile U8 evt_rd;
+
 /**************************************************************************/
 /*!
     Initialize the USB stack. Actually, we just clear out the protocol control
@@ -62,23 +71,190 @@ void usb_init()
     Get a pointer to the USB stack's protocol control block.
 */
 /**************************************************************************/
-usb_pcb_t *usb_pcb_get()
+RAMFUNC usb_pcb_t *usb_pcb_get()
 {
     return &pcb;
 }
 
 /**************************************************************************/
 /*!
-    Register the class driver
+    Register the class driver. This is for devices made of a single class.
+    The class owns every interface and endpoint on the device. Composite
+    devices register each of their class drivers with usb_reg_class() instead.
 */
 /**************************************************************************/
 void usb_reg_class_drvr(void (*class_init)(),
                         void (*class_req_handler)(req_t *req),
                         void (*class_rx_handler)())
 {
-    pcb.class_req_handler   = class_req_handler;
-    pcb.class_init          = class_init;
-    pcb.class_rx_handler    = class_rx_handler;
+    single_drvr.intf        = 0;
+    single_drvr.num_intfs   = MAX_INTFS;
+    single_drvr.ep_mask     = 0xFF;
+    single_drvr.init        = class_init;
+    single_drvr.req_handler = class_req_handler;
+    single_drvr.rx_handler  = class_rx_handler;
+
+    pcb.class_drvr[0]       = &single_drvr;
+    pcb.num_class_drvrs     = 1;
+}
+
+/**************************************************************************/
+/*!
+    Register the class driver's set interface callback. This is optional and
+    only needed by classes with alternate settings. The callback gets the
+    interface number and the alternate setting the host selected. It should
+    reconfigure or disable the interface's endpoints to match the alternate
+    setting and return true, or return false to reject it.
+*/
+/**************************************************************************/
+void usb_reg_class_set_intf(bool (*class_set_intf)(U8 intf, U8 alt))
+{
+    single_drvr.set_intf = class_set_intf;
+}
+
+/**************************************************************************/
+/*!
+    Add a class driver to a composite device. The driver struct isn't copied
+    so it needs to stay around, ie: a const in flash. Returns false if the
+    driver table is full.
+*/
+/**************************************************************************/
+bool usb_reg_class(const usb_class_drvr_t *drvr)
+{
+    if (pcb.num_class_drvrs >= MAX_CLASS_DRVRS)
+    {
+        return false;
+    }
+
+    pcb.class_drvr[pcb.num_class_drvrs++] = drvr;
+    return true;
+}
+
+/**************************************************************************/
+/*!
+    Return the class driver that owns the specified interface or NULL if
+    there isn't one.
+*/
+/**************************************************************************/
+const usb_class_drvr_t *usb_class_drvr_get(U8 intf)
+{
+    U8 i;
+    const usb_class_drvr_t *drvr;
+
+    for (i=0; i<pcb.num_class_drvrs; i++)
+    {
+        drvr = pcb.class_drvr[i];
+        if ((intf >= drvr->intf) && (intf < (drvr->intf + drvr->num_intfs)))
+        {
+            return drvr;
+        }
+    }
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Return the class driver that owns the specified endpoint or NULL if
+    there isn't one.
+*/
+/**************************************************************************/
+const usb_class_drvr_t *usb_class_drvr_get_ep(U8 ep_num)
+{
+    U8 i;
+
+    for (i=0; i<pcb.num_class_drvrs; i++)
+    {
+        if (pcb.class_drvr[i]->ep_mask & (1 << ep_num))
+        {
+            return pcb.class_drvr[i];
+        }
+    }
+    return NULL;
+}
+
+/**************************************************************************/
+/*!
+    Post an event from the usb interrupt. If the queue is full the event is
+    dropped. The pcb flags still say what needs doing, so usb_poll() won't
+    miss anything, only the reason for the wakeup is lost.
+*/
+/**************************************************************************/
+RAMFUNC void usb_evt_post(U8 evt)
+{
+    U8 next = (evt_wr + 1) & (USB_EVT_QUEUE_SZ - 1);
+
+    if (next != evt_rd)
+    {
+        evt_queue[evt_wr] = evt;
+        evt_wr = next;
+    }
+}
+
+/**************************************************************************/
+/*!
+    Take the oldest event off the queue. Returns USB_EVT_NONE if it's empty.
+    Only call it from the main loop.
+*/
+/**************************************************************************/
+U8 usb_evt_get()
+{
+    U8 evt;
+
+    if (evt_rd == evt_wr)
+    {
+        return USB_EVT_NONE;
+    }
+
+    evt = evt_queue[evt_rd];
+    evt_rd = (evt_rd + 1) & (USB_EVT_QUEUE_SZ - 1);
+    return evt;
+}
+
+/**************************************************************************/
+/*!
+    Return true if usb_poll() has something to do.
+*/
+/**************************************************************************/
+static bool usb_work_pending()
+{
+    U8 mask = (1<<SETUP_DATA_AVAIL);
+
+    if (!pcb.connected)
+    {
+        return false;
+    }
+
+    // rx and tx data only get handled once we're enumerated
+    if (pcb.flags & (1<<ENUMERATED))
+    {
+        mask |= (1<<RX_DATA_AVAIL) | (1<<TX_DATA_AVAIL);
+    }
+    return (pcb.flags & mask) || pcb.pending_data;
+}
+
+/**************************************************************************/
+/*!
+    Sleep until an interrupt comes in, unless there's already an event or
+    usb_poll() work waiting. Returns the oldest event, or USB_EVT_NONE if
+    something other than the usb woke us up. Call it in the main loop ahead
+    of usb_poll() instead of spinning on usb_poll().
+*/
+/**************************************************************************/
+U8 usb_wait_event()
+{
+    U8 evt;
+
+    // the interrupts are off while deciding so one can't come in between
+    // the check and the sleep. hw_sleep() still wakes up on it and returns
+    // with the interrupts back on.
+    hw_intp_disable();
+    if (((evt = usb_evt_get()) == USB_EVT_NONE) && !usb_work_pending())
+    {
+        hw_sleep();
+        return usb_evt_get();
+    }
+    hw_intp_enable();
+    return evt;
 }
 
 /**************************************************************************/
@@ -92,6 +268,11 @@ void usb_poll()
 {
     U8 i, ep_num;
 
+    if (!usb_work_pending())
+    {
+        return;
+    }
+
     if (pcb.connected)
     {
         // if any setup data is pending, send it to the ctrl handler. we operate
@@ -99,13 +280,18 @@ void usb_poll()
         // operations easier because we can just do a pointer overlay on the buffer.
         if (pcb.flags & (1<<SETUP_DATA_AVAIL))
         {
-            // clear the setup flag at the very beginning. later on, we can wait
-            // on this flag if there are data stages to the setup transaction.
+            // clear the setup flag at the very beginning. if the request has a
+            // data stage, the flag will get set again as each data packet arrives.
+            // the isr can handle requests too, so mark the ctrl state as ours first.
+            hw_intp_disable();
+            pcb.ctrl.busy = true;
             pcb.flags &= ~(1<<SETUP_DATA_AVAIL);
+            hw_intp_enable();
 
-            // handle the request
+            // handle the request or the data stage packet. the ctrl handler
+            // empties the fifo itself before releasing the endpoint.
             ctrl_handler();
-            usb_buf_clear_fifo(EP_CTRL);
+            pcb.ctrl.busy = false;
         }
 
         // check the pending data flags to see if we received any data in the USB rx fifos.
@@ -127,13 +313,19 @@ void usb_poll()
             // if any rx data is pending, send it to the rx handler
             if (pcb.flags & (1<<RX_DATA_AVAIL))
             {
-                if (pcb.class_rx_handler)
+                // each class driver checks its own endpoints for data
+                for (i=0; i<pcb.num_class_drvrs; i++)
                 {
-                    pcb.class_rx_handler();
+                    if (pcb.class_drvr[i]->rx_handler)
+                    {
+                        pcb.class_drvr[i]->rx_handler();
+                    }
                 }
 
                 // clear the rx data avail flag now that we're done processing the rx data.
+                hw_intp_disable();
                 pcb.flags &= ~(1 << RX_DATA_AVAIL);
+                hw_intp_enable();
             }
 
             // if any tx data is pending, send it to the endpoint fifo
@@ -83,7 +83,7 @@ U8 usb_buf_read(U8 ep_num)
     will roll over to zero.
 */
 /**************************************************************************/
-U8 usb_buf_write(U8 ep_num, U8 data)
+RAMFUNC U8 usb_buf_write(U8 ep_num, U8 data)
 {
     usb_pcb_t *pcb = usb_pcb_get();
 
@@ -109,7 +109,7 @@ U8 usb_buf_space(U8 ep_num)
     Clear the fifo read and write pointers and set the length to zero.
 */
 /**************************************************************************/
-void usb_buf_clear_fifo(U8 ep_num)
+RAMFUNC void usb_buf_clear_fifo(U8 ep_num)
 {
     usb_pcb_t *pcb = usb_pcb_get();
 
@@ -132,7 +132,7 @@ U8 usb_buf_data_pending(U8 ep_dir)
     usb_pcb_t *pcb = usb_pcb_get();
 
     // start from ep 1 since we aren't checking the ctrl ep
-    for (i=1; i<(NUM_EPS+1); i++)
+    for (i=1; i<NUM_EPS; i++)
     {
         if ((pcb->fifo[i].ep_dir == ep_dir) && (pcb->fifo[i].len != 0))
         {